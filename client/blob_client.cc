@@ -1,7 +1,12 @@
 #include "blob_client.h"
 #include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "absl/status/status.h"
 #include "protos/blobstore.grpc.pb.h"
@@ -12,11 +17,56 @@ using grpc::ClientContext;
 using grpc::Status;
 using blobstore::BlobStore;
 
+// Rejections in a row after which a request fails, and the longest wait
+// between two of them.
+#define MAX_OVERLOAD_RETRIES 32
+#define MAX_BACKOFF_US 1000000
+// Read latencies the hedge delay is derived from, how many it takes before
+// reads are hedged, and how often the delay is recomputed.
+#define HEDGE_LATENCY_SAMPLES 512
+#define HEDGE_MIN_SAMPLES 64
+#define HEDGE_REFRESH_SAMPLES 32
+// Hedges the budget can save up for a burst of slow reads.
+#define HEDGE_MAX_TOKENS 10.0
+// Deadline of a call unless setDeadline() says otherwise; range reads get
+// it once more for every RANGE_DEADLINE_BYTES they cover.
+#define DEFAULT_DEADLINE_MS 5000
+#define RANGE_DEADLINE_BYTES (1 << 20)
+// Wait before the second failover in a row, doubling up to the maximum.
+#define FAILOVER_BACKOFF_US 20000
+#define MAX_FAILOVER_BACKOFF_US 1000000
+
+// Last primary any client of a pair of servers in this process talked to,
+// so that new clients start there instead of at server1.
+static std::mutex primary_cache_mutex;
+static std::unordered_map<std::string, std::string> primary_cache;
+
 BlobClient::BlobClient(const std::string &server1_address, const std::string &server2_address, const int max_retry_count)
     : server1_address_(server1_address), server2_address_(server2_address), max_retry_count_(max_retry_count) {
   retry_count_ = 0;
+  overload_count_ = 0;
+  backoffs_ = 0;
+  rng_.seed(std::random_device()());
+  hedge_percentile_ = 0;
+  hedge_budget_ = 0;
+  hedge_tokens_ = 0;
+  next_latency_ = 0;
+  hedge_delay_us_ = 0;
+  hedges_ = 0;
+  hedge_wins_ = 0;
+  replication_seq_ = 0;
+  deadline_ms_ = DEFAULT_DEADLINE_MS;
+  clientStub_ = nullptr;
   // Default primary server is the first server
   primary_address_ = server1_address_;
+  {
+    std::lock_guard<std::mutex> lock(primary_cache_mutex);
+    auto it = primary_cache.find(server1_address_ + "," + server2_address_);
+    if (it != primary_cache.end()) {
+      primary_address_ = it->second;
+    }
+  }
+  known_primary_ = primary_address_;
   log_prefix_ = "\t[ClientLib]: ";
 }
 
@@ -26,13 +76,216 @@ void BlobClient::changePrimary(){
   } else {
     primary_address_ = server1_address_;
   }
+  if (clientStub_) {
+    clientStub_ = stubFor(primary_address_);
+  }
+}
+
+// Where a backup said the primary is.
+void BlobClient::redirect(const std::string &primary_ip) {
+  primary_address_ = primary_ip;
+  clientStub_ = stubFor(primary_address_);
+}
+
+const std::string &BlobClient::otherAddress() const {
+  return primary_address_ == server1_address_ ? server2_address_ : server1_address_;
+}
+
+// Channels are created once per address and kept; a new one starts
+// connecting right away rather than on its first call.
+BlobStore::Stub *BlobClient::stubFor(const std::string &address) {
+  std::unique_ptr<BlobStore::Stub> &stub = stubs_[address];
+  if (!stub) {
+    std::shared_ptr<Channel> channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+    channel->GetState(true);
+    stub = BlobStore::NewStub(channel);
+  }
+  return stub.get();
+}
+
+void BlobClient::setDeadline(int deadline_ms) {
+  deadline_ms_ = deadline_ms;
+}
+
+void BlobClient::applyDeadline(ClientContext &context, int64_t scale) {
+  if (deadline_ms_ > 0) {
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_ms_ * scale));
+  }
+}
+
+// After a successful call: share the server that answered with the other
+// clients of this process.
+void BlobClient::rememberPrimary() {
+  if (primary_address_ == known_primary_) {
+    return;
+  }
+  known_primary_ = primary_address_;
+  std::lock_guard<std::mutex> lock(primary_cache_mutex);
+  primary_cache[server1_address_ + "," + server2_address_] = primary_address_;
+}
+
+// After a failed call: moves to the other server (unless switch_server is
+// false) and returns true once the next attempt may go out. The first
+// failover is immediate, as the other server is likely fine; further ones
+// back off exponentially, with jitter. False, and retry_count_ reset, after
+// max_retry_count_ failures in a row.
+bool BlobClient::failOver(const Status &status, const char *message, bool switch_server) {
+  fprintf(stderr, "%s %d: %s\n", log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
+  fprintf(stderr, "%s %s. Retrying ...\n", log_prefix_.c_str(), message);
+
+  retry_count_++;
+  if (retry_count_ >= max_retry_count_) {
+    // Error on reaching max retry count and reset retry_count_
+    retry_count_ = 0;
+    return false;
+  }
+  if (switch_server) {
+    changePrimary();
+  }
+  if (retry_count_ > 1) {
+    int64_t delay_us = std::min<int64_t>(MAX_FAILOVER_BACKOFF_US,
+                                         (int64_t)FAILOVER_BACKOFF_US << std::min(retry_count_ - 2, 10));
+    delay_us = delay_us / 2 + rng_() % (delay_us / 2 + 1);
+    std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+  }
+  return true;
 }
 
-// Connect to server
+// An overloaded server rejects requests with RESOURCE_EXHAUSTED and says
+// when to come back. Wait that long, doubled for each rejection in a row and
+// jittered so that the rejected clients do not all return at once. False for
+// other errors, and when the request should fail instead.
+bool BlobClient::backOff(const ClientContext &context, const Status &status) {
+  if (status.error_code() != grpc::StatusCode::RESOURCE_EXHAUSTED) {
+    return false;
+  }
+  if (overload_count_ >= MAX_OVERLOAD_RETRIES) {
+    overload_count_ = 0;
+    return false;
+  }
+  int64_t retry_after_ms = 1;
+  auto trailers = context.GetServerTrailingMetadata();
+  auto it = trailers.find(RETRY_AFTER_METADATA_KEY);
+  if (it != trailers.end()) {
+    retry_after_ms = std::max<int64_t>(1, atoll(std::string(it->second.data(), it->second.size()).c_str()));
+  }
+  int64_t delay_us = std::min<int64_t>(MAX_BACKOFF_US, (retry_after_ms * 1000) << std::min(overload_count_, 4));
+  delay_us = delay_us / 2 + rng_() % (delay_us / 2 + 1);
+  overload_count_++;
+  backoffs_++;
+  std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+  return true;
+}
+
+// Connect to both servers; requests go to the primary.
 void BlobClient::connect() {
   fprintf(stderr, "%s Connecting to server %s\n", log_prefix_.c_str(), primary_address_.c_str());
-  clientStub_ = BlobStore::NewStub(grpc::CreateChannel(
-      primary_address_, grpc::InsecureChannelCredentials()));
+  stubFor(otherAddress());
+  clientStub_ = stubFor(primary_address_);
+}
+
+void BlobClient::setHedging(double percentile, double budget) {
+  hedge_percentile_ = percentile;
+  hedge_budget_ = budget;
+}
+
+void BlobClient::recordReadLatency(double us) {
+  if (read_latencies_us_.size() < HEDGE_LATENCY_SAMPLES) {
+    read_latencies_us_.push_back(us);
+  } else {
+    read_latencies_us_[next_latency_] = us;
+  }
+  next_latency_ = (next_latency_ + 1) % HEDGE_LATENCY_SAMPLES;
+  if (read_latencies_us_.size() >= HEDGE_MIN_SAMPLES && next_latency_ % HEDGE_REFRESH_SAMPLES == 0) {
+    std::vector<double> sorted(read_latencies_us_);
+    size_t idx = std::min(sorted.size() - 1, (size_t)(hedge_percentile_ * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+    hedge_delay_us_ = sorted[idx];
+  }
+}
+
+// Sends request to the server at hand. With hedging on, a read it has not
+// answered after hedge_delay_us_ goes to the other server as well; the first
+// successful answer is returned and the other call cancelled. If neither
+// succeeds, the first server's status is returned.
+Status BlobClient::callRead(ClientContext &context, const blobstore::ReadRequest &request,
+                            blobstore::ReadResponse *response) {
+  auto start = std::chrono::system_clock::now();
+  auto elapsed_us = [start]() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now() - start).count() /
+           1000.0;
+  };
+  if (hedge_percentile_ <= 0 || Utils::get_crash_type(request.address()) != CrashType::NO_CRASH) {
+    Status status = clientStub_->Read(&context, request, response);
+    if (status.ok() && hedge_percentile_ > 0) {
+      recordReadLatency(elapsed_us());
+    }
+    return status;
+  }
+  hedge_tokens_ = std::min(HEDGE_MAX_TOKENS, hedge_tokens_ + hedge_budget_);
+  bool may_hedge = hedge_delay_us_ > 0 && hedge_tokens_ >= 1;
+
+  // Tags: 1 the first call, 2 the hedge.
+  grpc::CompletionQueue cq;
+  Status status;
+  auto rpc = clientStub_->AsyncRead(&context, request, &cq);
+  rpc->Finish(response, &status, (void *)1);
+  int pending = 1;
+
+  ClientContext hedge_context;
+  applyDeadline(hedge_context);
+  blobstore::ReadRequest hedge_request(request);
+  hedge_request.set_hedge(true);
+  hedge_request.set_min_seq(replication_seq_);
+  blobstore::ReadResponse hedge_response;
+  Status hedge_status;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<blobstore::ReadResponse>> hedge_rpc;
+
+  int winner = 0;
+  auto hedge_at = start + std::chrono::microseconds((int64_t)hedge_delay_us_);
+  while (pending > 0) {
+    void *tag;
+    bool ok;
+    if (may_hedge && !hedge_rpc) {
+      if (cq.AsyncNext(&tag, &ok, hedge_at) == grpc::CompletionQueue::TIMEOUT) {
+        hedge_tokens_ -= 1;
+        hedges_++;
+        hedge_rpc = stubFor(otherAddress())->AsyncRead(&hedge_context, hedge_request, &cq);
+        hedge_rpc->Finish(&hedge_response, &hedge_status, (void *)2);
+        pending++;
+        continue;
+      }
+    } else {
+      cq.Next(&tag, &ok);
+    }
+    pending--;
+    if (winner != 0) {
+      continue;
+    }
+    if (tag == (void *)1 && status.ok()) {
+      winner = 1;
+      if (pending > 0) {
+        hedge_context.TryCancel();
+      }
+    } else if (tag == (void *)2 && hedge_status.ok()) {
+      winner = 2;
+      hedge_wins_++;
+      if (pending > 0) {
+        context.TryCancel();
+      }
+    } else if (tag == (void *)1 && !hedge_rpc) {
+      // Failed before a hedge went out; the caller handles it.
+      may_hedge = false;
+    }
+  }
+  if (winner == 0) {
+    return status;
+  }
+  recordReadLatency(elapsed_us());
+  if (winner == 2) {
+    *response = std::move(hedge_response);
+  }
+  return Status::OK;
 }
 
 // Read from server
@@ -42,99 +295,298 @@ int BlobClient::read(int64_t address, std::string &data) {
     return -1;
   }
 
-  ClientContext context;
-  blobstore::ReadRequest request;
-  request.set_address(address);
+  while (true) {
+    ClientContext context;
+    applyDeadline(context);
+    blobstore::ReadRequest request;
+    request.set_address(address);
 
-  blobstore::ReadResponse response;
-  Status status = clientStub_->Read(&context, request, &response);
-  if (status.ok()) {
-    // reset retry_count_ on success
-    retry_count_ = 0;
+    blobstore::ReadResponse response;
+    Status status = callRead(context, request, &response);
+    if (status.ok()) {
+      // reset retry_count_ on success
+      retry_count_ = 0;
+      overload_count_ = 0;
 
-    if(response.status() == "FAILURE") {
-      primary_address_ = response.primary_ip();
-      connect();
-      return read(address, data);
-    } else if (response.status() == "UNAVAILABLE") {
-      return read(address, data);
-    } else {
+      if(response.status() == "FAILURE") {
+        redirect(response.primary_ip());
+        continue;
+      } else if (response.status() == "UNAVAILABLE") {
+        continue;
+      }
+      rememberPrimary();
       data = response.data();
       return data.size();
     }
-  } else {
-    fprintf(stderr, "%s %d: %s\n", log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
-    fprintf(stderr, "%s Failed to read from server. Retrying ...\n", log_prefix_.c_str());
-    
-    retry_count_++;
-    if (retry_count_ >= max_retry_count_) {
-      // Error on reaching max retry count and reset retry_count_
-      retry_count_ = 0;
-      return -1;
+    if (backOff(context, status)) {
+      continue;
     }
-    
     // Change primary server and retry for each failure
-    changePrimary();
-    connect();
+    if (!failOver(status, "Failed to read from server")) {
+      return -1;
+    }
 
     // If this read request had a crash address, retry with correct address
     if(Utils::get_crash_type(address) != CrashType::NO_CRASH) {
       address = Utils::get_address(address);
     }
-    
-    return read(address, data); // can cause stack overflow if retry_count_ is too high
   }
 }
 
 // Write to server
-int BlobClient::write(int64_t address, std::string data) {
+int BlobClient::write(int64_t address, std::string data, blobstore::Durability durability) {
   if (!clientStub_) {
     fprintf(stderr, "%s Client not connected.\n", log_prefix_.c_str());
     return -1;
   }
 
-  ClientContext context;
-  blobstore::WriteRequest request;
-  request.set_address(address);
-  request.set_data(data);
+  while (true) {
+    ClientContext context;
+    applyDeadline(context);
+    blobstore::WriteRequest request;
+    request.set_address(address);
+    request.set_data(data);
+    request.set_durability(durability);
 
-  blobstore::WriteResponse response;
-  Status status = clientStub_->Write(&context, request, &response);
-  if (status.ok()) {
-    // reset retry_count_ on success
-    retry_count_ = 0;
+    blobstore::WriteResponse response;
+    Status status = clientStub_->Write(&context, request, &response);
+    if (status.ok()) {
+      // reset retry_count_ on success
+      retry_count_ = 0;
+      overload_count_ = 0;
 
-    if(response.status() == "FAILURE") {
-      primary_address_ = response.primary_ip();
-      connect();
-      return write(address, data);
-    } else if (response.status() == "UNAVAILABLE") {
-      // TODO: if write unavailable, exit
-      return -1;
-    } else {
+      if(response.status() == "FAILURE") {
+        redirect(response.primary_ip());
+        continue;
+      } else if (response.status() == "UNAVAILABLE") {
+        // TODO: if write unavailable, exit
+        return -1;
+      }
+      replication_seq_ = std::max(replication_seq_, response.replication_seq());
+      rememberPrimary();
       return data.length();
     }
-  } else {
-    fprintf(stderr, "%s %d: %s\n", log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
-    fprintf(stderr, "%s Failed to write to server. Retrying ...\n", log_prefix_.c_str());
-
-    retry_count_++;
-    if (retry_count_ >= max_retry_count_) {
-      // Error on reaching max retry count and reset retry_count_
-      retry_count_ = 0;
-      return -1;
+    if (backOff(context, status)) {
+      continue;
     }
-
     // Change primary server and retry for each failure
-    changePrimary();
-    connect();
+    if (!failOver(status, "Failed to write to server")) {
+      return -1;
+    }
 
     // If this write request had a crash address, retry with correct address
     if(Utils::get_crash_type(address) != CrashType::NO_CRASH) {
       address = Utils::get_address(address);
     }
+  }
+}
+
+
+// Trim on server
+int64_t BlobClient::trim(int64_t address, int64_t length) {
+  if (!clientStub_) {
+    fprintf(stderr, "%s Client not connected.\n", log_prefix_.c_str());
+    return -1;
+  }
+
+  while (true) {
+    ClientContext context;
+    applyDeadline(context);
+    blobstore::TrimRequest request;
+    request.set_address(address);
+    request.set_length(length);
+
+    blobstore::TrimResponse response;
+    Status status = clientStub_->Trim(&context, request, &response);
+    if (status.ok()) {
+      // reset retry_count_ on success
+      retry_count_ = 0;
+      overload_count_ = 0;
+      replication_seq_ = std::max(replication_seq_, response.replication_seq());
+      rememberPrimary();
+      return length;
+    }
+    if (backOff(context, status)) {
+      continue;
+    }
+    if (status.error_code() == grpc::StatusCode::INVALID_ARGUMENT) {
+      fprintf(stderr, "%s %d: %s\n", log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
+      return -1;
+    }
+    // Change primary server and retry for each failure; trimming a block
+    // twice is harmless.
+    if (!failOver(status, "Failed to trim on server")) {
+      return -1;
+    }
+  }
+}
+
+int64_t BlobClient::createSnapshot() {
+  if (!clientStub_) {
+    fprintf(stderr, "%s Client not connected.\n", log_prefix_.c_str());
+    return -1;
+  }
+
+  while (true) {
+    ClientContext context;
+    applyDeadline(context);
+    blobstore::CreateSnapshotRequest request;
+    blobstore::CreateSnapshotResponse response;
+    Status status = clientStub_->CreateSnapshot(&context, request, &response);
+    if (status.ok()) {
+      retry_count_ = 0;
+      overload_count_ = 0;
+      rememberPrimary();
+      return response.snapshot();
+    }
+    if (backOff(context, status)) {
+      continue;
+    }
+    // A snapshot nobody reads expires on its own.
+    if (!failOver(status, "Failed to create a snapshot on server")) {
+      return -1;
+    }
+  }
+}
+
+// Only the primary that created the snapshot knows it: no failover.
+int BlobClient::releaseSnapshot(int64_t snapshot) {
+  if (!clientStub_) {
+    fprintf(stderr, "%s Client not connected.\n", log_prefix_.c_str());
+    return -1;
+  }
+
+  while (true) {
+    ClientContext context;
+    applyDeadline(context);
+    blobstore::ReleaseSnapshotRequest request;
+    request.set_snapshot(snapshot);
+    blobstore::ReleaseSnapshotResponse response;
+    Status status = clientStub_->ReleaseSnapshot(&context, request, &response);
+    if (status.ok()) {
+      overload_count_ = 0;
+      return 0;
+    }
+    if (backOff(context, status)) {
+      continue;
+    }
+    fprintf(stderr, "%s %d: %s\n", log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
+    return -1;
+  }
+}
 
-    return write(address, data);
+int BlobClient::readAt(int64_t snapshot, int64_t address, std::string &data) {
+  if (!clientStub_) {
+    fprintf(stderr, "%s Client not connected.\n", log_prefix_.c_str());
+    return -1;
+  }
+
+  while (true) {
+    ClientContext context;
+    applyDeadline(context);
+    blobstore::ReadRequest request;
+    request.set_address(address);
+    request.set_snapshot(snapshot);
+
+    blobstore::ReadResponse response;
+    Status status = clientStub_->Read(&context, request, &response);
+    if (status.ok()) {
+      retry_count_ = 0;
+      overload_count_ = 0;
+      rememberPrimary();
+      data = response.data();
+      return data.size();
+    }
+    if (backOff(context, status)) {
+      continue;
+    }
+    if (status.error_code() == grpc::StatusCode::FAILED_PRECONDITION ||
+        status.error_code() == grpc::StatusCode::INVALID_ARGUMENT) {
+      fprintf(stderr, "%s %d: %s\n", log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
+      return -1;
+    }
+    if (!failOver(status, "Failed to read a snapshot from server")) {
+      return -1;
+    }
   }
 }
 
+std::unique_ptr<BlobClient::RangeReader> BlobClient::readRange(int64_t address, int64_t length, int chunk_size,
+                                                               int64_t snapshot) {
+  return std::unique_ptr<RangeReader>(new RangeReader(this, address, length, chunk_size, snapshot));
+}
+
+BlobClient::RangeReader::RangeReader(BlobClient *client, int64_t address, int64_t length, int chunk_size,
+                                     int64_t snapshot)
+    : client_(client), next_address_(address), end_address_(address + length), chunk_size_(chunk_size),
+      snapshot_(snapshot), status_(0) {}
+
+void BlobClient::RangeReader::open() {
+  blobstore::ReadRangeRequest request;
+  request.set_address(next_address_);
+  request.set_length(end_address_ - next_address_);
+  request.set_chunk_size(chunk_size_);
+  request.set_snapshot(snapshot_);
+  context_.reset(new ClientContext());
+  client_->applyDeadline(*context_, 1 + (end_address_ - next_address_) / RANGE_DEADLINE_BYTES);
+  reader_ = client_->clientStub_->ReadRange(context_.get(), request);
+}
+
+bool BlobClient::RangeReader::next(int64_t &address, std::string &data) {
+  bool redirected = false;
+  while (status_ == 0 && next_address_ < end_address_) {
+    if (!client_->clientStub_) {
+      fprintf(stderr, "%s Client not connected.\n", client_->log_prefix_.c_str());
+      status_ = -1;
+      return false;
+    }
+    if (!reader_) {
+      open();
+    }
+
+    blobstore::ReadRangeResponse response;
+    if (reader_->Read(&response)) {
+      if (response.status() == "FAILURE") {
+        // A backup; the stream ends right after this.
+        client_->redirect(response.primary_ip());
+        redirected = true;
+        continue;
+      }
+      client_->retry_count_ = 0;
+      client_->overload_count_ = 0;
+      client_->rememberPrimary();
+      address = response.address();
+      data = std::move(*response.mutable_data());
+      next_address_ = address + data.size();
+      return true;
+    }
+
+    Status status = reader_->Finish();
+    reader_.reset();
+    if (status.ok()) {
+      // The server sent everything it had.
+      context_.reset();
+      next_address_ = end_address_;
+      break;
+    }
+    bool overloaded = client_->backOff(*context_, status);
+    context_.reset();
+    if (overloaded) {
+      // Same server, once it has room.
+      continue;
+    }
+    if (status.error_code() == grpc::StatusCode::INVALID_ARGUMENT ||
+        status.error_code() == grpc::StatusCode::FAILED_PRECONDITION) {
+      fprintf(stderr, "%s %d: %s\n", client_->log_prefix_.c_str(), status.error_code(), status.error_message().c_str());
+      status_ = -1;
+      return false;
+    }
+    // Go where the backup pointed, else to the other server.
+    if (!client_->failOver(status, "Range read from server broke off", !redirected)) {
+      status_ = -1;
+      return false;
+    }
+    redirected = false;
+  }
+  return false;
+}
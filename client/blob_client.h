@@ -2,7 +2,9 @@
 #define BLOB_CLIENT_H
 
 #include <memory>
+#include <random>
 #include <unordered_map>
+#include <vector>
 #include "protos/blobstore.grpc.pb.h"
 
 using blobstore::BlobStore;
@@ -12,17 +14,110 @@ private:
   std::string server1_address_;
   std::string server2_address_;
   std::string primary_address_;
-  std::unique_ptr<BlobStore::Stub> clientStub_;
+  // The primary last shared with other clients of this process.
+  std::string known_primary_;
+  // Open channels by server address; clientStub_ is the primary's.
+  std::unordered_map<std::string, std::unique_ptr<BlobStore::Stub>> stubs_;
+  BlobStore::Stub *clientStub_;
   int retry_count_;
   int max_retry_count_;
+  int deadline_ms_;
+  // Rejections by an overloaded server in a row, and in total.
+  int overload_count_;
+  int64_t backoffs_;
+  std::minstd_rand rng_;
+  // Hedged reads: see setHedging. Latencies of recent successful reads, the
+  // delay derived from them, and the hedges the budget still allows.
+  double hedge_percentile_;
+  double hedge_budget_;
+  double hedge_tokens_;
+  std::vector<double> read_latencies_us_;
+  size_t next_latency_;
+  double hedge_delay_us_;
+  int64_t hedges_;
+  int64_t hedge_wins_;
+  // Latest replication round of this client's writes and trims: a hedge is
+  // only answered by a backup that has it.
+  int64_t replication_seq_;
   std::string log_prefix_;
 
+  BlobStore::Stub *stubFor(const std::string &address);
+  const std::string &otherAddress() const;
+  void redirect(const std::string &primary_ip);
+  void applyDeadline(grpc::ClientContext &context, int64_t scale = 1);
+  void rememberPrimary();
+  bool failOver(const grpc::Status &status, const char *message, bool switch_server = true);
+  bool backOff(const grpc::ClientContext &context, const grpc::Status &status);
+  grpc::Status callRead(grpc::ClientContext &context, const blobstore::ReadRequest &request,
+                        blobstore::ReadResponse *response);
+  void recordReadLatency(double us);
+
 public:
+  // Iterates over a range read chunk by chunk, in address order. A broken
+  // stream is reopened, on the other server if need be, from the first byte
+  // not yet returned.
+  class RangeReader {
+  public:
+    // Next chunk and its address. False at the end of the range, or when the
+    // read failed for good, in which case status() is -1.
+    bool next(int64_t &address, std::string &data);
+    int status() const { return status_; }
+
+  private:
+    friend class BlobClient;
+    RangeReader(BlobClient *client, int64_t address, int64_t length, int chunk_size, int64_t snapshot);
+    void open();
+
+    BlobClient *client_;
+    int64_t next_address_;
+    int64_t end_address_;
+    int chunk_size_;
+    int64_t snapshot_;
+    int status_;
+    std::unique_ptr<grpc::ClientContext> context_;
+    std::unique_ptr<grpc::ClientReader<blobstore::ReadRangeResponse>> reader_;
+  };
+
+  // Starts at the primary another client of the same two servers in this
+  // process last reached, else at server1.
   BlobClient(const std::string &server1_address, const std::string &server2_address, const int max_retry_count);
   void changePrimary();
+  // Opens channels to both servers, which stay open for failovers.
   void connect();
+  // Deadline of every call in milliseconds (0: none); a call running past
+  // it fails over like any other error. Range reads get it once per MB.
+  void setDeadline(int deadline_ms);
+  // Server requests currently go to.
+  const std::string &get_primary() const { return primary_address_; }
   int read(int64_t address, std::string &data);
-  int write(int64_t address, std::string data);
+  int write(int64_t address, std::string data,
+            blobstore::Durability durability = blobstore::DURABILITY_REPLICATED_MEMORY);
+  // Releases the blocks of [address, address + length); both must be
+  // multiples of the block size. Returns length, or -1.
+  int64_t trim(int64_t address, int64_t length);
+  // Streams [address, address + length) back in chunks of chunk_size bytes
+  // (0: the server's default), as of snapshot if non-zero. Blocks never
+  // written read as padding.
+  std::unique_ptr<RangeReader> readRange(int64_t address, int64_t length, int chunk_size = 0,
+                                         int64_t snapshot = 0);
+  // A point-in-time view of the store on the primary, for readAt and
+  // readRange until it is released; -1 on failure. A failover drops it.
+  int64_t createSnapshot();
+  int releaseSnapshot(int64_t snapshot);
+  // Like read, as of snapshot; -1 also if the snapshot is gone.
+  int readAt(int64_t snapshot, int64_t address, std::string &data);
+  // Times a request was sent again after the server turned it down as
+  // overloaded.
+  int64_t get_backoffs() const { return backoffs_; }
+  // A read the server has not answered within the given percentile (e.g.
+  // 0.99) of recent read latencies is also sent to the other server, and the
+  // first answer is taken. budget (e.g. 0.05) caps the share of reads that
+  // may be hedged. A percentile of 0 turns hedging off. Backups answer hedges
+  // only if they serve backup reads; call before connect().
+  void setHedging(double percentile, double budget);
+  // Hedges sent, and those answered before the first request.
+  int64_t get_hedges() const { return hedges_; }
+  int64_t get_hedge_wins() const { return hedge_wins_; }
 };
 
 #endif
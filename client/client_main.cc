@@ -79,6 +79,64 @@ void read_write_aligned() {
   }
 }
 
+void read_range() {
+  printf("Running [read_range]\n");
+  int num_blocks = 1024;
+  int64_t base = 1 << 30;
+  for(int block = 0; block < num_blocks; block++) {
+    string data(4096, 'a' + (block % 26));
+    if (client->write(base + block * 4096, data) < 0) {
+      printf("Failed to write to server.\n");
+    }
+  }
+
+  // Start mid-block so every chunk straddles block boundaries.
+  int64_t address = base + 100, expected = address;
+  string data;
+  int mismatches = 0;
+  auto reader = client->readRange(address, (int64_t)num_blocks * 4096 - 100, 256 * 1024);
+  while (reader->next(address, data)) {
+    if (address != expected) {
+      printf("Chunk at %ld, expected %ld\n", address, expected);
+    }
+    for (size_t i = 0; i < data.size(); i++) {
+      char byte = 'a' + ((address + i - base) / 4096) % 26;
+      if (data[i] != byte) {
+        mismatches++;
+      }
+    }
+    expected = address + data.size();
+  }
+  if (reader->status() < 0) {
+    printf("Failed to read range from server.\n");
+  }
+  printf("Read %ld bytes in range, %d mismatched.\n", expected - base - 100, mismatches);
+}
+
+void trim_range() {
+  printf("Running [trim_range]\n");
+  int num_blocks = 1024;
+  int64_t base = 1 << 30;
+  // Release the second half of what read_range wrote; it reads as padding.
+  if (client->trim(base + num_blocks / 2 * 4096, num_blocks / 2 * 4096) < 0) {
+    printf("Failed to trim on server.\n");
+  }
+  int64_t address;
+  string data;
+  int mismatches = 0;
+  auto reader = client->readRange(base, (int64_t)num_blocks * 4096);
+  while (reader->next(address, data)) {
+    for (size_t i = 0; i < data.size(); i++) {
+      int64_t block = (address + i - base) / 4096;
+      char byte = block < num_blocks / 2 ? 'a' + block % 26 : ' ';
+      if (data[i] != byte) {
+        mismatches++;
+      }
+    }
+  }
+  printf("Trimmed %d blocks, %d bytes mismatched.\n", num_blocks / 2, mismatches);
+}
+
 int64_t get_address_with_crash(int64_t address, CrashType crash_type) {
   int64_t crash_address = crash_type * MAX_ADDRESS_LENGTH;
   int64_t address_to_write = -1 * (crash_address + address);
@@ -126,6 +184,50 @@ void read_write_with_crash(CrashType crash_type) {
 }
 
 
+void snapshot_read() {
+  printf("Running [snapshot_read]\n");
+  int num_blocks = 1024;
+  int64_t base = 1 << 30;
+  int64_t snapshot = client->createSnapshot();
+  if (snapshot < 0) {
+    printf("Failed to create snapshot on server.\n");
+    return;
+  }
+  // Overwrite the first half and write over the trimmed second half; the
+  // snapshot still reads them as trim_range left them.
+  for (int block = 0; block < num_blocks; block += 2) {
+    if (client->write(base + block * 4096, string(4096, 'Z')) < 0) {
+      printf("Failed to write to server.\n");
+    }
+  }
+  int64_t address;
+  string data;
+  int mismatches = 0;
+  if (client->readAt(snapshot, base, data) < 0 || data != string(4096, 'a')) {
+    mismatches++;
+  }
+  auto reader = client->readRange(base, (int64_t)num_blocks * 4096, 0, snapshot);
+  while (reader->next(address, data)) {
+    for (size_t i = 0; i < data.size(); i++) {
+      int64_t block = (address + i - base) / 4096;
+      char byte = block < num_blocks / 2 ? 'a' + block % 26 : ' ';
+      if (data[i] != byte) {
+        mismatches++;
+      }
+    }
+  }
+  if (reader->status() < 0) {
+    printf("Failed to read range at snapshot from server.\n");
+  }
+  if (client->releaseSnapshot(snapshot) < 0) {
+    printf("Failed to release snapshot on server.\n");
+  }
+  if (client->readAt(snapshot, base, data) >= 0) {
+    printf("Read at released snapshot %ld succeeded.\n", snapshot);
+  }
+  printf("Read snapshot %ld, %d bytes mismatched.\n", snapshot, mismatches);
+}
+
 int main(int argc, char* argv[]) {
   if (argc != 2) {
     printf("Usage: %s <conf file>\n", argv[0]);
@@ -157,6 +259,10 @@ int main(int argc, char* argv[]) {
   time_taken = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
   printf("Time taken [read_write_unaligned]: %f\n", time_taken);
 
+  read_range();
+  trim_range();
+  snapshot_read();
+
   // Run crash tests - See list of crashes in CrashType enum
   read_write_with_crash(CrashType::PRIMARY_CRASH_AFTER_LOCAL_COMMIT);
 
@@ -1,4 +1,5 @@
 #include "blob_client.h"
+#include "workload.h"
 #include "resources/utils.h"
 #include <iostream>
 #include <string>
@@ -8,7 +9,6 @@
 #include <mutex>
 #include <time.h>
 #include <unistd.h>
-#include <random>
 
 #include <condition_variable>
 #include "absl/flags/flag.h"
@@ -18,7 +18,7 @@
 
 enum { NS_PER_SECOND =  1000000000 };
 ABSL_FLAG(std::string , key_distribution, "uniform",
-          "Key distribution: uniform, exponential (3)");
+          "Key distribution: uniform, exponential (3), hotspot (90% to 1% of the store)");
 ABSL_FLAG(float, write_ratio, 0.5,
           "Ratio of writes to total requests");
 ABSL_FLAG(int64_t, store_size, 256 * 1024,
@@ -49,66 +49,10 @@ void clear_caches() {
   const int M = 1024*1024*64;
   int* buff = new int[M];
   for (int i = 0; i < M; i++) buff[i] = rand()%1001;
-  delete buff;
+  delete[] buff;
 }
 
 
-struct Request {
-  int64_t address;
-  bool write;
-};
-
-class RequestGenerator {
- public:
-  RequestGenerator() = delete;
-  RequestGenerator(int client_id, float write_ratio, int64_t store_size, 
-                    std::string alignment, std::string key_distribution): 
-                    generator_(std::random_device{}()), uniform_dist_(0.0, 1.0), exponential_dist_(3.0) {
-    alignment_ = alignment;
-    write_ratio_ = write_ratio;
-    store_size_ = store_size*1024*1024;
-    key_distribution_ = key_distribution;
-  }
-  bool IsWrite() {
-    double x = uniform_dist_(generator_);
-    return x <= write_ratio_;
-  }
-  int64_t GetAddress() {
-    if (alignment_ == "aligned") {
-      if (key_distribution_ == "uniform") {
-        return int64_t((uniform_dist_(generator_) * store_size_)/4096)*4096;
-      } else if (key_distribution_ == "exponential") {
-        return int64_t((exponential_dist_(generator_) * store_size_)/4096)*4096;
-      }
-    } else if (alignment_ == "unaligned") {
-      if (key_distribution_ == "uniform") {
-        return int64_t((uniform_dist_(generator_) * store_size_));
-      } else if (key_distribution_ == "exponential") {
-        return int64_t((exponential_dist_(generator_) * store_size_));
-      }
-    } else {
-      printf("Unknown alignment: %s\n", alignment_.c_str());
-      return -1;
-    }
-  }
-  Request GetRequest() {
-    Request r;
-    r.address = GetAddress();
-    r.write = IsWrite();
-    return r;
-  }
-
- private:
- std::mt19937 generator_;
- std::uniform_real_distribution<double> uniform_dist_;
- std::exponential_distribution<double> exponential_dist_;
- std::string alignment_;
- double write_ratio_;
- int64_t store_size_;
- std::string key_distribution_;
-};
-
-
 void RunClientWorkload(int client_id, std::string server1_address, std::string server2_address, int max_retry_count, double& avg_time_us) {
   // srand(client_id);
   printf("Client: %d\n", client_id);
@@ -26,6 +26,15 @@ Lock mtxLock;
 Utils utils;
 
 string log_prefix_ = "[ClientApp]: ";
+int failed_checks = 0;
+
+// Count and report a failed check.
+void check(bool ok, const char* test, const string& what) {
+  if (!ok) {
+    fprintf(stderr, "%s [%s] %s\n", log_prefix_.c_str(), test, what.c_str());
+    failed_checks++;
+  }
+}
 
 void update_hash(int address, size_t str_hash) {
     WriteLock lock(mtxLock);
@@ -73,6 +82,19 @@ void stop_servers() {
   }
 }
 
+// Stop the server whose store is store_name (store1 or store2) only.
+void stop_server(const string& store_name) {
+  fprintf(stderr, "%s Stopping the server on %s\n", log_prefix_.c_str(), store_name.c_str());
+
+  string server_binary = home_dir + "/bazel-bin/server/server";
+  string kill_server_cmd = " ps -ef | grep " + server_binary + " | grep '" + home_dir + "/" + store_name +
+                           "' | grep -v grep | awk '{print $2}' | xargs -r kill -9";
+  int res = system(kill_server_cmd.c_str());
+  if (res < 0) {
+    fprintf(stderr, "%s Failed to stop server.\n", log_prefix_.c_str());
+  }
+}
+
 int64_t create_crash_address(int64_t address, CrashType crash_type) {
   int64_t crash_address = crash_type * MAX_ADDRESS_LENGTH;
   int64_t address_to_write = -1 * (crash_address + address);
@@ -167,6 +189,121 @@ int test_multiple_clients_with_crash(int num_clients, CrashType crash_type) {
   return 0;
 }
 
+// The test blocks below live past the addresses the crash tests write.
+#define TEST_BLOCK_BASE 1000
+
+// Released blocks read back like blocks never written; their neighbours and
+// a range read across them are unaffected.
+void test_trim(shared_ptr<BlobClient> client) {
+  const char* test = "trim";
+  fprintf(stderr, "%s Running [%s]\n", log_prefix_.c_str(), test);
+  int64_t base = (int64_t)TEST_BLOCK_BASE * BLOCK_SIZE;
+  for (int i = 0; i < 4; i++) {
+    check(client->write(base + i * BLOCK_SIZE, string(BLOCK_SIZE, 'p' + i)) == BLOCK_SIZE, test, "write failed");
+  }
+  check(client->trim(base + BLOCK_SIZE, 2 * BLOCK_SIZE) == 2 * BLOCK_SIZE, test, "trim failed");
+
+  string never_written, data;
+  check(client->read(base + 100 * BLOCK_SIZE, never_written) >= 0, test, "read of a block never written failed");
+  for (int i = 0; i < 4; i++) {
+    bool trimmed = i == 1 || i == 2;
+    check(client->read(base + i * BLOCK_SIZE, data) >= 0, test, "read failed");
+    check(data == (trimmed ? never_written : string(BLOCK_SIZE, 'p' + i)), test,
+          "block " + to_string(i) + (trimmed ? " still holds data after the trim" : " changed by the trim"));
+  }
+
+  // Blocks never written read as padding in a range.
+  string expected = string(BLOCK_SIZE, 'p') + string(2 * BLOCK_SIZE, ' ') + string(BLOCK_SIZE, 's');
+  string range, chunk;
+  int64_t address;
+  unique_ptr<BlobClient::RangeReader> reader = client->readRange(base, 4 * BLOCK_SIZE);
+  while (reader->next(address, chunk)) {
+    range += chunk;
+  }
+  check(reader->status() == 0 && range == expected, test, "range read across the trimmed blocks is wrong");
+}
+
+// A snapshot keeps reading the image a block had when it was taken, and
+// stops reading at all once released.
+void test_snapshot(shared_ptr<BlobClient> client) {
+  const char* test = "snapshot";
+  fprintf(stderr, "%s Running [%s]\n", log_prefix_.c_str(), test);
+  int64_t address = (int64_t)(TEST_BLOCK_BASE + 10) * BLOCK_SIZE;
+  check(client->write(address, string(BLOCK_SIZE, 'x')) == BLOCK_SIZE, test, "write failed");
+  int64_t snapshot = client->createSnapshot();
+  check(snapshot > 0, test, "createSnapshot failed");
+  check(client->write(address, string(BLOCK_SIZE, 'y')) == BLOCK_SIZE, test, "overwrite failed");
+
+  string data;
+  check(client->readAt(snapshot, address, data) == BLOCK_SIZE && data == string(BLOCK_SIZE, 'x'), test,
+        "snapshot read does not return the image from before the overwrite");
+  check(client->read(address, data) == BLOCK_SIZE && data == string(BLOCK_SIZE, 'y'), test,
+        "read does not return the overwrite");
+
+  check(client->releaseSnapshot(snapshot) == 0, test, "releaseSnapshot failed");
+  check(client->readAt(snapshot, address, data) < 0, test, "read of a released snapshot succeeded");
+}
+
+// A range read returns what reading its blocks one by one does, aligned and
+// unaligned writes alike; also once the primary fails and the backup takes
+// over halfway.
+void check_range_matches_reads(shared_ptr<BlobClient> client, const char* test, int64_t base, int num_blocks) {
+  string expected, data;
+  for (int i = 0; i < num_blocks; i++) {
+    check(client->read(base + i * BLOCK_SIZE, data) >= 0, test, "read failed");
+    // Blocks never written read as padding in a range.
+    data.resize(BLOCK_SIZE, ' ');
+    expected += data;
+  }
+  string range, chunk;
+  int64_t address, next_address = base;
+  // Small chunks, so that the range takes several messages.
+  unique_ptr<BlobClient::RangeReader> reader = client->readRange(base, num_blocks * BLOCK_SIZE, 4 * BLOCK_SIZE);
+  while (reader->next(address, chunk)) {
+    check(address == next_address, test, "chunk at " + to_string(address) + ", expected " + to_string(next_address));
+    next_address = address + chunk.size();
+    range += chunk;
+  }
+  check(reader->status() == 0, test, "range read failed");
+  check(range == expected, test, "range read does not match the block reads");
+}
+
+void test_read_range(shared_ptr<BlobClient> client) {
+  const char* test = "read_range";
+  fprintf(stderr, "%s Running [%s]\n", log_prefix_.c_str(), test);
+  int64_t base = (int64_t)(TEST_BLOCK_BASE + 20) * BLOCK_SIZE;
+  int num_blocks = 32;
+  for (int i = 0; i < num_blocks; i += 2) {
+    // Every other write is unaligned, spilling into the next block.
+    int64_t address = base + i * BLOCK_SIZE + (i % 4 == 0 ? 0 : BLOCK_SIZE / 2);
+    check(client->write(address, string(BLOCK_SIZE, 'a' + i % 26)) == BLOCK_SIZE, test, "write failed");
+  }
+  check_range_matches_reads(client, test, base, num_blocks);
+
+  stop_server(client->get_primary() == server1_address ? "store1" : "store2");
+  check_range_matches_reads(client, test, base, num_blocks);
+}
+
+int test_block_operations() {
+  int res = start_servers();
+  if (res < 0) {
+    fprintf(stderr, "%s Failed to start servers.\n", log_prefix_.c_str());
+    return res;
+  }
+
+  sleep(2);
+
+  shared_ptr<BlobClient> client(new BlobClient(server1_address, server2_address, max_retry_count));
+  client->connect();
+  test_trim(client);
+  test_snapshot(client);
+  // Last: it stops the primary.
+  test_read_range(client);
+
+  stop_servers();
+  return 0;
+}
+
 int main(int argc, char* argv[]) {
   if (argc != 2) {
     fprintf(stderr, "Usage: %s <conf file>\n", argv[0]);
@@ -205,6 +342,13 @@ int main(int argc, char* argv[]) {
     test_multiple_clients_with_crash(num_clients, crash_type);
   }
 
+  fprintf(stderr, "%s ============ RUNNING BLOCK OPERATION TESTS ============\n", log_prefix_.c_str());
+  test_block_operations();
+
+  if (failed_checks > 0) {
+    fprintf(stderr, "%s ============ %d CHECKS FAILED ============\n", log_prefix_.c_str(), failed_checks);
+    return 1;
+  }
   fprintf(stderr, "%s ============ TESTS COMPLETED ============\n", log_prefix_.c_str());
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,386 @@
+// In-process cluster benchmark: runs a primary and its backup BlobServers in
+// this process on loopback ports, drives them with the client_perf workload and
+// reports throughput/latency with and without replication.
+//
+//   bazel run //client:cluster_perf --cxxopt=-std=c++17 --copt=-O3 -- --num_clients=8
+#include "blob_client.h"
+#include "workload.h"
+#include "server/blob_server.h"
+#include "server/blob_service.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+ABSL_FLAG(std::string , key_distribution, "uniform",
+          "Key distribution: uniform, exponential (3), hotspot (90% to 1% of the store)");
+ABSL_FLAG(float, write_ratio, 0.5,
+          "Ratio of writes to total requests");
+ABSL_FLAG(int64_t, store_size, 64,
+          "Storage size in MBs");
+ABSL_FLAG(int, num_clients, 4, "Number of clients");
+ABSL_FLAG(std::string, alignment, "aligned",
+          "Alignment of data: aligned or unaligned");
+ABSL_FLAG(int, requests_per_client, 2000, "Number of requests per client");
+ABSL_FLAG(std::string, primary_address, "127.0.0.1:50061", "Loopback address of the primary");
+ABSL_FLAG(std::string, backup_address, "127.0.0.1:50062",
+          "Loopback addresses of the backups, comma-separated");
+ABSL_FLAG(std::string, tmp_dir, "/tmp", "Directory under which per-run store roots are created");
+ABSL_FLAG(int, num_shards, 1, "Number of shards per server");
+ABSL_FLAG(int, replication_quorum, 0, "Backups acknowledging each write (0: all)");
+ABSL_FLAG(bool, async_apply, false, "Write block files from a background applier");
+ABSL_FLAG(int, replication_channels, 0, "Replication connections per peer (0: one per shard)");
+ABSL_FLAG(bool, replication_stream, true, "Replicate over a long-lived stream per connection instead of unary calls");
+ABSL_FLAG(bool, compression, false, "Deflate replicated block data");
+ABSL_FLAG(bool, verify, false, "Run an anti-entropy pass on every backup after the workload");
+ABSL_FLAG(std::string, durability, "replicated_memory",
+          "Durability of writes: primary_memory, replicated_memory, local_disk or replicated_disk");
+ABSL_FLAG(int, admission_limit, 0, "Client requests of each kind served at once (0: unbounded)");
+ABSL_FLAG(int, admission_read_latency_us, 0, "Read latency above which the admission limit shrinks (0: fixed)");
+ABSL_FLAG(int, admission_write_latency_us, 0, "Write latency above which the admission limit shrinks (0: fixed)");
+ABSL_FLAG(bool, backup_reads, false, "Backups answer hedged reads");
+ABSL_FLAG(bool, coalesce_writes, false, "Fold queued writes to the same address into one");
+ABSL_FLAG(bool, lock_free_reads, true, "The primary reads blocks without the shard locks");
+ABSL_FLAG(int, heatmap_interval_s, 0,
+          "Profile accesses on the servers and print the primary's heatmap after the workload (0: off)");
+ABSL_FLAG(double, hedge_percentile, 0,
+          "Hedge reads slower than this percentile of recent reads to the backup (0: off)");
+ABSL_FLAG(double, hedge_budget, 0.05, "Largest share of reads that may be hedged");
+ABSL_FLAG(std::string, mode, "both",
+          "Which configurations to run: single, replicated or both");
+
+// One BlobServer together with the gRPC server exposing it.
+struct Replica {
+  std::shared_ptr<BlobServer> blobserver;
+  std::unique_ptr<BlobStoreImpl> blobstore_service;
+  std::unique_ptr<StoreInternalImpl> store_internal_service;
+  std::unique_ptr<grpc::Server> server;
+};
+
+std::unique_ptr<Replica> StartReplica(const std::string& self_address,
+                                      const std::string& other_addresses,
+                                      const std::string& root_dir) {
+  std::unique_ptr<Replica> replica(new Replica());
+  ServerOptions options;
+  options.num_shards = absl::GetFlag(FLAGS_num_shards);
+  options.replication_quorum = absl::GetFlag(FLAGS_replication_quorum);
+  options.async_apply = absl::GetFlag(FLAGS_async_apply);
+  options.replication_channels = absl::GetFlag(FLAGS_replication_channels);
+  options.replication_stream = absl::GetFlag(FLAGS_replication_stream);
+  options.compression = absl::GetFlag(FLAGS_compression);
+  options.backup_reads = absl::GetFlag(FLAGS_backup_reads);
+  options.coalesce_writes = absl::GetFlag(FLAGS_coalesce_writes);
+  options.heatmap_interval_s = absl::GetFlag(FLAGS_heatmap_interval_s);
+  options.lock_free_reads = absl::GetFlag(FLAGS_lock_free_reads);
+  options.admission_limit = absl::GetFlag(FLAGS_admission_limit);
+  options.admission_read_latency_us = absl::GetFlag(FLAGS_admission_read_latency_us);
+  options.admission_write_latency_us = absl::GetFlag(FLAGS_admission_write_latency_us);
+  replica->blobserver = std::make_shared<BlobServer>(root_dir, self_address, other_addresses, options);
+  replica->blobstore_service.reset(new BlobStoreImpl(replica->blobserver));
+  replica->store_internal_service.reset(new StoreInternalImpl(replica->blobserver));
+
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(self_address, grpc::InsecureServerCredentials());
+  builder.RegisterService(replica->blobstore_service.get());
+  builder.RegisterService(replica->store_internal_service.get());
+  replica->server = builder.BuildAndStart();
+  if (!replica->server) {
+    fprintf(stderr, "[ClusterPerf] Failed to listen on %s\n", self_address.c_str());
+    exit(1);
+  }
+  // Pings the other addresses: becomes primary if nobody answers, otherwise
+  // recovers from the primary and becomes its backup.
+  replica->blobserver->ServerInit();
+  return replica;
+}
+
+void StopReplica(std::unique_ptr<Replica>& replica) {
+  if (!replica) {
+    return;
+  }
+  // The primary's Replicate streams to it stay open; cancel them rather
+  // than wait for them to end.
+  replica->server->Shutdown(std::chrono::system_clock::now());
+  replica->server->Wait();
+  replica.reset();
+}
+
+struct ClientStats {
+  std::vector<double> read_us;
+  std::vector<double> write_us;
+  int errors = 0;
+  int64_t backoffs = 0;
+  int64_t hedges = 0;
+  int64_t hedge_wins = 0;
+};
+
+blobstore::Durability ParseDurability(const std::string& name) {
+  blobstore::Durability durability;
+  std::string upper = "DURABILITY_" + name;
+  std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+  if (!blobstore::Durability_Parse(upper, &durability)) {
+    fprintf(stderr, "Unknown durability: %s\n", name.c_str());
+    exit(1);
+  }
+  return durability;
+}
+
+void RunClientWorkload(int client_id, std::string server1_address, std::string server2_address, ClientStats& stats) {
+  std::unique_ptr<BlobClient> client(new BlobClient(server1_address, server2_address, 3));
+  client->setHedging(absl::GetFlag(FLAGS_hedge_percentile), absl::GetFlag(FLAGS_hedge_budget));
+  client->connect();
+  RequestGenerator request_generator(client_id,
+                                     absl::GetFlag(FLAGS_write_ratio),
+                                     absl::GetFlag(FLAGS_store_size),
+                                     absl::GetFlag(FLAGS_alignment),
+                                     absl::GetFlag(FLAGS_key_distribution));
+  int num_requests = absl::GetFlag(FLAGS_requests_per_client);
+  blobstore::Durability durability = ParseDurability(absl::GetFlag(FLAGS_durability));
+  std::string write_data;
+  for (int i = 0; i < 4096; i++) write_data.push_back('A' + rand()%26);
+  for(int ii = 0; ii < num_requests; ++ii) {
+    auto request = request_generator.GetRequest();
+    auto start = std::chrono::high_resolution_clock::now();
+    int res;
+    if (request.write) {
+      res = client->write(request.address, write_data, durability);
+    } else {
+      std::string read_data;
+      res = client->read(request.address, read_data);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double us = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0;
+    (request.write ? stats.write_us : stats.read_us).push_back(us);
+    if (res < 0) {
+      stats.errors++;
+    }
+  }
+  stats.backoffs = client->get_backoffs();
+  stats.hedges = client->get_hedges();
+  stats.hedge_wins = client->get_hedge_wins();
+}
+
+struct Summary {
+  double throughput;
+  double read_avg, read_p50, read_p99, read_p999;
+  double write_avg, write_p50, write_p99;
+  int errors;
+};
+
+double Percentile(std::vector<double>& samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t idx = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+double Average(const std::vector<double>& samples) {
+  if (samples.empty()) {
+    return 0;
+  }
+  double total = 0;
+  for (double s : samples) total += s;
+  return total / samples.size();
+}
+
+Summary RunConfiguration(bool replicated) {
+  std::string primary_address = absl::GetFlag(FLAGS_primary_address);
+  std::vector<std::string> backup_addresses;
+  std::stringstream backup_list(absl::GetFlag(FLAGS_backup_address));
+  std::string address;
+  while (std::getline(backup_list, address, ',')) {
+    backup_addresses.push_back(address);
+  }
+  std::string all_addresses = primary_address + "," + absl::GetFlag(FLAGS_backup_address);
+  std::string root_template = absl::GetFlag(FLAGS_tmp_dir) + "/blobstore-cluster-XXXXXX";
+  std::vector<char> root_buf(root_template.begin(), root_template.end());
+  root_buf.push_back('\0');
+  if (mkdtemp(root_buf.data()) == nullptr) {
+    perror("[ClusterPerf] mkdtemp");
+    exit(1);
+  }
+  std::string root(root_buf.data());
+
+  // The primary starts first so that its pings to the (not yet running)
+  // backups fail and it takes the primary role.
+  std::unique_ptr<Replica> primary = StartReplica(primary_address, all_addresses, root + "/primary");
+  std::vector<std::unique_ptr<Replica>> backups;
+  if (replicated) {
+    for (size_t i = 0; i < backup_addresses.size(); i++) {
+      backups.push_back(StartReplica(backup_addresses[i], all_addresses, root + "/backup" + std::to_string(i)));
+    }
+  }
+
+  int num_clients = absl::GetFlag(FLAGS_num_clients);
+  std::vector<ClientStats> stats(num_clients);
+  std::vector<std::thread> client_threads;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int ii = 0; ii < num_clients; ii++) {
+    client_threads.push_back(std::thread(RunClientWorkload, ii, primary_address, backup_addresses[0], std::ref(stats[ii])));
+  }
+  for (auto& t: client_threads) {
+    t.join();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  const PayloadCounters& replication_bytes = primary->blobserver->get_replication_bytes();
+  if (replication_bytes.raw_bytes > 0) {
+    printf("[ClusterPerf] Replicated block data: %ld bytes, %ld bytes sent (%.2fx)\n",
+           (long)replication_bytes.raw_bytes, (long)replication_bytes.sent_bytes,
+           (double)replication_bytes.raw_bytes / replication_bytes.sent_bytes);
+  }
+
+  ReplicationStreamStats streams = primary->blobserver->get_replication_stream_stats();
+  if (streams.messages > 0) {
+    printf("[ClusterPerf] Replication streams: %ld opened, %ld messages, %ld acks (%.2f messages/ack)\n",
+           (long)streams.streams, (long)streams.messages, (long)streams.acks,
+           streams.acks > 0 ? (double)streams.messages / streams.acks : 0.0);
+  }
+
+  if (absl::GetFlag(FLAGS_admission_limit) > 0) {
+    int64_t backoffs = 0;
+    for (auto& s : stats) backoffs += s.backoffs;
+    printf("[ClusterPerf] Admission: %ld requests rejected, %ld client backoffs\n",
+           (long)primary->blobstore_service->get_rejected(), (long)backoffs);
+  }
+
+  printf("[ClusterPerf] Writes by durability:");
+  for (int level = 0; level < blobstore::Durability_ARRAYSIZE; level++) {
+    printf(" %s %ld", blobstore::Durability_Name((blobstore::Durability)level).c_str(),
+           (long)primary->blobserver->get_writes((blobstore::Durability)level));
+  }
+  printf(", coalesced %ld\n", (long)primary->blobserver->get_coalesced_writes());
+  printf("[ClusterPerf] Lock-free reads: %ld retries, %ld fell back to the locks\n",
+         (long)primary->blobserver->get_lock_free_read_retries(), (long)primary->blobserver->get_locked_reads());
+
+  if (absl::GetFlag(FLAGS_heatmap_interval_s) > 0) {
+    StoreInternalClient admin(primary_address);
+    blobstore::HeatmapRequest request;
+    blobstore::HeatmapResponse heatmap;
+    request.set_num_blocks(8);
+    request.set_num_regions(8);
+    grpc::Status status = admin.GetHeatmap(request, &heatmap);
+    if (!status.ok()) {
+      printf("[ClusterPerf] GetHeatmap failed: %s\n", status.error_message().c_str());
+    } else {
+      printf("[ClusterPerf] Heatmap: %ld reads, %ld writes. Hottest blocks:", (long)heatmap.reads(),
+             (long)heatmap.writes());
+      for (const auto& block : heatmap.blocks()) {
+        printf(" %ld:%ld", (long)block.block(), (long)block.accesses());
+      }
+      printf(". Regions of %ld blocks (reads/writes):", (long)heatmap.region_blocks());
+      for (const auto& region : heatmap.regions()) {
+        printf(" %ld:%ld/%ld", (long)region.region(), (long)region.reads(), (long)region.writes());
+      }
+      printf(". Writes per lock slot:");
+      for (int64_t writes : heatmap.lock_slot_writes()) {
+        printf(" %ld", (long)writes);
+      }
+      printf("\n");
+    }
+  }
+
+  if (absl::GetFlag(FLAGS_verify)) {
+    primary->blobserver->WaitForBackgroundTasks();
+    for (size_t i = 0; i < backups.size(); i++) {
+      AntiEntropyStats verify_stats;
+      absl::Status status = backups[i]->blobserver->AntiEntropy(&verify_stats);
+      printf("[ClusterPerf] Verify %s: %s, %ld nodes compared in %d messages, %ld blocks repaired, %ld ms\n",
+             backup_addresses[i].c_str(), status.ok() ? "ok" : std::string(status.message()).c_str(),
+             (long)verify_stats.nodes_compared, verify_stats.messages, (long)verify_stats.divergent_blocks,
+             (long)verify_stats.elapsed_ms);
+    }
+  }
+
+  for (auto& backup : backups) {
+    StopReplica(backup);
+  }
+  StopReplica(primary);
+  std::filesystem::remove_all(root);
+
+  ClientStats all;
+  for (auto& s : stats) {
+    all.read_us.insert(all.read_us.end(), s.read_us.begin(), s.read_us.end());
+    all.write_us.insert(all.write_us.end(), s.write_us.begin(), s.write_us.end());
+    all.errors += s.errors;
+    all.hedges += s.hedges;
+    all.hedge_wins += s.hedge_wins;
+  }
+  double elapsed_s = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+  Summary summary;
+  summary.throughput = (all.read_us.size() + all.write_us.size()) / elapsed_s;
+  summary.read_avg = Average(all.read_us);
+  summary.read_p50 = Percentile(all.read_us, 0.50);
+  summary.read_p99 = Percentile(all.read_us, 0.99);
+  summary.read_p999 = Percentile(all.read_us, 0.999);
+  summary.write_avg = Average(all.write_us);
+  summary.write_p50 = Percentile(all.write_us, 0.50);
+  summary.write_p99 = Percentile(all.write_us, 0.99);
+  summary.errors = all.errors;
+  if (absl::GetFlag(FLAGS_hedge_percentile) > 0) {
+    printf("[ClusterPerf] Hedged reads: %ld of %zu, %ld answered first, read p99.9 %.1f us\n",
+           (long)all.hedges, all.read_us.size(), (long)all.hedge_wins, summary.read_p999);
+  }
+  return summary;
+}
+
+void PrintSummary(const char* name, const Summary& s) {
+  printf("%-12s %12.2f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %8d\n", name, s.throughput,
+         s.read_avg, s.read_p50, s.read_p99, s.write_avg, s.write_p50, s.write_p99, s.errors);
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  srand(time(NULL));
+  std::string mode = absl::GetFlag(FLAGS_mode);
+  if (mode != "single" && mode != "replicated" && mode != "both") {
+    fprintf(stderr, "Unknown mode: %s\n", mode.c_str());
+    return 1;
+  }
+
+  std::vector<std::pair<const char*, Summary>> results;
+  if (mode != "replicated") {
+    std::cout << "[ClusterPerf] Running without replication" << std::endl;
+    results.push_back({"single", RunConfiguration(false)});
+  }
+  if (mode != "single") {
+    std::cout << "[ClusterPerf] Running with primary + backups" << std::endl;
+    results.push_back({"replicated", RunConfiguration(true)});
+  }
+
+  printf("\nClients: %d, Requests/client: %d, Shards: %d, Quorum: %d, Async apply: %d, Channels: %d, Stream: %d, Compression: %d, Durability: %s, Admission limit: %d, Coalesce writes: %d, Lock-free reads: %d, Write ratio: %.2f, Alignment: %s, Distribution: %s\n",
+         absl::GetFlag(FLAGS_num_clients), absl::GetFlag(FLAGS_requests_per_client), absl::GetFlag(FLAGS_num_shards),
+         absl::GetFlag(FLAGS_replication_quorum), absl::GetFlag(FLAGS_async_apply),
+         absl::GetFlag(FLAGS_replication_channels), absl::GetFlag(FLAGS_replication_stream),
+         absl::GetFlag(FLAGS_compression),
+         absl::GetFlag(FLAGS_durability).c_str(), absl::GetFlag(FLAGS_admission_limit),
+         absl::GetFlag(FLAGS_coalesce_writes), absl::GetFlag(FLAGS_lock_free_reads), absl::GetFlag(FLAGS_write_ratio), absl::GetFlag(FLAGS_alignment).c_str(),
+         absl::GetFlag(FLAGS_key_distribution).c_str());
+  printf("%-12s %12s %10s %10s %10s %10s %10s %10s %8s\n", "config", "ops/s",
+         "rd avg us", "rd p50", "rd p99", "wr avg us", "wr p50", "wr p99", "errors");
+  for (auto& r : results) {
+    PrintSummary(r.first, r.second);
+  }
+  if (results.size() == 2) {
+    const Summary& single = results[0].second;
+    const Summary& replicated = results[1].second;
+    printf("Replication overhead: throughput %+.1f%%, write p50 %+.1f%%, write p99 %+.1f%%\n",
+           100.0 * (replicated.throughput - single.throughput) / single.throughput,
+           100.0 * (replicated.write_p50 - single.write_p50) / single.write_p50,
+           100.0 * (replicated.write_p99 - single.write_p99) / single.write_p99);
+  }
+  return 0;
+}
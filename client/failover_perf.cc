@@ -0,0 +1,294 @@
+// Failover benchmark: starts a primary and a backup from home_dir the way
+// client_test does, runs steady load against them and kills the primary
+// partway through. Reports what the clients saw: how long no request
+// succeeded, the errors, and a latency timeline in 10 ms buckets through
+// detection, promotion and back to steady state.
+//
+// The primary dies either from SIGKILL or at a CrashType injection point,
+// for which the server has to be built with -DCRASH_TEST:
+//
+//   bazel build //server:server --cxxopt=-std=c++17 --cxxopt=-DCRASH_TEST
+//   bazel run //client:failover_perf --cxxopt=-std=c++17 -- --config_file=/mnt/Work/CS739-P3/resources/exec.conf --crash_type=PRIMARY_CRASH_AFTER_LOCAL_COMMIT
+#include "blob_client.h"
+#include "workload.h"
+#include "resources/utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+ABSL_FLAG(std::string, config_file, "/mnt/Work/CS739-P3/resources/exec.conf",
+          "Client config: server1_address (the primary), server2_address, home_dir, max_retry_count");
+ABSL_FLAG(std::string, server_conf, "", "Server tunables file passed to both servers");
+ABSL_FLAG(std::string, crash_type, "SIGKILL",
+          "How the primary dies: SIGKILL, PRIMARY_CRASH_AFTER_LOCAL_PREPARE, "
+          "PRIMARY_CRASH_AFTER_LOCAL_COMMIT or PRIMARY_CRASH_BEFORE_READ");
+ABSL_FLAG(int, crash_after_ms, 2000, "Time into the load at which the primary dies");
+ABSL_FLAG(int, duration_ms, 6000, "Length of the load");
+ABSL_FLAG(int, num_clients, 4, "Number of clients");
+ABSL_FLAG(float, write_ratio, 0.5, "Ratio of writes to total requests");
+ABSL_FLAG(int64_t, store_size, 64, "Storage size in MBs");
+ABSL_FLAG(int, bucket_ms, 10, "Resolution of the timeline");
+ABSL_FLAG(int, deadline_ms, 0, "Client call deadline (0: the client's default)");
+
+#define BLOCK_SIZE 4096
+// Buckets in a row at the pre-crash rate that count as steady state again.
+#define STEADY_BUCKETS 10
+
+using Clock = std::chrono::steady_clock;
+
+std::string server1_address, server2_address, home_dir;
+int max_retry_count;
+
+// One request as a client saw it, in microseconds since the load started.
+struct Sample {
+  int64_t start_us;
+  int64_t end_us;
+  bool ok;
+  // Answered by server2, the backup at the start.
+  bool on_backup;
+};
+
+std::string ServerBinary() {
+  return home_dir + "/bazel-bin/server/server";
+}
+
+void StartServer(const std::string& self, const std::string& other, const std::string& store,
+                 const std::string& log) {
+  std::string cmd = "rm -rf " + home_dir + "/" + store + " && " + ServerBinary() + " " + self + " " + other + " " +
+                    home_dir + "/" + store + " " + absl::GetFlag(FLAGS_server_conf) + " >> " + home_dir +
+                    "/logs/" + log + " 2>&1 &";
+  if (system(cmd.c_str()) != 0) {
+    fprintf(stderr, "[FailoverPerf] Failed to start %s\n", self.c_str());
+    exit(1);
+  }
+}
+
+// Kills the server listening on address, or all of them if address is empty.
+void KillServers(const std::string& address = "") {
+  std::string cmd = "ps -ef | grep '" + ServerBinary() + " " + address +
+                    "' | grep -v grep | awk '{print $2}' | xargs -r kill -9";
+  system(cmd.c_str());
+}
+
+int64_t CreateCrashAddress(int64_t address, CrashType crash_type) {
+  return -1 * (crash_type * MAX_ADDRESS_LENGTH + address);
+}
+
+void RunClient(int client_id, Clock::time_point start, std::atomic<bool>& stop, std::vector<Sample>& samples) {
+  BlobClient client(server1_address, server2_address, max_retry_count);
+  if (absl::GetFlag(FLAGS_deadline_ms) > 0) {
+    client.setDeadline(absl::GetFlag(FLAGS_deadline_ms));
+  }
+  client.connect();
+  RequestGenerator request_generator(client_id, absl::GetFlag(FLAGS_write_ratio), absl::GetFlag(FLAGS_store_size),
+                                     "aligned", "uniform");
+  std::string write_data(BLOCK_SIZE, 'a' + client_id % 26);
+  while (!stop) {
+    auto request = request_generator.GetRequest();
+    Sample sample;
+    sample.start_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    int res;
+    if (request.write) {
+      res = client.write(request.address, write_data);
+    } else {
+      std::string read_data;
+      res = client.read(request.address, read_data);
+    }
+    sample.end_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    sample.ok = res >= 0;
+    sample.on_backup = client.get_primary() == server2_address;
+    samples.push_back(sample);
+  }
+}
+
+// Kills the primary. An injected crash is tripped by a request from a
+// client of its own, on the returned thread; the load clients see the rest.
+std::thread CrashPrimary(const std::string& crash_type_name) {
+  if (crash_type_name == "SIGKILL") {
+    KillServers(server1_address);
+    return std::thread();
+  }
+  CrashType crash_type = NO_CRASH;
+  for (CrashType type : {PRIMARY_CRASH_AFTER_LOCAL_PREPARE, PRIMARY_CRASH_AFTER_LOCAL_COMMIT,
+                         PRIMARY_CRASH_BEFORE_READ}) {
+    if (Utils::crash_type_to_string(type) == crash_type_name) {
+      crash_type = type;
+    }
+  }
+  if (crash_type == NO_CRASH) {
+    fprintf(stderr, "[FailoverPerf] Unknown crash type: %s\n", crash_type_name.c_str());
+    exit(1);
+  }
+  return std::thread([crash_type]() {
+    BlobClient client(server1_address, server2_address, max_retry_count);
+    client.connect();
+    int64_t address = CreateCrashAddress(0, crash_type);
+    std::string data(BLOCK_SIZE, 'x');
+    if (crash_type == PRIMARY_CRASH_BEFORE_READ) {
+      client.read(address, data);
+    } else {
+      client.write(address, data);
+    }
+  });
+}
+
+int64_t Percentile(std::vector<int64_t>& samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t idx = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  Utils utils;
+  if (utils.parse_config_file(absl::GetFlag(FLAGS_config_file)) != 0) {
+    fprintf(stderr, "[FailoverPerf] Failed to parse config file\n");
+    return 1;
+  }
+  server1_address = utils.config["server1_address"];
+  server2_address = utils.config["server2_address"];
+  home_dir = utils.config["home_dir"];
+  max_retry_count = atoi(utils.config["max_retry_count"].c_str());
+
+  KillServers();
+  system(("mkdir -p " + home_dir + "/logs").c_str());
+  // The primary starts first so that it takes the primary role.
+  StartServer(server1_address, server2_address, "failover_store1", "failover_server1.log");
+  sleep(1);
+  StartServer(server2_address, server1_address, "failover_store2", "failover_server2.log");
+  sleep(2);
+
+  int num_clients = absl::GetFlag(FLAGS_num_clients);
+  std::vector<std::vector<Sample>> samples(num_clients);
+  std::vector<std::thread> client_threads;
+  std::atomic<bool> stop{false};
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < num_clients; i++) {
+    client_threads.push_back(std::thread(RunClient, i, start, std::ref(stop), std::ref(samples[i])));
+  }
+  std::this_thread::sleep_until(start + std::chrono::milliseconds(absl::GetFlag(FLAGS_crash_after_ms)));
+  int64_t crash_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+  std::thread crash_thread = CrashPrimary(absl::GetFlag(FLAGS_crash_type));
+  std::this_thread::sleep_until(start + std::chrono::milliseconds(absl::GetFlag(FLAGS_duration_ms)));
+  stop = true;
+  for (auto& t : client_threads) {
+    t.join();
+  }
+  if (crash_thread.joinable()) {
+    crash_thread.join();
+  }
+  KillServers();
+
+  std::vector<Sample> all;
+  for (auto& s : samples) {
+    all.insert(all.end(), s.begin(), s.end());
+  }
+  std::sort(all.begin(), all.end(), [](const Sample& a, const Sample& b) { return a.end_us < b.end_us; });
+
+  // Completions per bucket.
+  int64_t bucket_us = absl::GetFlag(FLAGS_bucket_ms) * 1000;
+  size_t num_buckets = absl::GetFlag(FLAGS_duration_ms) * 1000 / bucket_us + 1;
+  std::vector<int> ok(num_buckets), errors(num_buckets), on_backup(num_buckets);
+  std::vector<std::vector<int64_t>> latency_us(num_buckets);
+  for (const Sample& s : all) {
+    size_t b = std::min(num_buckets - 1, (size_t)(s.end_us / bucket_us));
+    (s.ok ? ok[b] : errors[b])++;
+    on_backup[b] += s.ok && s.on_backup;
+    latency_us[b].push_back(s.end_us - s.start_us);
+  }
+
+  // Before the crash, leaving out the first half second of warm-up.
+  size_t crash_bucket = crash_us / bucket_us;
+  size_t warm_bucket = std::min(crash_bucket, (size_t)(500000 / bucket_us));
+  double steady_rate = 0;
+  for (size_t b = warm_bucket; b < crash_bucket; b++) {
+    steady_rate += ok[b];
+  }
+  steady_rate /= std::max<size_t>(1, crash_bucket - warm_bucket);
+
+  // Unavailability: the longest stretch without a successful completion
+  // that ends after the crash.
+  int64_t last_ok_us = 0, gap_start_us = 0, gap_us = 0;
+  int64_t first_backup_ok_us = -1, first_error_us = -1;
+  int total_errors = 0;
+  for (const Sample& s : all) {
+    if (!s.ok) {
+      total_errors++;
+      if (first_error_us < 0 && s.end_us >= crash_us) {
+        first_error_us = s.end_us;
+      }
+      continue;
+    }
+    if (s.end_us >= crash_us && s.end_us - last_ok_us > gap_us) {
+      gap_us = s.end_us - last_ok_us;
+      gap_start_us = last_ok_us;
+    }
+    if (s.on_backup && first_backup_ok_us < 0 && s.end_us >= crash_us) {
+      first_backup_ok_us = s.end_us;
+    }
+    last_ok_us = s.end_us;
+  }
+
+  // Steady state: the first of STEADY_BUCKETS buckets in a row after the
+  // promotion that all complete at least 90% of the pre-crash rate.
+  size_t steady_bucket = num_buckets;
+  size_t promoted_bucket = first_backup_ok_us < 0 ? num_buckets : first_backup_ok_us / bucket_us;
+  for (size_t b = promoted_bucket; b + STEADY_BUCKETS <= num_buckets; b++) {
+    bool steady = true;
+    for (size_t i = b; i < b + STEADY_BUCKETS && steady; i++) {
+      steady = ok[i] >= 0.9 * steady_rate;
+    }
+    if (steady) {
+      steady_bucket = b;
+      break;
+    }
+  }
+
+  printf("[FailoverPerf] Timeline (ms since the crash; completions per %d ms bucket):\n",
+         absl::GetFlag(FLAGS_bucket_ms));
+  printf("%8s %6s %6s %8s %10s %10s\n", "t ms", "ok", "errors", "backup", "p50 us", "max us");
+  size_t first = crash_bucket >= 5 ? crash_bucket - 5 : 0;
+  size_t last = std::min(num_buckets, std::max(steady_bucket, promoted_bucket) + STEADY_BUCKETS + 5);
+  if (steady_bucket == num_buckets) {
+    // Never recovered: the first second after the crash tells enough.
+    last = std::min(last, crash_bucket + 1000000 / bucket_us);
+  }
+  for (size_t b = first; b < last; b++) {
+    int64_t p50 = Percentile(latency_us[b], 0.5);
+    int64_t max = latency_us[b].empty() ? 0 : *std::max_element(latency_us[b].begin(), latency_us[b].end());
+    printf("%8ld %6d %6d %8d %10ld %10ld\n", (long)(((int64_t)(b * bucket_us) - crash_us) / 1000), ok[b],
+           errors[b], on_backup[b], (long)p50, (long)max);
+  }
+
+  auto since_crash = [crash_us](int64_t us) {
+    if (us < 0) {
+      return std::string("none");
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%+.1f ms", (us - crash_us) / 1000.0);
+    return std::string(buf);
+  };
+  printf("\nCrash: %s at %.0f ms, Clients: %d, Write ratio: %.2f, Pre-crash rate: %.1f ops per %d ms\n",
+         absl::GetFlag(FLAGS_crash_type).c_str(), crash_us / 1000.0, num_clients, absl::GetFlag(FLAGS_write_ratio),
+         steady_rate, absl::GetFlag(FLAGS_bucket_ms));
+  printf("Unavailable: %.1f ms (no request succeeded from %s to %s)\n", gap_us / 1000.0,
+         since_crash(gap_start_us).c_str(), since_crash(gap_start_us + gap_us).c_str());
+  printf("First error: %s, first success on the backup: %s, steady again: %s\n",
+         since_crash(first_error_us).c_str(), since_crash(first_backup_ok_us).c_str(),
+         since_crash(steady_bucket < num_buckets ? std::max<int64_t>(steady_bucket * bucket_us, first_backup_ok_us)
+                                                 : -1).c_str());
+  printf("Requests: %zu, errors: %d\n", all.size(), total_errors);
+  return 0;
+}
@@ -0,0 +1,217 @@
+// In-process read scaling benchmark: a primary without backups serves
+// --num_readers threads reading random blocks while a number of writer
+// threads commit writes to random blocks. One run per entry of --writers,
+// with reads that take the shard locks and with lock-free reads, gives the
+// curve of read throughput and latency against write concurrency.
+//
+//   bazel run //client:read_perf --cxxopt=-std=c++17 --copt=-O3 -- --writers=0,1,2,4,8
+#include "server/blob_server.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+ABSL_FLAG(std::string, writers, "0,1,2,4,8", "Writer threads, one run per entry, comma-separated");
+ABSL_FLAG(int, num_readers, 4, "Threads reading from the primary");
+ABSL_FLAG(int, duration_s, 3, "Seconds each run lasts");
+ABSL_FLAG(int64_t, store_size, 16, "Storage size in MBs, written before the runs");
+ABSL_FLAG(std::string, alignment, "aligned", "Read addresses: aligned or unaligned");
+ABSL_FLAG(std::string, self_address, "127.0.0.1:50073", "Address of the primary");
+ABSL_FLAG(std::string, backup_address, "127.0.0.1:50074",
+          "Address of a backup that is not running, so that the primary serves alone");
+ABSL_FLAG(std::string, tmp_dir, "/tmp", "Directory under which the store root is created");
+ABSL_FLAG(int, num_shards, 1, "Number of shards");
+ABSL_FLAG(bool, async_apply, false, "Commit writes to a journal and apply them to block files in the background");
+
+struct Point {
+  int writers;
+  bool lock_free;
+  double read_ops;
+  double write_ops;
+  int64_t read_p50_us;
+  int64_t read_p99_us;
+  int64_t read_max_us;
+  int64_t read_errors;
+  // Aligned reads that returned parts of two images of their block.
+  int64_t torn_reads;
+  int64_t retries;
+  int64_t locked_reads;
+};
+
+// A block of which every 8 bytes are stamp, and not a fill, so that a read
+// that mixes two images of the block can be told apart.
+std::string StampedBlock(uint64_t stamp) {
+  stamp = (stamp << 8) | 0x01;
+  std::string data(BLOCK_SIZE, '\0');
+  for (size_t i = 0; i + sizeof(stamp) <= data.size(); i += sizeof(stamp)) {
+    memcpy(&data[i], &stamp, sizeof(stamp));
+  }
+  return data;
+}
+
+bool IsTorn(const std::string& data) {
+  if (data.size() != BLOCK_SIZE) {
+    return true;
+  }
+  for (size_t i = 8; i + 8 <= data.size(); i += 8) {
+    if (memcmp(&data[i], &data[0], 8) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int64_t Percentile(std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+Point RunPoint(const std::string& root, int64_t store_blocks, int num_writers, bool lock_free) {
+  ServerOptions options;
+  options.num_shards = absl::GetFlag(FLAGS_num_shards);
+  options.async_apply = absl::GetFlag(FLAGS_async_apply);
+  options.lock_free_reads = lock_free;
+  std::shared_ptr<BlobServer> server = std::make_shared<BlobServer>(
+      root, absl::GetFlag(FLAGS_self_address), absl::GetFlag(FLAGS_backup_address), options);
+  server->ServerInit();
+  bool unaligned = absl::GetFlag(FLAGS_alignment) == "unaligned";
+  // The last block has no block after it for an unaligned read.
+  int64_t read_blocks = unaligned ? std::max<int64_t>(1, store_blocks - 1) : store_blocks;
+
+  std::atomic<bool> stop(false);
+  std::atomic<int64_t> writes(0);
+  std::vector<std::vector<int64_t>> latencies(absl::GetFlag(FLAGS_num_readers));
+  std::vector<int64_t> read_errors(latencies.size(), 0);
+  std::vector<int64_t> torn_reads(latencies.size(), 0);
+  std::vector<std::thread> threads;
+  for (size_t r = 0; r < latencies.size(); r++) {
+    threads.push_back(std::thread([&, r]() {
+      std::minstd_rand rng(r + 1);
+      std::string data;
+      while (!stop) {
+        int64_t address = (rng() % read_blocks) * BLOCK_SIZE + (unaligned ? 1 + rng() % (BLOCK_SIZE - 1) : 0);
+        auto start = std::chrono::high_resolution_clock::now();
+        if (!server->Read(address, &data).ok()) {
+          read_errors[r]++;
+        } else if (!unaligned && IsTorn(data)) {
+          torn_reads[r]++;
+        }
+        latencies[r].push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - start).count());
+      }
+    }));
+  }
+  for (int w = 0; w < num_writers; w++) {
+    threads.push_back(std::thread([&, w]() {
+      std::minstd_rand rng(1000 + w);
+      while (!stop) {
+        if (server->Write((rng() % store_blocks) * BLOCK_SIZE, StampedBlock(rng())).ok()) {
+          writes++;
+        }
+      }
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(absl::GetFlag(FLAGS_duration_s)));
+  stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  std::vector<int64_t> all;
+  Point point;
+  point.writers = num_writers;
+  point.lock_free = lock_free;
+  point.read_errors = 0;
+  point.torn_reads = 0;
+  for (size_t r = 0; r < latencies.size(); r++) {
+    all.insert(all.end(), latencies[r].begin(), latencies[r].end());
+    point.read_errors += read_errors[r];
+    point.torn_reads += torn_reads[r];
+  }
+  std::sort(all.begin(), all.end());
+  double seconds = absl::GetFlag(FLAGS_duration_s);
+  point.read_ops = all.size() / seconds;
+  point.write_ops = writes / seconds;
+  point.read_p50_us = Percentile(all, 0.5);
+  point.read_p99_us = Percentile(all, 0.99);
+  point.read_max_us = all.empty() ? 0 : all.back();
+  point.retries = server->get_lock_free_read_retries();
+  point.locked_reads = server->get_locked_reads();
+  server->WaitForBackgroundTasks();
+  return point;
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  std::vector<int> writer_counts;
+  std::stringstream writer_list(absl::GetFlag(FLAGS_writers));
+  std::string count;
+  while (std::getline(writer_list, count, ',')) {
+    writer_counts.push_back(atoi(count.c_str()));
+  }
+
+  std::string root_template = absl::GetFlag(FLAGS_tmp_dir) + "/blobstore-read-XXXXXX";
+  std::vector<char> root_buf(root_template.begin(), root_template.end());
+  root_buf.push_back('\0');
+  if (mkdtemp(root_buf.data()) == nullptr) {
+    perror("[ReadPerf] mkdtemp");
+    return 1;
+  }
+  std::string root(root_buf.data());
+  int64_t store_blocks = std::max<int64_t>(1, absl::GetFlag(FLAGS_store_size) * 1024 * 1024 / BLOCK_SIZE);
+  {
+    ServerOptions options;
+    options.num_shards = absl::GetFlag(FLAGS_num_shards);
+    options.async_apply = absl::GetFlag(FLAGS_async_apply);
+    BlobServer server(root, absl::GetFlag(FLAGS_self_address), absl::GetFlag(FLAGS_backup_address), options);
+    server.ServerInit();
+    printf("[ReadPerf] Populating %ld blocks\n", (long)store_blocks);
+    for (int64_t block = 0; block < store_blocks; block++) {
+      if (!server.Write(block * BLOCK_SIZE, StampedBlock(block)).ok()) {
+        fprintf(stderr, "[ReadPerf] Failed to populate block %ld\n", (long)block);
+        return 1;
+      }
+    }
+    server.WaitForBackgroundTasks();
+  }
+
+  std::vector<Point> points;
+  for (int writers : writer_counts) {
+    for (bool lock_free : {false, true}) {
+      points.push_back(RunPoint(root, store_blocks, writers, lock_free));
+      printf("[ReadPerf] %d writers, %s reads: %.0f reads/s\n", writers, lock_free ? "lock-free" : "locked",
+             points.back().read_ops);
+    }
+  }
+  std::filesystem::remove_all(root);
+
+  // torn: aligned reads that mixed two images of a block. retries: lock-free
+  // reads that raced with a commit to their blocks; locked: reads that then
+  // took the shard locks.
+  printf("\nStore: %ld MB, Readers: %d, Alignment: %s, Shards: %d, Async apply: %d\n",
+         (long)absl::GetFlag(FLAGS_store_size), absl::GetFlag(FLAGS_num_readers),
+         absl::GetFlag(FLAGS_alignment).c_str(), absl::GetFlag(FLAGS_num_shards), absl::GetFlag(FLAGS_async_apply));
+  printf("%8s %10s %12s %10s %10s %10s %10s %8s %8s %10s %10s\n", "writers", "reads", "reads/s", "rd p50 us",
+         "rd p99 us", "rd max us", "writes/s", "errors", "torn", "retries", "locked");
+  for (const Point& p : points) {
+    printf("%8d %10s %12.0f %10ld %10ld %10ld %10.0f %8ld %8ld %10ld %10ld\n", p.writers,
+           p.lock_free ? "lock-free" : "locked", p.read_ops, (long)p.read_p50_us, (long)p.read_p99_us,
+           (long)p.read_max_us, p.write_ops, (long)p.read_errors, (long)p.torn_reads, (long)p.retries,
+           (long)p.locked_reads);
+  }
+  return 0;
+}
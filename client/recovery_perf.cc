@@ -0,0 +1,362 @@
+// In-process recovery benchmark: populates a primary and its backup, takes
+// the backup down, applies a number of writes over a working set to the
+// primary alone, restarts the backup on its old store and reports how long
+// it takes to rejoin, phase by phase. One run per entry of --writes gives the
+// curve of BlobServer start-up and ServerInit -> Recovery against the
+// outage length. Meanwhile --load_writers keep writing to the primary; the
+// longest of their writes shows how long the primary stopped for the backup.
+//
+//   bazel run //client:recovery_perf --cxxopt=-std=c++17 --copt=-O3 -- --writes=10000,100000,1000000,10000000
+#include "server/blob_server.h"
+#include "server/blob_service.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+ABSL_FLAG(std::string, writes, "10000,100000,1000000,10000000",
+          "Writes applied while the backup is down, one run per entry, comma-separated");
+ABSL_FLAG(int64_t, store_size, 64, "Storage size in MBs written before the backup goes down");
+ABSL_FLAG(int64_t, working_set, 1024,
+          "Distinct blocks the outage writes go to (0: the whole store)");
+ABSL_FLAG(int, num_writers, 4, "Threads issuing writes to the primary");
+ABSL_FLAG(int, load_writers, 1, "Threads writing to the primary while the backup rejoins");
+ABSL_FLAG(bool, online_recovery, false,
+          "The backup rejoins with online recovery; the rejoin ends when it has caught up");
+ABSL_FLAG(std::string, primary_address, "127.0.0.1:50071", "Loopback address of the primary");
+ABSL_FLAG(std::string, backup_address, "127.0.0.1:50072", "Loopback address of the backup");
+ABSL_FLAG(std::string, tmp_dir, "/tmp", "Directory under which per-run store roots are created");
+ABSL_FLAG(int, num_shards, 1, "Number of shards per server");
+ABSL_FLAG(bool, async_apply, false, "Commit writes to a journal and apply them to block files in the background");
+ABSL_FLAG(bool, verify, false,
+          "After each rejoin, compare the backup's blocks with the primary's (anti-entropy) and report differences");
+ABSL_FLAG(int, compression, 0,
+          "Block compression in replication and recovery: 0 none, 1 deflate, 2 deflate level 1");
+
+// Heap allocations made through operator new, by both replicas and the load.
+std::atomic<int64_t> num_allocations{0};
+
+void* operator new(size_t size) {
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+// GCC treats operator new as the library's, so once a delete is inlined next
+// to its new it warns that the malloc'ed block is freed with free().
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+#pragma GCC diagnostic pop
+
+// Peak resident set size since the last ResetPeakRss, in bytes.
+int64_t PeakRss() {
+  FILE* status = fopen("/proc/self/status", "r");
+  if (status == nullptr) {
+    return 0;
+  }
+  char line[256];
+  int64_t kb = 0;
+  while (fgets(line, sizeof(line), status) != nullptr) {
+    if (strncmp(line, "VmHWM:", 6) == 0) {
+      kb = atoll(line + 6);
+    }
+  }
+  fclose(status);
+  return kb * 1024;
+}
+
+void ResetPeakRss() {
+  FILE* clear_refs = fopen("/proc/self/clear_refs", "w");
+  if (clear_refs != nullptr) {
+    fputs("5", clear_refs);
+    fclose(clear_refs);
+  }
+}
+
+struct Replica {
+  std::shared_ptr<BlobServer> blobserver;
+  std::unique_ptr<BlobStoreImpl> blobstore_service;
+  std::unique_ptr<StoreInternalImpl> store_internal_service;
+  std::unique_ptr<grpc::Server> server;
+};
+
+// Time spent in the BlobServer constructor (allocation map, logs, journal),
+// in ServerInit (ping, Recovery) and, with online recovery, catching up.
+struct StartTimes {
+  int64_t construct_us = 0;
+  int64_t init_us = 0;
+  int64_t catch_up_us = 0;
+};
+
+std::unique_ptr<Replica> StartReplica(const std::string& self_address,
+                                      const std::string& other_addresses,
+                                      const std::string& root_dir,
+                                      StartTimes* times = nullptr) {
+  std::unique_ptr<Replica> replica(new Replica());
+  ServerOptions options;
+  options.num_shards = absl::GetFlag(FLAGS_num_shards);
+  options.async_apply = absl::GetFlag(FLAGS_async_apply);
+  options.compression = absl::GetFlag(FLAGS_compression);
+  options.online_recovery = absl::GetFlag(FLAGS_online_recovery);
+  auto start = std::chrono::high_resolution_clock::now();
+  replica->blobserver = std::make_shared<BlobServer>(root_dir, self_address, other_addresses, options);
+  replica->blobstore_service.reset(new BlobStoreImpl(replica->blobserver));
+  replica->store_internal_service.reset(new StoreInternalImpl(replica->blobserver));
+
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(self_address, grpc::InsecureServerCredentials());
+  builder.RegisterService(replica->blobstore_service.get());
+  builder.RegisterService(replica->store_internal_service.get());
+  replica->server = builder.BuildAndStart();
+  if (!replica->server) {
+    fprintf(stderr, "[RecoveryPerf] Failed to listen on %s\n", self_address.c_str());
+    exit(1);
+  }
+  auto constructed = std::chrono::high_resolution_clock::now();
+  replica->blobserver->ServerInit();
+  auto end = std::chrono::high_resolution_clock::now();
+  if (times != nullptr) {
+    times->construct_us = std::chrono::duration_cast<std::chrono::microseconds>(constructed - start).count();
+    times->init_us = std::chrono::duration_cast<std::chrono::microseconds>(end - constructed).count();
+    if (!replica->blobserver->WaitForCatchUp(3600 * 1000)) {
+      fprintf(stderr, "[RecoveryPerf] %s did not catch up\n", self_address.c_str());
+    }
+    times->catch_up_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - end).count();
+  }
+  return replica;
+}
+
+void StopReplica(std::unique_ptr<Replica>& replica) {
+  if (!replica) {
+    return;
+  }
+  // The primary's Replicate streams to it stay open; cancel them rather
+  // than wait for them to end.
+  replica->server->Shutdown(std::chrono::system_clock::now());
+  replica->server->Wait();
+  replica.reset();
+}
+
+// Writes num_writes blocks to server, spread over num_writers threads. Write
+// i goes to block i % num_blocks, so that every block of the set is written
+// before any is written twice.
+int64_t WriteBlocks(BlobServer* server, int64_t num_writes, int64_t num_blocks) {
+  int num_writers = std::max(1, absl::GetFlag(FLAGS_num_writers));
+  std::atomic<int64_t> next(0);
+  std::atomic<int64_t> errors(0);
+  std::vector<std::thread> writers;
+  for (int w = 0; w < num_writers; w++) {
+    writers.push_back(std::thread([&, w]() {
+      std::minstd_rand rng(w + 1);
+      std::string data(BLOCK_SIZE, '\0');
+      for (char& c : data) c = 'A' + rng() % 26;
+      while (true) {
+        int64_t i = next.fetch_add(1);
+        if (i >= num_writes) {
+          break;
+        }
+        // A different image every time, so that no write is a no-op.
+        memcpy(&data[0], &i, sizeof(i));
+        if (!server->Write((i % num_blocks) * BLOCK_SIZE, data).ok()) {
+          errors++;
+        }
+      }
+    }));
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  return errors;
+}
+
+// Writes to the primary until stop is set, recording the longest one.
+struct Load {
+  std::atomic<bool> stop{false};
+  std::atomic<int64_t> writes{0};
+  std::atomic<int64_t> errors{0};
+  std::atomic<int64_t> max_us{0};
+  std::vector<std::thread> threads;
+};
+
+void StartLoad(Load& load, BlobServer* server, int64_t num_blocks) {
+  for (int w = 0; w < absl::GetFlag(FLAGS_load_writers); w++) {
+    load.threads.push_back(std::thread([&load, server, num_blocks, w]() {
+      std::minstd_rand rng(1000 + w);
+      std::string data(BLOCK_SIZE, 'L');
+      while (!load.stop) {
+        auto start = std::chrono::high_resolution_clock::now();
+        absl::Status status = server->Write((rng() % num_blocks) * BLOCK_SIZE, data);
+        int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        int64_t max_us = load.max_us;
+        while (us > max_us && !load.max_us.compare_exchange_weak(max_us, us)) {}
+        if (status.ok()) {
+          load.writes++;
+        } else {
+          load.errors++;
+        }
+      }
+    }));
+  }
+}
+
+void StopLoad(Load& load) {
+  load.stop = true;
+  for (auto& t : load.threads) {
+    t.join();
+  }
+}
+
+struct Point {
+  int64_t writes;
+  int64_t write_errors;
+  double write_s;
+  int64_t load_writes;
+  int64_t load_errors;
+  int64_t max_stall_us;
+  StartTimes start;
+  RecoveryStats backup;
+  RecoveryStats primary;
+  int64_t recovery_bytes;
+  // Over the rejoin: heap allocations, and peak RSS above the RSS before it.
+  int64_t allocations;
+  int64_t peak_rss_growth;
+};
+
+double Ms(int64_t us) {
+  return us / 1000.0;
+}
+
+Point RunPoint(int64_t num_writes) {
+  std::string primary_address = absl::GetFlag(FLAGS_primary_address);
+  std::string backup_address = absl::GetFlag(FLAGS_backup_address);
+  std::string root_template = absl::GetFlag(FLAGS_tmp_dir) + "/blobstore-recovery-XXXXXX";
+  std::vector<char> root_buf(root_template.begin(), root_template.end());
+  root_buf.push_back('\0');
+  if (mkdtemp(root_buf.data()) == nullptr) {
+    perror("[RecoveryPerf] mkdtemp");
+    exit(1);
+  }
+  std::string root(root_buf.data());
+  int64_t store_blocks = std::max<int64_t>(1, absl::GetFlag(FLAGS_store_size) * 1024 * 1024 / BLOCK_SIZE);
+  int64_t working_set = absl::GetFlag(FLAGS_working_set);
+  if (working_set <= 0 || working_set > store_blocks) {
+    working_set = store_blocks;
+  }
+
+  // The primary starts first so that its ping to the (not yet running)
+  // backup fails and it takes the primary role.
+  std::unique_ptr<Replica> primary = StartReplica(primary_address, backup_address, root + "/primary");
+  std::unique_ptr<Replica> backup = StartReplica(backup_address, primary_address, root + "/backup");
+  printf("[RecoveryPerf] Populating %ld blocks\n", (long)store_blocks);
+  int64_t populate_errors = WriteBlocks(primary->blobserver.get(), store_blocks, store_blocks);
+  primary->blobserver->WaitForBackgroundTasks();
+
+  StopReplica(backup);
+  printf("[RecoveryPerf] Backup down, %ld writes over %ld blocks\n", (long)num_writes, (long)working_set);
+  Point point;
+  point.writes = num_writes;
+  auto write_start = std::chrono::high_resolution_clock::now();
+  point.write_errors = populate_errors + WriteBlocks(primary->blobserver.get(), num_writes, working_set);
+  point.write_s = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::high_resolution_clock::now() - write_start).count() / 1e6;
+  primary->blobserver->WaitForBackgroundTasks();
+
+  printf("[RecoveryPerf] Restarting backup\n");
+  Load load;
+  ResetPeakRss();
+  int64_t rss_before = PeakRss();
+  int64_t allocations_before = num_allocations;
+  StartLoad(load, primary->blobserver.get(), working_set);
+  backup = StartReplica(backup_address, primary_address, root + "/backup", &point.start);
+  StopLoad(load);
+  point.allocations = num_allocations - allocations_before;
+  point.peak_rss_growth = PeakRss() - rss_before;
+  point.load_writes = load.writes;
+  point.load_errors = load.errors;
+  point.max_stall_us = load.max_us;
+  point.backup = backup->blobserver->get_recovery_stats();
+  point.primary = primary->blobserver->get_recovery_stats();
+  point.recovery_bytes = primary->blobserver->get_recovery_bytes().sent_bytes;
+  if (absl::GetFlag(FLAGS_verify)) {
+    primary->blobserver->WaitForBackgroundTasks();
+    AntiEntropyStats verify_stats;
+    absl::Status status = backup->blobserver->AntiEntropy(&verify_stats);
+    printf("[RecoveryPerf] Verify: %s, %ld blocks differ\n",
+           status.ok() ? "ok" : std::string(status.message()).c_str(), (long)verify_stats.divergent_blocks);
+  }
+
+  StopReplica(backup);
+  StopReplica(primary);
+  std::filesystem::remove_all(root);
+  return point;
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  std::vector<int64_t> write_counts;
+  std::stringstream write_list(absl::GetFlag(FLAGS_writes));
+  std::string count;
+  while (std::getline(write_list, count, ',')) {
+    write_counts.push_back(atoll(count.c_str()));
+  }
+
+  std::vector<Point> points;
+  for (int64_t num_writes : write_counts) {
+    points.push_back(RunPoint(num_writes));
+    const Point& p = points.back();
+    printf("[RecoveryPerf] %ld writes in %.1f s (%ld errors), rejoin %.1f ms, %ld writes meanwhile (%ld errors)\n",
+           (long)p.writes, p.write_s, (long)p.write_errors,
+           Ms(p.start.construct_us + p.start.init_us + p.start.catch_up_us), (long)p.load_writes,
+           (long)p.load_errors);
+  }
+
+  // other: serialization, transfer and waiting, what the rejoin took
+  // outside the phases before it. pause: clients stopped on the primary.
+  // allocs, peak MB: heap allocations and peak RSS growth during the rejoin.
+  printf("\nStore: %ld MB, Working set: %ld blocks, Writers: %d, Shards: %d, Async apply: %d, Compression: %d, Online recovery: %d\n",
+         (long)absl::GetFlag(FLAGS_store_size), (long)absl::GetFlag(FLAGS_working_set),
+         absl::GetFlag(FLAGS_num_writers), absl::GetFlag(FLAGS_num_shards), absl::GetFlag(FLAGS_async_apply),
+         absl::GetFlag(FLAGS_compression), absl::GetFlag(FLAGS_online_recovery));
+  printf("%10s %10s %10s %12s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "writes", "log ents",
+         "records", "sent bytes", "start ms", "read logs", "merge", "create", "replay", "other", "rejoin ms",
+         "pause ms", "max stall", "allocs", "peak MB");
+  for (const Point& p : points) {
+    int64_t rejoin_us = p.start.construct_us + p.start.init_us + p.start.catch_up_us;
+    int64_t other_us = rejoin_us - p.start.construct_us - p.backup.read_logs_us - p.primary.merge_us -
+                       p.primary.create_records_us - p.backup.replay_us;
+    printf("%10ld %10ld %10ld %12ld %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10ld %10.1f\n",
+           (long)p.writes, (long)p.backup.log_entries, (long)p.backup.records, (long)p.recovery_bytes,
+           Ms(p.start.construct_us), Ms(p.backup.read_logs_us), Ms(p.primary.merge_us),
+           Ms(p.primary.create_records_us), Ms(p.backup.replay_us), Ms(std::max<int64_t>(0, other_us)),
+           Ms(rejoin_us), Ms(p.primary.pause_us), Ms(p.max_stall_us), (long)p.allocations,
+           p.peak_rss_growth / (1024.0 * 1024.0));
+  }
+  return 0;
+}
@@ -0,0 +1,230 @@
+// In-process snapshot benchmark: a primary without backups serves writer
+// threads while an exporter reads the whole store as of a snapshot with
+// ReadRange. Before each export the writers pause for a moment so that the
+// exporter can note what every block holds at the snapshot; the export,
+// which runs while they write, must return exactly that. One run per entry
+// of --writers reports the export and write rates, and the block images the
+// snapshot kept.
+//
+//   bazel run //client:snapshot_perf --cxxopt=-std=c++17 --copt=-O3 -- --writers=0,1,4,8
+#include "server/blob_server.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+ABSL_FLAG(std::string, writers, "0,1,4,8", "Writer threads, one run per entry, comma-separated");
+ABSL_FLAG(int, exports, 3, "Snapshot exports per run");
+ABSL_FLAG(int64_t, store_size, 16, "Storage size in MBs, written before the runs");
+ABSL_FLAG(int, chunk_size, 0, "Bytes per range read chunk (0: the server's default)");
+ABSL_FLAG(int, snapshot_max_mb, 256, "Bound of the block images kept for snapshots, in MB");
+ABSL_FLAG(std::string, self_address, "127.0.0.1:50075", "Address of the primary");
+ABSL_FLAG(std::string, backup_address, "127.0.0.1:50076",
+          "Address of a backup that is not running, so that the primary serves alone");
+ABSL_FLAG(std::string, tmp_dir, "/tmp", "Directory under which the store root is created");
+ABSL_FLAG(int, num_shards, 1, "Number of shards");
+ABSL_FLAG(bool, async_apply, false, "Commit writes to a journal and apply them to block files in the background");
+
+struct Point {
+  int writers;
+  int exports;
+  // Exports that failed or whose snapshot could not be released, blocks
+  // that could not be read to check an export, and blocks that differed
+  // from the snapshot.
+  int failed_exports;
+  int64_t failed_reads;
+  int64_t mismatches;
+  double export_ms;
+  double export_mb_s;
+  double write_ops;
+  // Largest number of images kept during an export, and their bytes.
+  int64_t peak_versions;
+  int64_t peak_bytes;
+  // Left over once every snapshot was released.
+  int64_t versions_after;
+  int64_t expired;
+};
+
+std::string RandomBlock(std::minstd_rand& rng) {
+  std::string data(BLOCK_SIZE, '\0');
+  for (char& c : data) c = 'A' + rng() % 26;
+  return data;
+}
+
+ServerOptions Options() {
+  ServerOptions options;
+  options.num_shards = absl::GetFlag(FLAGS_num_shards);
+  options.async_apply = absl::GetFlag(FLAGS_async_apply);
+  options.snapshot_max_mb = absl::GetFlag(FLAGS_snapshot_max_mb);
+  return options;
+}
+
+Point RunPoint(const std::string& root, int64_t store_blocks, int num_writers) {
+  std::shared_ptr<BlobServer> server = std::make_shared<BlobServer>(
+      root, absl::GetFlag(FLAGS_self_address), absl::GetFlag(FLAGS_backup_address), Options());
+  server->ServerInit();
+
+  // Writers hold pause shared for each write; the exporter takes it to note
+  // the contents at the snapshot, and holds the gate meanwhile so that the
+  // writers let it in.
+  std::shared_timed_mutex pause;
+  std::mutex gate;
+  std::atomic<bool> stop(false);
+  std::atomic<int64_t> writes(0);
+  std::vector<std::thread> writers;
+  for (int w = 0; w < num_writers; w++) {
+    writers.push_back(std::thread([&, w]() {
+      std::minstd_rand rng(1000 + w);
+      std::string data = RandomBlock(rng);
+      while (!stop) {
+        data[0] = 'A' + rng() % 26;
+        {
+          std::lock_guard<std::mutex> wait(gate);
+        }
+        std::shared_lock<std::shared_timed_mutex> lock(pause);
+        if (server->Write((rng() % store_blocks) * BLOCK_SIZE, data).ok()) {
+          writes++;
+        }
+      }
+    }));
+  }
+
+  Point point = {};
+  point.writers = num_writers;
+  point.exports = absl::GetFlag(FLAGS_exports);
+  int64_t export_us = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int e = 0; e < point.exports; e++) {
+    int64_t snapshot;
+    std::vector<size_t> expected(store_blocks);
+    std::vector<bool> checked(store_blocks, true);
+    {
+      std::lock_guard<std::mutex> closed(gate);
+      std::unique_lock<std::shared_timed_mutex> lock(pause);
+      if (!server->CreateSnapshot(&snapshot).ok()) {
+        point.failed_exports++;
+        continue;
+      }
+      std::string data;
+      for (int64_t block = 0; block < store_blocks; block++) {
+        if (!server->Read(block * BLOCK_SIZE, &data).ok()) {
+          point.failed_reads++;
+          checked[block] = false;
+          continue;
+        }
+        expected[block] = std::hash<std::string>()(data);
+      }
+    }
+    auto export_start = std::chrono::high_resolution_clock::now();
+    absl::Status status = server->ReadRange(0, store_blocks * BLOCK_SIZE, absl::GetFlag(FLAGS_chunk_size),
+                                            [&](int64_t address, std::string& chunk) {
+      for (size_t offset = 0; offset < chunk.size(); offset += BLOCK_SIZE) {
+        int64_t block = (address + offset) / BLOCK_SIZE;
+        if (checked[block] && std::hash<std::string>()(chunk.substr(offset, BLOCK_SIZE)) != expected[block]) {
+          point.mismatches++;
+        }
+      }
+      SnapshotStats stats = server->get_snapshot_stats();
+      point.peak_versions = std::max(point.peak_versions, stats.versions);
+      point.peak_bytes = std::max(point.peak_bytes, stats.bytes);
+      return true;
+    }, snapshot);
+    export_us += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - export_start).count();
+    if (!status.ok()) {
+      fprintf(stderr, "[SnapshotPerf] Export failed: %s\n", std::string(status.message()).c_str());
+      point.failed_exports++;
+    }
+    absl::Status released = server->ReleaseSnapshot(snapshot);
+    if (!released.ok()) {
+      fprintf(stderr, "[SnapshotPerf] Release failed: %s\n", std::string(released.message()).c_str());
+      point.failed_exports++;
+    }
+  }
+  double seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::high_resolution_clock::now() - start).count() / 1e6;
+  stop = true;
+  for (auto& t : writers) {
+    t.join();
+  }
+  server->WaitForBackgroundTasks();
+
+  SnapshotStats stats = server->get_snapshot_stats();
+  point.versions_after = stats.versions;
+  point.expired = stats.expired;
+  point.export_ms = export_us / 1000.0 / std::max(1, point.exports);
+  point.export_mb_s = export_us > 0 ? point.exports * store_blocks * BLOCK_SIZE / (export_us / 1e6) / (1 << 20) : 0;
+  point.write_ops = writes / seconds;
+  return point;
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  std::vector<int> writer_counts;
+  std::stringstream writer_list(absl::GetFlag(FLAGS_writers));
+  std::string count;
+  while (std::getline(writer_list, count, ',')) {
+    writer_counts.push_back(atoi(count.c_str()));
+  }
+
+  std::string root_template = absl::GetFlag(FLAGS_tmp_dir) + "/blobstore-snapshot-XXXXXX";
+  std::vector<char> root_buf(root_template.begin(), root_template.end());
+  root_buf.push_back('\0');
+  if (mkdtemp(root_buf.data()) == nullptr) {
+    perror("[SnapshotPerf] mkdtemp");
+    return 1;
+  }
+  std::string root(root_buf.data());
+  int64_t store_blocks = std::max<int64_t>(1, absl::GetFlag(FLAGS_store_size) * 1024 * 1024 / BLOCK_SIZE);
+  {
+    BlobServer server(root, absl::GetFlag(FLAGS_self_address), absl::GetFlag(FLAGS_backup_address), Options());
+    server.ServerInit();
+    printf("[SnapshotPerf] Populating %ld blocks\n", (long)store_blocks);
+    std::minstd_rand rng(0);
+    for (int64_t block = 0; block < store_blocks; block++) {
+      if (!server.Write(block * BLOCK_SIZE, RandomBlock(rng)).ok()) {
+        fprintf(stderr, "[SnapshotPerf] Failed to populate block %ld\n", (long)block);
+        return 1;
+      }
+    }
+    server.WaitForBackgroundTasks();
+  }
+
+  std::vector<Point> points;
+  for (int writers : writer_counts) {
+    points.push_back(RunPoint(root, store_blocks, writers));
+    printf("[SnapshotPerf] %d writers: %ld mismatches, %ld failed reads\n", writers,
+           (long)points.back().mismatches, (long)points.back().failed_reads);
+  }
+  std::filesystem::remove_all(root);
+
+  // kept, kept MB: most images the snapshot held during an export; after:
+  // images left once it was released; unread: blocks an export could not be
+  // checked against.
+  printf("\nStore: %ld MB, Exports: %d, Snapshot bound: %d MB, Shards: %d, Async apply: %d\n",
+         (long)absl::GetFlag(FLAGS_store_size), absl::GetFlag(FLAGS_exports), absl::GetFlag(FLAGS_snapshot_max_mb),
+         absl::GetFlag(FLAGS_num_shards), absl::GetFlag(FLAGS_async_apply));
+  printf("%8s %10s %10s %10s %10s %10s %10s %10s %8s %8s %8s\n", "writers", "export ms", "export MB/s", "writes/s",
+         "kept", "kept MB", "after", "mismatch", "unread", "failed", "expired");
+  for (const Point& p : points) {
+    printf("%8d %10.1f %10.1f %10.0f %10ld %10.1f %10ld %10ld %8ld %8d %8ld\n", p.writers, p.export_ms,
+           p.export_mb_s, p.write_ops, (long)p.peak_versions, p.peak_bytes / (1024.0 * 1024.0),
+           (long)p.versions_after, (long)p.mismatches, (long)p.failed_reads, p.failed_exports, (long)p.expired);
+  }
+  return 0;
+}
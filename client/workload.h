@@ -0,0 +1,77 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+
+// Request generators shared by the performance harnesses (client_perf, cluster_perf).
+
+struct Request {
+  int64_t address;
+  bool write;
+};
+
+class RequestGenerator {
+ public:
+  RequestGenerator() = delete;
+  RequestGenerator(int client_id, float write_ratio, int64_t store_size,
+                    std::string alignment, std::string key_distribution):
+                    generator_(std::random_device{}()), uniform_dist_(0.0, 1.0), exponential_dist_(3.0) {
+    alignment_ = alignment;
+    write_ratio_ = write_ratio;
+    store_size_ = store_size*1024*1024;
+    key_distribution_ = key_distribution;
+  }
+  bool IsWrite() {
+    double x = uniform_dist_(generator_);
+    return x <= write_ratio_;
+  }
+  // hotspot: 90% of the requests go to the first 1% of the store (at least a block).
+  double HotspotOffset() {
+    double hot_size = std::max(4096.0, store_size_ * 0.01);
+    if (uniform_dist_(generator_) < 0.9) {
+      return uniform_dist_(generator_) * hot_size;
+    }
+    return uniform_dist_(generator_) * store_size_;
+  }
+  int64_t GetAddress() {
+    if (alignment_ == "aligned") {
+      if (key_distribution_ == "uniform") {
+        return int64_t((uniform_dist_(generator_) * store_size_)/4096)*4096;
+      } else if (key_distribution_ == "exponential") {
+        return int64_t((exponential_dist_(generator_) * store_size_)/4096)*4096;
+      } else if (key_distribution_ == "hotspot") {
+        return int64_t(HotspotOffset()/4096)*4096;
+      }
+    } else if (alignment_ == "unaligned") {
+      if (key_distribution_ == "uniform") {
+        return int64_t((uniform_dist_(generator_) * store_size_));
+      } else if (key_distribution_ == "exponential") {
+        return int64_t((exponential_dist_(generator_) * store_size_));
+      } else if (key_distribution_ == "hotspot") {
+        return int64_t(HotspotOffset());
+      }
+    }
+    printf("Unknown alignment/key distribution: %s/%s\n", alignment_.c_str(), key_distribution_.c_str());
+    return -1;
+  }
+  Request GetRequest() {
+    Request r;
+    r.address = GetAddress();
+    r.write = IsWrite();
+    return r;
+  }
+
+ private:
+ std::mt19937 generator_;
+ std::uniform_real_distribution<double> uniform_dist_;
+ std::exponential_distribution<double> exponential_dist_;
+ std::string alignment_;
+ double write_ratio_;
+ int64_t store_size_;
+ std::string key_distribution_;
+};
+
+#endif // WORKLOAD_H
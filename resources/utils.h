@@ -4,6 +4,9 @@
 #include <unordered_map>
 #include <fstream>
 #define MAX_ADDRESS_LENGTH 100000
+// Trailing metadata of a RESOURCE_EXHAUSTED reply: milliseconds the client
+// should wait before sending the request again.
+#define RETRY_AFTER_METADATA_KEY "retry-after-ms"
 
 
 // create enums for crash types
@@ -0,0 +1,160 @@
+#include "access_profile.h"
+#include <algorithm>
+#include <limits>
+
+AccessProfile::AccessProfile(int64_t region_blocks, int num_lock_slots)
+    : region_blocks_(std::max<int64_t>(1, region_blocks)), lock_slot_writes_(std::max(1, num_lock_slots)) {}
+
+// splitmix64 of the block, salted per row.
+size_t AccessProfile::Column(int row, int64_t block) {
+  uint64_t x = (uint64_t)block + (uint64_t)(row + 1) * 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return row * ACCESS_SKETCH_WIDTH + (x & (ACCESS_SKETCH_WIDTH - 1));
+}
+
+void AccessProfile::Record(int64_t block, bool write) {
+  uint32_t estimate = std::numeric_limits<uint32_t>::max();
+  for(int row = 0; row < ACCESS_SKETCH_DEPTH; row++) {
+    estimate = std::min(estimate, sketch_[Column(row, block)].fetch_add(1, std::memory_order_relaxed) + 1);
+  }
+  OfferTop(block, estimate);
+
+  int64_t region = block / region_blocks_;
+  RegionStripe& stripe = region_stripes_[(uint64_t)region % ACCESS_REGION_STRIPES];
+  {
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    RegionCount& count = stripe.regions[region];
+    count.region = region;
+    if(write) {
+      count.writes++;
+    } else {
+      count.reads++;
+    }
+  }
+  if(write) {
+    lock_slot_writes_[block % lock_slot_writes_.size()].fetch_add(1, std::memory_order_relaxed);
+    writes_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    reads_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// The heavy hitters never hold up an access: if another one is updating
+// them, this estimate is skipped, and the block's next access offers a
+// larger one.
+void AccessProfile::OfferTop(int64_t block, int64_t estimate) {
+  if(estimate <= top_threshold_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(top_mutex_, std::try_to_lock);
+  if(!lock.owns_lock()) {
+    return;
+  }
+  int64_t& count = top_[block];
+  count = std::max(count, estimate);
+  if(top_.size() <= ACCESS_TOP_BLOCKS) {
+    if(top_.size() == ACCESS_TOP_BLOCKS) {
+      auto min = std::min_element(top_.begin(), top_.end(),
+                                  [](const auto& a, const auto& b) { return a.second < b.second; });
+      top_threshold_ = min->second;
+    }
+    return;
+  }
+  auto min = std::min_element(top_.begin(), top_.end(),
+                              [](const auto& a, const auto& b) { return a.second < b.second; });
+  top_.erase(min);
+  min = std::min_element(top_.begin(), top_.end(),
+                         [](const auto& a, const auto& b) { return a.second < b.second; });
+  top_threshold_ = min->second;
+}
+
+// Accesses racing with the halving may be lost; the profile is an estimate.
+void AccessProfile::Decay() {
+  for(auto& counter : sketch_) {
+    counter.store(counter.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+  }
+  {
+    std::lock_guard<std::mutex> lock(top_mutex_);
+    int64_t threshold = std::numeric_limits<int64_t>::max();
+    for(auto it = top_.begin(); it != top_.end();) {
+      it->second = Estimate(it->first);
+      if(it->second == 0) {
+        it = top_.erase(it);
+        continue;
+      }
+      threshold = std::min(threshold, it->second);
+      it++;
+    }
+    top_threshold_ = top_.size() < ACCESS_TOP_BLOCKS ? 0 : threshold;
+  }
+  for(auto& stripe : region_stripes_) {
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    for(auto it = stripe.regions.begin(); it != stripe.regions.end();) {
+      it->second.reads /= 2;
+      it->second.writes /= 2;
+      if(it->second.reads == 0 && it->second.writes == 0) {
+        it = stripe.regions.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+  for(auto& counter : lock_slot_writes_) {
+    counter.store(counter.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+  }
+  reads_.store(reads_ / 2);
+  writes_.store(writes_ / 2);
+}
+
+int64_t AccessProfile::Estimate(int64_t block) {
+  uint32_t estimate = std::numeric_limits<uint32_t>::max();
+  for(int row = 0; row < ACCESS_SKETCH_DEPTH; row++) {
+    estimate = std::min(estimate, sketch_[Column(row, block)].load(std::memory_order_relaxed));
+  }
+  return estimate;
+}
+
+std::vector<AccessProfile::BlockCount> AccessProfile::TopBlocks(size_t n) {
+  std::vector<BlockCount> blocks;
+  {
+    std::lock_guard<std::mutex> lock(top_mutex_);
+    for(auto& entry : top_) {
+      blocks.push_back(BlockCount{entry.first, Estimate(entry.first)});
+    }
+  }
+  std::sort(blocks.begin(), blocks.end(), [](const BlockCount& a, const BlockCount& b) {
+    return a.accesses != b.accesses ? a.accesses > b.accesses : a.block < b.block;
+  });
+  if(blocks.size() > n) {
+    blocks.resize(n);
+  }
+  return blocks;
+}
+
+std::vector<AccessProfile::RegionCount> AccessProfile::TopRegions(size_t n) {
+  std::vector<RegionCount> regions;
+  for(auto& stripe : region_stripes_) {
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    for(auto& entry : stripe.regions) {
+      regions.push_back(entry.second);
+    }
+  }
+  std::sort(regions.begin(), regions.end(), [](const RegionCount& a, const RegionCount& b) {
+    int64_t a_total = a.reads + a.writes, b_total = b.reads + b.writes;
+    return a_total != b_total ? a_total > b_total : a.region < b.region;
+  });
+  if(regions.size() > n) {
+    regions.resize(n);
+  }
+  return regions;
+}
+
+std::vector<int64_t> AccessProfile::LockSlotWrites() {
+  std::vector<int64_t> writes;
+  for(auto& counter : lock_slot_writes_) {
+    writes.push_back(counter.load(std::memory_order_relaxed));
+  }
+  return writes;
+}
@@ -0,0 +1,87 @@
+#ifndef ACCESS_PROFILE_H
+#define ACCESS_PROFILE_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Count-min sketch shape: ACCESS_SKETCH_DEPTH rows of ACCESS_SKETCH_WIDTH
+// counters (a power of two). An estimate overcounts by at most about
+// e / width of all accesses, with probability 1 - e^-depth.
+#define ACCESS_SKETCH_DEPTH 4
+#define ACCESS_SKETCH_WIDTH 4096
+// Heavy hitters kept by AccessProfile.
+#define ACCESS_TOP_BLOCKS 64
+// Region counters are split over this many independently locked maps.
+#define ACCESS_REGION_STRIPES 16
+
+// Where the reads and writes of a server go, cheaply enough to stay on in
+// production. Per block, a count-min sketch gives an estimate of the accesses
+// of any block and keeps the ACCESS_TOP_BLOCKS blocks with the largest
+// estimates. Per region (a run of region_blocks blocks) and per block lock
+// slot, reads and writes are counted exactly.
+//
+// Decay halves every count, so that after a few periods the profile shows
+// the recent traffic rather than everything since start-up.
+class AccessProfile {
+  public:
+  struct BlockCount {
+    int64_t block;
+    // Upper bound of the accesses, reads and writes.
+    int64_t accesses;
+  };
+  struct RegionCount {
+    int64_t region;
+    int64_t reads = 0;
+    int64_t writes = 0;
+  };
+
+  AccessProfile(int64_t region_blocks, int num_lock_slots);
+
+  void Record(int64_t block, bool write);
+  void Decay();
+
+  int64_t Estimate(int64_t block);
+  // Hottest first.
+  std::vector<BlockCount> TopBlocks(size_t n);
+  std::vector<RegionCount> TopRegions(size_t n);
+  // Writes per block lock slot (block % num_lock_slots).
+  std::vector<int64_t> LockSlotWrites();
+  int64_t get_region_blocks() {
+    return region_blocks_;
+  }
+  int64_t get_reads() {
+    return reads_;
+  }
+  int64_t get_writes() {
+    return writes_;
+  }
+
+  private:
+  static size_t Column(int row, int64_t block);
+  // Record an estimate for block in the heavy hitters if it is one.
+  void OfferTop(int64_t block, int64_t estimate);
+
+  const int64_t region_blocks_;
+  std::array<std::atomic<uint32_t>, ACCESS_SKETCH_DEPTH * ACCESS_SKETCH_WIDTH> sketch_{};
+
+  std::mutex top_mutex_;
+  std::unordered_map<int64_t, int64_t> top_;
+  // Smallest estimate in top_ once it is full; smaller ones skip the lock.
+  std::atomic<int64_t> top_threshold_{0};
+
+  struct RegionStripe {
+    std::mutex mutex;
+    std::unordered_map<int64_t, RegionCount> regions;
+  };
+  std::array<RegionStripe, ACCESS_REGION_STRIPES> region_stripes_;
+
+  std::vector<std::atomic<int64_t>> lock_slot_writes_;
+  std::atomic<int64_t> reads_{0};
+  std::atomic<int64_t> writes_{0};
+};
+
+#endif // ACCESS_PROFILE_H
@@ -0,0 +1,54 @@
+#include "admission.h"
+#include <algorithm>
+#include <cmath>
+
+// Floor of the adaptive bound, so that a slow disk never stops a kind of
+// request altogether.
+static const double MIN_LIMIT = 1;
+// Cap of the retry-after hint.
+static const int64_t MAX_RETRY_AFTER_MS = 1000;
+
+AdmissionLimiter::AdmissionLimiter(int max_limit, int64_t target_latency_us)
+    : max_limit_(max_limit), target_latency_us_(target_latency_us), limit_(max_limit) {}
+
+bool AdmissionLimiter::TryAcquire(int64_t* retry_after_ms) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if(max_limit_ <= 0 || in_flight_ < (int)limit_) {
+    in_flight_++;
+    return true;
+  }
+  rejected_++;
+  // The requests ahead finish in about one average latency each, limit_ of
+  // them at a time.
+  double wait_us = avg_latency_us_ * in_flight_ / limit_;
+  *retry_after_ms = std::min(MAX_RETRY_AFTER_MS, std::max<int64_t>(1, std::ceil(wait_us / 1000)));
+  return false;
+}
+
+void AdmissionLimiter::Release(int64_t latency_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  in_flight_--;
+  if(latency_us < 0) {
+    return;
+  }
+  avg_latency_us_ = avg_latency_us_ == 0 ? latency_us : 0.9 * avg_latency_us_ + 0.1 * latency_us;
+  if(max_limit_ <= 0 || target_latency_us_ <= 0) {
+    return;
+  }
+  since_decrease_++;
+  if(latency_us > target_latency_us_) {
+    // One cut per window: the completions of requests admitted under the
+    // old bound would otherwise cut it again.
+    if(since_decrease_ >= limit_) {
+      limit_ = std::max(MIN_LIMIT, limit_ * 0.9);
+      since_decrease_ = 0;
+    }
+  } else {
+    limit_ = std::min<double>(max_limit_, limit_ + 1 / limit_);
+  }
+}
+
+int AdmissionLimiter::get_limit() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return max_limit_ <= 0 ? 0 : (int)limit_;
+}
@@ -0,0 +1,71 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// Bounds the requests of one kind that are in flight at once. The bound
+// adapts to observed latency (AIMD): it grows by about one per window of
+// completions that stay under the target latency and is cut by a tenth, at
+// most once per window, when they do not. Requests over the bound are
+// rejected right away instead of queueing behind the shard locks.
+class AdmissionLimiter {
+  public:
+  // max_limit: bound to start from and never exceed; 0 admits everything.
+  // target_latency_us: completions slower than this shrink the bound; 0
+  // keeps the bound fixed at max_limit.
+  AdmissionLimiter(int max_limit, int64_t target_latency_us);
+
+  // False if the request has to be rejected; retry_after_ms is then set to
+  // a guess of when a slot frees up.
+  bool TryAcquire(int64_t* retry_after_ms);
+  // Ends a request admitted by TryAcquire. latency_us < 0 does not feed the
+  // limit (streams, whose duration depends on their length).
+  void Release(int64_t latency_us);
+
+  int get_limit();
+  int64_t get_rejected() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return rejected_;
+  }
+
+  private:
+  std::mutex mutex_;
+  const int max_limit_;
+  const int64_t target_latency_us_;
+  double limit_;
+  int in_flight_ = 0;
+  // Completions since the bound was last cut.
+  int64_t since_decrease_ = 0;
+  // Moving average of completion latency, for the retry-after hint.
+  double avg_latency_us_ = 0;
+  int64_t rejected_ = 0;
+};
+
+// Holds a slot of an AdmissionLimiter for the lifetime of a request.
+class AdmissionTicket {
+  public:
+  AdmissionTicket(AdmissionLimiter& limiter, bool feeds_limit = true)
+      : limiter_(limiter), feeds_limit_(feeds_limit), start_(std::chrono::steady_clock::now()) {
+    admitted_ = limiter_.TryAcquire(&retry_after_ms_);
+  }
+  ~AdmissionTicket() {
+    if(admitted_) {
+      int64_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start_).count();
+      limiter_.Release(feeds_limit_ ? latency_us : -1);
+    }
+  }
+  bool admitted() const { return admitted_; }
+  int64_t retry_after_ms() const { return retry_after_ms_; }
+
+  private:
+  AdmissionLimiter& limiter_;
+  bool feeds_limit_;
+  std::chrono::steady_clock::time_point start_;
+  bool admitted_;
+  int64_t retry_after_ms_ = 0;
+};
+
+#endif // ADMISSION_H
@@ -0,0 +1,171 @@
+#include "allocation_map.h"
+
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+
+// Fill files with fewer records than this are not compacted at runtime.
+#define FILL_COMPACT_RECORDS 4096
+
+AllocationMap::AllocationMap(const std::string& block_dir, const std::string& fill_path)
+    : fill_path_(fill_path) {
+  // Block files are named by their block number.
+  std::error_code ec;
+  for(const auto& entry : std::filesystem::directory_iterator(block_dir, ec)) {
+    std::string name = entry.path().filename().string();
+    if(name.empty() || name.find_first_not_of("0123456789") != std::string::npos || !entry.is_regular_file(ec)) {
+      continue;
+    }
+    blocks_[std::stoll(name)] = -1;
+  }
+  // A fill record is written before the block file is removed, so a fill
+  // wins over a block file left behind by a crash.
+  std::unordered_map<int64_t, int32_t> fills;
+  std::ifstream ifs(fill_path_, std::ios::binary);
+  FillRecord record;
+  while(ifs.read((char*)&record, sizeof(record))) {
+    fills[record.block] = record.fill;
+  }
+  ifs.close();
+  for(auto& it : fills) {
+    if(it.second < 0) {
+      continue;
+    }
+    blocks_[it.first] = it.second;
+    num_fills_++;
+    std::remove((block_dir + "/" + std::to_string(it.first)).c_str());
+  }
+  Compact();
+}
+
+AllocationMap::State AllocationMap::Lookup(int64_t block, char* fill) {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  auto it = blocks_.find(block);
+  if(it == blocks_.end()) {
+    return UNWRITTEN;
+  }
+  if(it->second < 0) {
+    return ALLOCATED;
+  }
+  *fill = (char)it->second;
+  return FILL;
+}
+
+void AllocationMap::MarkAllocated(int64_t block) {
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  auto it = blocks_.find(block);
+  if(it != blocks_.end() && it->second < 0) {
+    return;
+  }
+  if(it != blocks_.end()) {
+    // The block stops being a fill before its block file shows up.
+    Append(block, -1);
+    num_fills_--;
+  }
+  blocks_[block] = -1;
+}
+
+AllocationMap::State AllocationMap::MarkFill(int64_t block, char fill) {
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  State previous = UNWRITTEN;
+  auto it = blocks_.find(block);
+  if(it != blocks_.end()) {
+    previous = it->second < 0 ? ALLOCATED : FILL;
+    if(it->second == (uint8_t)fill) {
+      return previous;
+    }
+  }
+  Append(block, (uint8_t)fill);
+  if(previous != FILL) {
+    num_fills_++;
+  }
+  blocks_[block] = (uint8_t)fill;
+  return previous;
+}
+
+AllocationMap::State AllocationMap::MarkUnwritten(int64_t block) {
+  std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+  auto it = blocks_.find(block);
+  if(it == blocks_.end()) {
+    return UNWRITTEN;
+  }
+  State previous = ALLOCATED;
+  if(it->second >= 0) {
+    Append(block, -1);
+    num_fills_--;
+    previous = FILL;
+  }
+  blocks_.erase(it);
+  return previous;
+}
+
+void AllocationMap::Sync() {
+  // Compaction replaces the file, so open it afresh.
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  int fd = ::open(fill_path_.c_str(), O_RDONLY);
+  if(fd < 0 || ::fdatasync(fd) != 0) {
+    std::cout << "AllocationMap::Sync() - Failed to sync fill file: " << fill_path_ << std::endl;
+  }
+  if(fd >= 0) {
+    ::close(fd);
+  }
+}
+
+std::vector<int64_t> AllocationMap::Blocks() {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  std::vector<int64_t> blocks;
+  blocks.reserve(blocks_.size());
+  for(auto& it : blocks_) {
+    blocks.push_back(it.first);
+  }
+  return blocks;
+}
+
+int64_t AllocationMap::num_fills() {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return num_fills_;
+}
+
+int64_t AllocationMap::num_allocated() {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return blocks_.size() - num_fills_;
+}
+
+void AllocationMap::Append(int64_t block, int32_t fill) {
+  FillRecord record = {block, fill};
+  ofs_.write((char*)&record, sizeof(record));
+  ofs_.flush();
+  if(ofs_.fail()) {
+    std::cout << "AllocationMap::Append() - Failed to write to fill file: " << fill_path_ << std::endl;
+  }
+  num_records_++;
+  if(num_records_ > FILL_COMPACT_RECORDS && num_records_ > 2 * num_fills_) {
+    Compact();
+  }
+}
+
+void AllocationMap::Compact() {
+  std::vector<FillRecord> records;
+  for(auto& it : blocks_) {
+    if(it.second >= 0) {
+      records.push_back(FillRecord{it.first, it.second});
+    }
+  }
+  if(ofs_.is_open()) {
+    ofs_.close();
+  }
+  std::string tmp_path = fill_path_ + ".tmp";
+  std::ofstream tmp(tmp_path, std::ios::trunc | std::ios::binary);
+  tmp.write((char*)records.data(), records.size() * sizeof(FillRecord));
+  tmp.close();
+  std::rename(tmp_path.c_str(), fill_path_.c_str());
+  num_records_ = records.size();
+  ofs_.open(fill_path_, std::ios::app | std::ios::binary);
+  if(!ofs_.is_open()) {
+    std::cout << "AllocationMap::Compact() - Failed to open fill file: " << fill_path_ << std::endl;
+    exit(1);
+  }
+}
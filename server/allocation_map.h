@@ -0,0 +1,82 @@
+#ifndef ALLOCATION_MAP_H
+#define ALLOCATION_MAP_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Fill file format: records of int64 block | int32 fill, where fill is the
+// byte the block consists of, or -1 once the block has a block file again.
+// The last record of a block wins; the file is compacted when opened.
+struct FillRecord {
+  int64_t block;
+  int32_t fill;
+};
+
+// Whether data is size copies of one byte, and which.
+inline bool IsFill(const std::string& data, size_t size, char* fill) {
+  if(data.size() != size || size == 0 || memcmp(data.data(), data.data() + 1, size - 1) != 0) {
+    return false;
+  }
+  *fill = data[0];
+  return true;
+}
+
+// Which blocks of a store have a block file, which are a single repeated byte
+// (a fill, kept without a block file) and which were never written. Lets reads
+// of fills and unwritten blocks be answered without touching the disk.
+class AllocationMap {
+public:
+  enum State {
+    UNWRITTEN,
+    ALLOCATED,
+    FILL,
+  };
+
+  // Loads the fills from fill_path and the block files under block_dir.
+  AllocationMap(const std::string& block_dir, const std::string& fill_path);
+
+  State Lookup(int64_t block, char* fill);
+
+  // Call before renaming a block file into place.
+  void MarkAllocated(int64_t block);
+
+  // Records block as a fill. Returns the previous state; the caller removes
+  // the block file if it was ALLOCATED.
+  State MarkFill(int64_t block, char fill);
+
+  // Forget block. Returns the previous state; the caller removes the block
+  // file if it was ALLOCATED.
+  State MarkUnwritten(int64_t block);
+
+  // Wait until the fill file is on disk.
+  void Sync();
+
+  // Every block with a block file or a fill.
+  std::vector<int64_t> Blocks();
+
+  int64_t num_fills();
+  int64_t num_allocated();
+
+private:
+  void Append(int64_t block, int32_t fill);
+  // Rewrite the fill file with one record per fill.
+  void Compact();
+
+  std::string fill_path_;
+  std::ofstream ofs_;
+  std::shared_timed_mutex mutex_;
+  // block -> fill byte, or -1 for a block file.
+  std::unordered_map<int64_t, int16_t> blocks_;
+  int64_t num_fills_ = 0;
+  // Records in the fill file; it is compacted once the stale ones outnumber
+  // the fills.
+  int64_t num_records_ = 0;
+};
+
+#endif // ALLOCATION_MAP_H
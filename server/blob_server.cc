@@ -1,15 +1,23 @@
 #include "blob_server.h"
+#include "crc32c.h"
+#include <algorithm>
 #include <string> 
 #include <memory>
 #include <assert.h>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <sstream>
+#include <unordered_set>
 #include <vector>
 #include <signal.h>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <grpcpp/grpcpp.h>
 
@@ -22,7 +30,6 @@
 #include "absl/strings/string_view.h"
 #include "resources/utils.h"
 
-#define BLOCK_SIZE 4096
 // #define performance_measure
 
 using grpc::Channel;
@@ -35,47 +42,282 @@ using blobstore::PrepareRequest;
 using blobstore::PrepareResponse;
 using blobstore::CommitRequest;
 using blobstore::CommitResponse;
+using blobstore::ReplicateMessage;
 using blobstore::RecoveryRequest;
 using blobstore::RecoveryResponse;
 using blobstore::RecoveryRecord;
+using blobstore::CatchUpRequest;
+using blobstore::CatchUpResponse;
 using blobstore::LogEntry;
+using blobstore::ReplicationProgress;
 
 BlobServer::BlobServer(std::string root_path, 
                     std::string self_ip, 
-                    std::string other_ip): 
+                    std::string other_ips,
+                    ServerOptions options): 
                     root_path_(root_path), 
                     self_ip_(self_ip), 
-                    other_ip_(other_ip) {
+                    options_(options) {
   srand(time(0));
   // Initialize storage directories
   ::mkdir(this->root_path_.c_str(), 0777);
-  this->tmp_path_ = this->root_path_ + "/tmp";
-  ::mkdir(this->tmp_path_.c_str(), 0777);
-  // Initialize logger
-  logger_ = std::make_shared<Logger>(this->root_path_ + "/log");
-  // Connect to other storage server.
-  ConnectToOtherBlobServer();
+  // Block files live directly under the root. Each shard keeps its log and
+  // tmp directory under root/shard-<i>; a single shard keeps the original
+  // root/log and root/tmp layout.
+  allocation_map_.reset(new AllocationMap(this->root_path_, this->root_path_ + "/fills"));
+  std::cout << "Allocation map: " << allocation_map_->num_allocated() << " block files, "
+            << allocation_map_->num_fills() << " fills" << std::endl;
+  snapshots_.reset(new SnapshotStore((int64_t)options_.snapshot_max_mb << 20, options_.snapshot_ttl_s));
+  // The hash tree is built by the first anti-entropy pass.
+  for(int64_t block : allocation_map_->Blocks()) {
+    merkle_tree_.MarkDirty(block);
+  }
+  int num_shards = std::max(1, options_.num_shards);
+  for(int i = 0; i < num_shards; i++) {
+    std::unique_ptr<Shard> shard(new Shard());
+    shard->dir_path = num_shards == 1 ? this->root_path_ : this->root_path_ + "/shard-" + std::to_string(i);
+    ::mkdir(shard->dir_path.c_str(), 0777);
+    shard->tmp_path = shard->dir_path + "/tmp";
+    ::mkdir(shard->tmp_path.c_str(), 0777);
+    // Initialize logger
+    shard->logger = std::make_shared<Logger>(shard->dir_path + "/log");
+    if(options_.async_apply) {
+      shard->journal = std::make_shared<Journal>(shard->dir_path + "/journal");
+    }
+    shards_.push_back(std::move(shard));
+  }
+  if(options_.async_apply) {
+    // Finish what the applier of the previous run did not get to.
+    ReplayJournals();
+    applier_ = std::thread(&BlobServer::RunApplier, this);
+  }
+  // Txids already in the logs; a promotion continues above them.
+  for(auto& shard : shards_) {
+    LogReader reader(shard->logger->log_file_path());
+    LogRecord record;
+    while(reader.Next(&record)) {
+      ObserveTxId(record.txid);
+    }
+  }
+  std::stringstream peer_list(other_ips);
+  std::string ip;
+  while(std::getline(peer_list, ip, PEER_LIST_SEPARATOR)) {
+    if(ip.empty() || ip == self_ip_) {
+      continue;
+    }
+    std::unique_ptr<Peer> peer(new Peer());
+    peer->ip = ip;
+    peers_.push_back(std::move(peer));
+  }
+  primary_ip_ = peers_.empty() ? self_ip_ : peers_[0]->ip;
+  // Connect to other storage servers.
+  ConnectToOtherBlobServers();
+  peer_pinger_thread_ = std::thread(&BlobServer::RunPeerPinger, this);
+  if(options_.anti_entropy_interval_s > 0) {
+    anti_entropy_thread_ = std::thread(&BlobServer::RunAntiEntropy, this);
+  }
+  if(options_.scrub_blocks_per_s > 0) {
+    scrubber_thread_ = std::thread(&BlobServer::RunScrubber, this);
+  }
+  if(options_.heatmap_interval_s > 0) {
+    // Regions are shard stripes, the unit a shard boundary can move by.
+    access_profile_.reset(new AccessProfile(SHARD_STRIPE_BLOCKS, NUM_MUTEXES));
+    heatmap_thread_ = std::thread(&BlobServer::RunHeatmap, this);
+  }
+}
+
+BlobServer::~BlobServer() {
+  {
+    std::lock_guard<std::mutex> lock(periodic_mutex_);
+    stop_periodic_ = true;
+    periodic_cv_.notify_all();
+  }
+  if(anti_entropy_thread_.joinable()) {
+    anti_entropy_thread_.join();
+  }
+  if(peer_pinger_thread_.joinable()) {
+    peer_pinger_thread_.join();
+  }
+  if(scrubber_thread_.joinable()) {
+    scrubber_thread_.join();
+  }
+  if(heatmap_thread_.joinable()) {
+    heatmap_thread_.join();
+  }
+  WaitForBackgroundTasks();
+  if(applier_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(apply_mutex_);
+      stop_applier_ = true;
+      apply_cv_.notify_all();
+    }
+    applier_.join();
+  }
+}
+
+void BlobServer::WaitForBackgroundTasks() {
+  {
+    std::unique_lock<std::mutex> lock(background_mutex_);
+    background_cv_.wait(lock, [this]() { return background_tasks_ == 0; });
+  }
+  for(auto& peer : peers_) {
+    peer->replication_queue.WaitUntilEmpty();
+  }
+}
+
+void BlobServer::RunInBackground(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    background_tasks_++;
+  }
+  std::thread([this, task = std::move(task)]() {
+    task();
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    background_tasks_--;
+    background_cv_.notify_all();
+  }).detach();
+}
+
+// An empty ip (a request from a server predating peer lists) means the only peer.
+Peer* BlobServer::FindPeer(const std::string& ip) {
+  if(ip.empty() && peers_.size() == 1) {
+    return peers_[0].get();
+  }
+  for(auto& peer : peers_) {
+    if(peer->ip == ip) {
+      return peer.get();
+    }
+  }
+  return nullptr;
+}
+
+void BlobServer::setBackupAlive(const std::string& ip, bool alive) {
+  Peer* peer = FindPeer(ip);
+  if(peer == nullptr) {
+    std::cout << "Unknown storage server: " << ip << std::endl;
+    return;
+  }
+  if(alive) {
+    // Don't replicate to a rejoined backup before the channels to it are up.
+    // It just called in, so don't wait out the reconnect backoff.
+    peer->control_client->WaitForConnected(BACKUP_CONNECT_TIMEOUT_MS, true);
+    peer->replication_client->WaitForConnected(BACKUP_CONNECT_TIMEOUT_MS, true);
+    // Recovery brought it the rounds it was not sent.
+    std::lock_guard<std::mutex> lock(peer->progress_mutex);
+    peer->last_round_seq = std::max<int64_t>(peer->last_round_seq, replication_seq_);
+  }
+  peer->alive = alive;
+}
+
+ReplicationStreamStats BlobServer::get_replication_stream_stats() {
+  ReplicationStreamStats stats;
+  for(auto& peer : peers_) {
+    peer->replication_client->AddStreamStats(&stats);
+  }
+  return stats;
+}
+
+int BlobServer::GetShardIndex(int64_t block) {
+  return (block / SHARD_STRIPE_BLOCKS) % shards_.size();
+}
+
+Shard& BlobServer::GetShard(int64_t block) {
+  return *shards_[GetShardIndex(block)];
+}
+
+// Shards touched by a read/write at address, in lock order.
+std::vector<int> BlobServer::GetShardIndexes(int64_t address) {
+  int64_t block = address / BLOCK_SIZE;
+  int shard1 = GetShardIndex(block);
+  if(address % BLOCK_SIZE == 0) {
+    return {shard1};
+  }
+  int shard2 = GetShardIndex(block + 1);
+  if(shard1 == shard2) {
+    return {shard1};
+  }
+  return {std::min(shard1, shard2), std::max(shard1, shard2)};
+}
+
+// Address used to pick shards; crash-test addresses encode the crash type.
+int64_t BlobServer::RoutingAddress(int64_t addr) {
+  #ifdef CRASH_TEST
+  return Utils::get_address(addr);
+  #else
+  return addr;
+  #endif
+}
+
+AllShardsLock BlobServer::LockAllShards() {
+  AllShardsLock locks(&all_shards_holders_);
+  for(auto& shard : shards_) {
+    locks.Lock(shard->recovery_mutex);
+  }
+  return locks;
 }
 
 absl::Status BlobServer::Recovery(){
   //read backup logs and send to primary
   std::cout << "[Recovery]: (Backup) Send Recovery request" << std::endl;
-  std::vector<LogEntry> self_logs = logger_->read_logs();
-  std::cout << "Read " << self_logs.size() << " log entries on local" << std::endl;
-  RecoveryRequest recovery_request;
-  RecoveryResponse recovery_response;
-  recovery_request.mutable_entry()->Assign(self_logs.begin(), self_logs.end());
-  #ifdef performance_measure
+  // The response holds a record per block the backup missed; one arena for
+  // the call frees them all at once.
+  google::protobuf::Arena arena;
+  RecoveryRequest& recovery_request = *google::protobuf::Arena::CreateMessage<RecoveryRequest>(&arena);
+  RecoveryResponse& recovery_response = *google::protobuf::Arena::CreateMessage<RecoveryResponse>(&arena);
+  auto read_logs_start = std::chrono::high_resolution_clock::now();
+  // Ship the log records as they are on disk, in contiguous ranges.
+  size_t num_entries = 0;
+  for(auto& shard : shards_) {
+    LogReader reader(shard->logger->log_file_path());
+    while(true) {
+      size_t num_records = 0;
+      std::string_view range = reader.NextRange(LOG_RANGE_RECORDS, &num_records);
+      if(range.empty()) {
+        break;
+      }
+      recovery_request.add_log_records(range.data(), range.size());
+      num_entries += num_records;
+    }
+  }
+  recovery_request.set_num_shards(shards_.size());
+  recovery_request.set_ip(self_ip_);
+  recovery_request.add_accept_codecs(blobstore::CODEC_DEFLATE);
+  recovery_request.add_accept_codecs(blobstore::CODEC_FILL);
+  recovery_request.set_online(options_.online_recovery);
+  std::cout << "Read " << num_entries << " log entries on local" << std::endl;
+  int64_t read_logs_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::high_resolution_clock::now() - read_logs_start).count();
+  Peer* primary = FindPeer(get_other_ip());
+  if(primary == nullptr) {
+    std::cout << "Backup Recovery failed: unknown primary " << get_other_ip() << std::endl;
+    return absl::CancelledError();
+  }
   auto log_import_start = std::chrono::high_resolution_clock::now();
-  #endif
   // Step 1: Send backup logs to primary
-  grpc::Status status = store_internal_client_->Recovery(recovery_request, &recovery_response);
-
-  #ifdef performance_measure
+  grpc::Status status = primary->recovery_client->Recovery(recovery_request, &recovery_response);
   auto log_import_end = std::chrono::high_resolution_clock::now();
-  #endif
 
-  if (status.ok()) {
+  if (status.ok() && recovery_response.online()) {
+    // The records follow in CatchUp requests, which wait for the recovery
+    // locks held by the caller.
+    ClearLogsForRecovery();
+    {
+      std::lock_guard<std::mutex> lock(catch_up_mutex_);
+      catching_up_ = true;
+      catch_up_start_ = std::chrono::steady_clock::now();
+    }
+    {
+      std::lock_guard<std::mutex> lock(recovery_stats_mutex_);
+      recovery_stats_.log_entries = num_entries;
+      recovery_stats_.records = 0;
+      recovery_stats_.read_logs_us = read_logs_us;
+      recovery_stats_.rpc_us = std::chrono::duration_cast<std::chrono::microseconds>(log_import_end - log_import_start).count();
+      recovery_stats_.replay_us = 0;
+      recovery_stats_.catch_up_us = 0;
+    }
+    std::cout << "[Backup] Catching up with the primary online." << std::endl;
+    return absl::OkStatus();
+  } else if (status.ok()) {
     // to_be_implemented
     // clear log file and iterate over recovery_response to add log entries and write data
     // Debug_Print - Need to disable. 
@@ -83,15 +325,27 @@ absl::Status BlobServer::Recovery(){
 
     std::cout << "[Backup] Number of Log entries to be replayed: " << recovery_response.records().size() << std::endl;
 
-    #ifdef performance_measure
     auto log_replay_start = std::chrono::high_resolution_clock::now();
-    #endif
-
     int replay_status = ReplayRecoveryRecords(recovery_response);
     std::cout << "Replay Status: " << replay_status << std::endl;
+    auto log_replay_end = std::chrono::high_resolution_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(catch_up_mutex_);
+      catching_up_ = false;
+      catch_up_cv_.notify_all();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(recovery_stats_mutex_);
+      recovery_stats_.log_entries = num_entries;
+      recovery_stats_.records = recovery_response.records().size();
+      recovery_stats_.read_logs_us = read_logs_us;
+      recovery_stats_.rpc_us = std::chrono::duration_cast<std::chrono::microseconds>(log_import_end - log_import_start).count();
+      recovery_stats_.replay_us = std::chrono::duration_cast<std::chrono::microseconds>(log_replay_end - log_replay_start).count();
+      recovery_stats_.catch_up_us = 0;
+    }
 
     #ifdef performance_measure
-    auto log_replay_end = std::chrono::high_resolution_clock::now();
     std::cout << "[Perf][LogImport]: " << std::chrono::duration_cast<std::chrono::milliseconds>(log_import_end - log_import_start).count() << " ms" << std::endl;
     std::cout << "[Perf][LogReplay]: " << std::chrono::duration_cast<std::chrono::milliseconds>(log_replay_end - log_replay_start).count() << " ms" << std::endl;
     #endif
@@ -111,10 +365,69 @@ absl::Status BlobServer::Recovery(){
  
 }
 
-void writeToTmpFile(std::string file_path, const std::string& data){
-  std::ofstream of(file_path, std::ios::trunc | std::ios::out);
-  of << data;
+// Wait until a file, or the names in a directory, are on disk.
+void syncPath(const std::string& path){
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0 || fsync(fd) != 0){
+    std::cout << "Failed to sync " << path << std::endl;
+  }
+  if(fd >= 0){
+    close(fd);
+  }
+}
+
+// Block files hold the block followed by the CRC32C of it (see ReadBlock).
+void writeBlockToTmpFile(const std::string& file_path, const std::string& data, bool sync = false){
+  uint32_t crc = Crc32c(data.data(), data.size());
+  std::ofstream of(file_path, std::ios::trunc | std::ios::out | std::ios::binary);
+  of.write(data.data(), data.size());
+  of.write((char*)&crc, sizeof(crc));
   of.close();
+  if(sync){
+    syncPath(file_path);
+  }
+}
+
+// Whether a write is on disk when it is acknowledged, and whether the
+// acknowledgement waits for the backups.
+static bool SyncsToDisk(blobstore::Durability durability) {
+  return durability == blobstore::DURABILITY_LOCAL_DISK || durability == blobstore::DURABILITY_REPLICATED_DISK;
+}
+
+static bool WaitsForBackups(blobstore::Durability durability) {
+  return durability == blobstore::DURABILITY_REPLICATED_MEMORY || durability == blobstore::DURABILITY_REPLICATED_DISK;
+}
+
+// The blocks a write of block1 and block2 (-1 if aligned) changes, and the
+// version slots a trim of [first_block, end_block) changes: past
+// BLOCK_VERSION_SLOTS blocks the slots repeat.
+static std::vector<int64_t> WrittenBlocks(int64_t block1, int64_t block2) {
+  if(block2 == -1) {
+    return {block1};
+  }
+  return {block1, block2};
+}
+
+static std::vector<int64_t> TrimmedBlocks(int64_t first_block, int64_t end_block) {
+  std::vector<int64_t> blocks;
+  for(int64_t block = first_block; block < end_block && block < first_block + BLOCK_VERSION_SLOTS; block++) {
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
+static std::vector<int64_t> RecordBlocks(const JournalRecord& record) {
+  return record.trim ? TrimmedBlocks(record.block1, record.block2) : WrittenBlocks(record.block1, record.block2);
+}
+
+void BlobServer::RecordRecoveryServed(int64_t merge_us, int64_t create_records_us, int64_t records,
+                                      int64_t pause_us) {
+  std::lock_guard<std::mutex> lock(recovery_stats_mutex_);
+  recovery_stats_.merge_us = merge_us;
+  recovery_stats_.create_records_us = create_records_us;
+  recovery_stats_.records = records;
+  recovery_stats_.pause_us = pause_us;
+  recovery_stats_.catch_up_us = 0;
 }
 
 int BlobServer::ReplayRecoveryRecords(RecoveryResponse& recovery_response) {
@@ -124,67 +437,143 @@ int BlobServer::ReplayRecoveryRecords(RecoveryResponse& recovery_response) {
   // 1. Create tmp file
   // 2. Add entry to log
   // 3. Rename tmp file(s) to file(s)
-
-  // 0. Clear old log file
-  this->logger_->clear_logs();
+  ClearLogsForRecovery();
 
   #ifdef debug
-  std::cout << "[Backup] Number of records in log before replay: " << this->logger_->read_logs().size() << std::endl;
   std::cout << "[Backup] Records Replayed: " << recovery_response.records().size() << std::endl;
   #endif
 
-  for(auto record = recovery_response.records().begin(); record != recovery_response.records().end(); record++) {
-    LogEntry entry = record->entry();
+  return ApplyRecoveryRecords(recovery_response.records());
+}
 
-    // 1. Create tmp file
-    std::string file_path1 = GetFilePath(this->tmp_path_, entry.address1());
-    std::string file_path2 = GetFilePath(this->tmp_path_, entry.address2());
-    
-    writeToTmpFile(file_path1, record->data1());
-    if(entry.address2() != -1){
-      writeToTmpFile(file_path2, record->data2());
+// Clear old log files. Pending async writes are older than the records.
+void BlobServer::ClearLogsForRecovery() {
+  DrainApplier();
+  {
+    std::lock_guard<std::mutex> lock(staged_mutex_);
+    staged_blocks_.clear();
+    staged_fills_.clear();
+  }
+  for(auto& shard : shards_) {
+    shard->logger->clear_logs();
+  }
+}
+
+int BlobServer::ApplyRecoveryRecords(const google::protobuf::RepeatedPtrField<RecoveryRecord>& records) {
+  for(auto record = records.begin(); record != records.end(); record++) {
+    const LogEntry& entry = record->entry();
+    if(record->log_only()) {
+      if(GetShard(entry.address1()).logger->add_entry(entry.txid(), entry.address1(), entry.address2(),
+                                                      entry.status()) < 0)
+        return -1;
+      ObserveTxId(entry.txid());
+      continue;
+    }
+    if(entry.status() == LOG_STATUS_TRIM) {
+      if(GetShard(entry.address1()).logger->add_entry(entry.txid(), entry.address1(), entry.address2(),
+                                                      entry.status()) < 0)
+        return -1;
+      ObserveTxId(entry.txid());
+      for(int64_t block = entry.address1(); block < entry.address2(); block++) {
+        UnmapBlock(block);
+      }
+      continue;
+    }
+    int64_t blocks[2] = {entry.address1(), entry.address2()};
+    blobstore::Codec codecs[2] = {record->codec1(), record->codec2()};
+    const std::string* payloads[2] = {&record->data1(), &record->data2()};
+    bool unwritten[2] = {record->unwritten1(), record->unwritten2()};
+    bool is_fill[2] = {false, false};
+    char fill[2] = {0, 0};
+
+    // 1. Create tmp files; fills and unwritten blocks need none
+    for(int i = 0; i < 2; i++) {
+      if(blocks[i] == -1 || unwritten[i]) {
+        continue;
+      }
+      if(codecs[i] == blobstore::CODEC_FILL && payloads[i]->size() == 1) {
+        is_fill[i] = true;
+        fill[i] = (*payloads[i])[0];
+        continue;
+      }
+      std::string data;
+      if(!DecompressPayload(codecs[i], *payloads[i], &data)) {
+        std::cout << "[Backup] Corrupt recovery record: " << entry.txid() << std::endl;
+        return -1;
+      }
+      writeBlockToTmpFile(GetTmpFilePath(blocks[i]), data);
     }
 
-    // 2. Add entry to log
-    int rc = this->logger_->add_entry(entry.txid(), entry.address1(), entry.address2(), entry.status());
+    // 2. Add entry to the log of the shard owning the first block
+    int rc = GetShard(entry.address1()).logger->add_entry(entry.txid(), entry.address1(), entry.address2(), entry.status());
     if(rc < 0)
       return -1;
-
-    std::string original_file_path1 = GetFilePath(this->root_path_, entry.address1());
-    std::string original_file_path2 = GetFilePath(this->root_path_, entry.address2());
+    ObserveTxId(entry.txid());
 
     // 3. Rename tmp files to actual files
-    std::rename(file_path1.c_str(), original_file_path1.c_str());
-    if(entry.address2() != -1){
-      std::rename(file_path2.c_str(), original_file_path2.c_str());
+    for(int i = 0; i < 2; i++) {
+      if(blocks[i] != -1 && unwritten[i]) {
+        UnmapBlock(blocks[i]);
+      } else if(blocks[i] != -1) {
+        InstallBlock(blocks[i], is_fill[i], fill[i]);
+      }
     }
   }
-  #ifdef debug
-  std::cout << "[Backup] Number of records in log after replay: " << this->logger_->read_logs().size() << std::endl;
-  #endif
-
   return 0;
 }
 
-void BlobServer::ConnectToOtherBlobServer() {
-  // Connect to other storage server.
-  grpc::ChannelArguments ch_args;
-    ch_args.SetMaxReceiveMessageSize(-1);
-    auto channel = grpc::CreateCustomChannel(other_ip_, grpc::InsecureChannelCredentials(), ch_args);
-    store_internal_client_ = std::move(std::make_unique<StoreInternalClient>(channel));
+void BlobServer::ConnectToOtherBlobServers() {
+  int replication_channels = options_.replication_channels > 0 ? options_.replication_channels : shards_.size();
+  for(auto& peer : peers_) {
+    // Connect to other storage server.
+    peer->control_client = std::make_unique<StoreInternalClient>(peer->ip);
+    peer->recovery_client = std::make_unique<StoreInternalClient>(peer->ip);
+    peer->replication_client = std::make_unique<StoreInternalClient>(peer->ip, replication_channels);
+    peer->replication_queue.Start(REPLICATION_WORKERS);
+  }
+}
+
+// Failover prefers the server with the most history, then the smallest address.
+static bool IsBetterCandidate(int64_t txid, const std::string& ip, int64_t best_txid, const std::string& best_ip) {
+  return txid > best_txid || (txid == best_txid && ip < best_ip);
 }
 
 void BlobServer::ServerInit() {
   std::cout << "BlobServer::ServerInit()" << std::endl;
-  std::unique_lock<std::shared_timed_mutex> recovery_lock(recovery_mutex_);
-  // Ping other storage server.
-  PingResponse ping_response;
-  PingRequest ping_request;
-  grpc::Status status = store_internal_client_->Ping(ping_request, &ping_response);
-  if (status.ok()) {
-    std::cout << "Ping other storage server successfully." << std::endl;
+  auto recovery_locks = LockAllShards();
+  // Ping other storage servers. Recover from the primary if one answers,
+  // otherwise from the best candidate among the live servers and this one.
+  std::string primary_ip;
+  std::string best_ip = self_ip_;
+  int64_t best_txid = max_txid_seen_;
+  for(auto& peer : peers_) {
+    PingResponse ping_response;
+    PingRequest ping_request;
+    grpc::Status status = peer->control_client->Ping(ping_request, &ping_response);
+    if(!status.ok()) {
+      std::cout << "Ping storage server " << peer->ip << " failed." << std::endl;
+      continue;
+    }
+    std::cout << "Ping storage server " << peer->ip << " successfully." << std::endl;
+    if(ping_response.status() == "PRIMARY") {
+      primary_ip = peer->ip;
+      break;
+    }
+    if(IsBetterCandidate(ping_response.last_txid(), peer->ip, best_txid, best_ip)) {
+      best_txid = ping_response.last_txid();
+      best_ip = peer->ip;
+    }
+  }
+  if(primary_ip.empty() && best_ip != self_ip_) {
+    primary_ip = best_ip;
+  }
+
+  if (!primary_ip.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(primary_ip_mutex_);
+      primary_ip_ = primary_ip;
+    }
     this->state = BACKUP;
-    backupAlive = true;
     #ifdef performance_measure
     auto recovery_start = std::chrono::high_resolution_clock::now();
     #endif
@@ -201,66 +590,527 @@ void BlobServer::ServerInit() {
       exit(1);
     }
   } else {
-    std::cout << "Ping other storage server failed." << std::endl;
-    this->state = PRIMARY;
-    backupAlive = false;
+    std::cout << "No primary found among the other storage servers." << std::endl;
+    std::lock_guard<std::mutex> lock(failover_mutex_);
+    PromoteLocked();
+  }
+}
+
+void BlobServer::BecomePrimary() {
+  std::lock_guard<std::mutex> lock(failover_mutex_);
+  PromoteLocked();
+}
+
+// Caller holds failover_mutex_.
+void BlobServer::PromoteLocked() {
+  if(state == PRIMARY) {
+    return;
+  }
+  std::cout << "Taking over as the Primary." << std::endl;
+  // Start a new txid epoch above everything this server has seen. Logs
+  // written with the old random txids may already use the top epochs.
+  int64_t epoch = (max_txid_seen_ >> 32) + 1;
+  next_txid_ = epoch < (1LL << 31) ? epoch << 32 : max_txid_seen_ + 1;
+  replication_seq_ = std::max<int64_t>(replication_seq_, next_txid_);
+  // Backups come back through Recovery.
+  for(auto& peer : peers_) {
+    peer->alive = false;
+    peer->catching_up = false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(primary_ip_mutex_);
+    primary_ip_ = self_ip_;
+  }
+  state = PRIMARY;
+  NotifyPeersOfPrimary();
+}
+
+// Tell the reachable peers to rejoin this server as its backups.
+void BlobServer::NotifyPeersOfPrimary() {
+  RunInBackground([this]() {
+    for(auto& peer : peers_) {
+      PingRequest ping_request;
+      PingResponse ping_response;
+      ping_request.set_primary_ip(self_ip_);
+      peer->control_client->Ping(ping_request, &ping_response);
+    }
+  });
+}
+
+void BlobServer::HandlePing(const PingRequest& request, PingResponse* response) {
+  response->set_status(state == PRIMARY ? "PRIMARY" : "BACKUP");
+  // A backup still catching up, or yet to rejoin, has only part of the history.
+  response->set_last_txid(catching_up_ || rejoining_ ? -1 : (int64_t)max_txid_seen_);
+  if(request.has_progress()) {
+    UpdateReplicationProgress(request.progress());
+  }
+  std::string primary_ip = request.primary_ip();
+  if(primary_ip.empty()) {
+    return;
+  }
+  if(primary_ip == self_ip_) {
+    // A backup that detected the primary failure picked this server.
+    RunInBackground([this]() { TakeOverAsPrimary(); });
+  } else {
+    if(state == BACKUP && primary_ip == get_other_ip()) {
+      std::cout << "[Backup] Dropped by the Primary " << primary_ip << ", rejoining." << std::endl;
+    } else {
+      std::cout << "[Backup] " << primary_ip << " is the new Primary." << std::endl;
+    }
+    // Writes may have gone on without this server: it cannot take over
+    // before it has recovered.
+    std::lock_guard<std::mutex> lock(rejoin_mutex_);
+    rejoining_ = true;
+    if(rejoin_ip_ != primary_ip) {
+      rejoin_ip_ = primary_ip;
+      RunInBackground([this, primary_ip]() { Rejoin(primary_ip); });
+    }
+  }
+}
+
+void BlobServer::Rejoin(const std::string& primary_ip) {
+  auto recovery_locks = LockAllShards();
+  {
+    std::lock_guard<std::mutex> failover_lock(failover_mutex_);
+    std::lock_guard<std::mutex> lock(primary_ip_mutex_);
+    primary_ip_ = primary_ip;
+    state = BACKUP;
+    for(auto& peer : peers_) {
+      peer->alive = false;
+    }
+  }
+  absl::Status status = Recovery();
+  std::lock_guard<std::mutex> lock(rejoin_mutex_);
+  if(rejoin_ip_ == primary_ip) {
+    rejoin_ip_.clear();
+  }
+  if(!status.ok()) {
+    // Still behind: it waits to be told to rejoin again, or to restart.
+    std::cout << "[Backup] Rejoining " << primary_ip << " failed." << std::endl;
+    return;
+  }
+  if(rejoin_ip_.empty()) {
+    rejoining_ = false;
+  }
+}
+
+void BlobServer::DropPeer(Peer* peer) {
+  peer->alive = false;
+  peer->catching_up = false;
+  // Nothing else tells a backup that is up but was slow that it missed writes.
+  std::lock_guard<std::mutex> lock(periodic_mutex_);
+  peer->dropped = true;
+  periodic_cv_.notify_all();
+}
+
+// Primary: send the live backups their replication progress, which keeps
+// their hedged reads going, and ping the backups it dropped, naming itself,
+// until they have rejoined; HandlePing makes them rejoin through Recovery.
+void BlobServer::RunPeerPinger() {
+  std::unique_lock<std::mutex> lock(periodic_mutex_);
+  while(!stop_periodic_) {
+    std::vector<Peer*> live, dropped;
+    for(auto& peer : peers_) {
+      if(peer->dropped && (peer->alive || state != PRIMARY)) {
+        // Rejoined already, or no longer this server's backup.
+        peer->dropped = false;
+      }
+      if(peer->dropped) {
+        dropped.push_back(peer.get());
+      } else if(peer->alive && state == PRIMARY) {
+        live.push_back(peer.get());
+      }
+    }
+    lock.unlock();
+    for(Peer* peer : live) {
+      PingRequest ping_request;
+      PingResponse ping_response;
+      *ping_request.mutable_progress() = GetReplicationProgress(peer);
+      peer->control_client->Ping(ping_request, &ping_response);
+    }
+    for(Peer* peer : dropped) {
+      PingRequest ping_request;
+      PingResponse ping_response;
+      ping_request.set_primary_ip(self_ip_);
+      peer->control_client->Ping(ping_request, &ping_response);
+    }
+    lock.lock();
+    periodic_cv_.wait_for(lock, std::chrono::milliseconds(PEER_PING_INTERVAL_MS), [this]() { return stop_periodic_; });
   }
 }
 
-std::vector<LogEntry> BlobServer::MergeAndRefreshLogsLocal(std::vector<LogEntry>& backup_logs){
+std::vector<LogEntry> BlobServer::MergeAndRefreshLogsLocal(std::vector<LogEntry>& backup_logs,
+                                                           const std::string& backup_ip){
   #ifdef performance_measure
   auto log_merge_start = std::chrono::high_resolution_clock::now();
   #endif
-  // Recovery Step 2: Merge logs to create logs to send to backup
-  std::vector<LogEntry> fresh_logs = logger_->merge_logs(backup_logs);
-  #ifdef performance_measure
-  auto log_merge_end = std::chrono::high_resolution_clock::now();
-  auto refresh_logs_start = std::chrono::high_resolution_clock::now();
-  #endif
-  // Auxilliary: Clear the unnecessary logs on primary
-  int status = logger_->refresh_logs(fresh_logs);
+  // Split backup logs by the shard that owns each entry; order within a shard is kept.
+  std::vector<std::vector<LogEntry>> backup_shard_logs(shards_.size());
+  for(auto& entry : backup_logs) {
+    int shard = GetShardIndex(entry.address1());
+    backup_shard_logs[shard].push_back(std::move(entry));
+  }
+
+  // Other backups that are down still need the primary's log to recover.
+  Peer* backup = FindPeer(backup_ip);
+  bool others_alive = true;
+  for(auto& peer : peers_) {
+    if(peer.get() != backup && (!peer->alive || peer->catching_up)) {
+      others_alive = false;
+    }
+  }
+
+  // Recovery Step 2: Merge logs to create logs to send to backup, one thread per shard
+  std::vector<std::vector<LogEntry>> fresh_shard_logs(shards_.size());
+  std::vector<std::thread> merge_threads;
+  for(size_t i = 0; i < shards_.size(); i++) {
+    merge_threads.push_back(std::thread([this, i, others_alive, &backup_shard_logs, &fresh_shard_logs]() {
+      std::vector<LogEntry> divergent_logs;
+      fresh_shard_logs[i] = shards_[i]->logger->merge_logs(backup_shard_logs[i], divergent_logs);
+      // Auxilliary: Clear the unnecessary logs on primary
+      if(others_alive) {
+        shards_[i]->logger->refresh_logs(fresh_shard_logs[i]);
+      }
+      // Blocks the backup wrote without the primary are reset to the primary's data.
+      fresh_shard_logs[i].insert(fresh_shard_logs[i].end(), std::make_move_iterator(divergent_logs.begin()),
+                                 std::make_move_iterator(divergent_logs.end()));
+    }));
+  }
+  for(auto& t : merge_threads) {
+    t.join();
+  }
+
+  std::vector<LogEntry> fresh_logs;
+  for(auto& shard_logs : fresh_shard_logs) {
+    fresh_logs.insert(fresh_logs.end(), std::make_move_iterator(shard_logs.begin()),
+                      std::make_move_iterator(shard_logs.end()));
+  }
 
   #ifdef performance_measure
-  auto refresh_logs_end = std::chrono::high_resolution_clock::now();
+  auto log_merge_end = std::chrono::high_resolution_clock::now();
   std::cout << "[Perf][LogMerge]: " << std::chrono::duration_cast<std::chrono::microseconds>(log_merge_end - log_merge_start).count() << " us" << std::endl;
-  std::cout << "[Perf][RefreshLogs]: " << std::chrono::duration_cast<std::chrono::microseconds>(refresh_logs_end - refresh_logs_start).count() << " us" << std::endl;
   #endif
 
   return fresh_logs;
 
 }
 
-std::vector<RecoveryRecord> BlobServer::CreateRecoveryResponse(std::vector<LogEntry>& fresh_logs){
+blobstore::Codec BlobServer::NegotiateCodec(const RecoveryRequest& request) {
+  blobstore::Codec codec = blobstore::CODEC_NONE;
+  for(int accepted : request.accept_codecs()) {
+    if(accepted == blobstore::CODEC_DEFLATE) {
+      codec = blobstore::CODEC_DEFLATE;
+    }
+  }
+  Peer* peer = FindPeer(request.ip());
+  if(peer != nullptr) {
+    peer->codec = codec;
+  }
+  return options_.compression ? codec : blobstore::CODEC_NONE;
+}
+
+// Payload of a block sent to a recovering backup: a single byte for a fill if
+// the backup accepts CODEC_FILL, else the block encoded with codec if it
+// shrinks.
+blobstore::Codec BlobServer::EncodeRecoveryBlock(std::string data, blobstore::Codec codec, bool send_fills,
+                                                 std::string* payload) {
+  char fill;
+  if(send_fills && IsFill(data, BLOCK_SIZE, &fill)) {
+    recovery_bytes_.Add(data.size(), 1);
+    *payload = std::string(1, fill);
+    return blobstore::CODEC_FILL;
+  }
+  std::string compressed;
+  if(!CompressPayload(codec, data, options_.compression_min_bytes, &compressed)) {
+    recovery_bytes_.Add(data.size(), data.size());
+    *payload = std::move(data);
+    return blobstore::CODEC_NONE;
+  }
+  recovery_bytes_.Add(data.size(), compressed.size());
+  *payload = std::move(compressed);
+  return codec;
+}
+
+void BlobServer::CreateRecoveryResponse(std::vector<LogEntry>::const_iterator begin,
+                                        std::vector<LogEntry>::const_iterator end,
+                                        std::unordered_set<int64_t>& sent_blocks,
+                                        google::protobuf::RepeatedPtrField<RecoveryRecord>* records,
+                                        blobstore::Codec codec, bool send_fills){
   //Populate response with log entries and data
-  std::vector<RecoveryRecord> recovery_records;
+  for(auto it = begin; it != end; it++){
+    const LogEntry& log_entry = *it;
+    if(log_entry.status() == LOG_STATUS_TRIM) {
+      AddTrimRecoveryRecords(log_entry, codec, send_fills, records);
+      continue;
+    }
+    // Every record carries the blocks as they are now, so a block rewritten
+    // during the outage only needs to go out once.
+    bool sent1 = sent_blocks.count(log_entry.address1()) > 0;
+    bool sent2 = log_entry.address2() == -1 || sent_blocks.count(log_entry.address2()) > 0;
+    if(sent1 && sent2) {
+      RecoveryRecord* recovery_record = records->Add();
+      recovery_record->mutable_entry()->CopyFrom(log_entry);
+      recovery_record->set_log_only(true);
+      continue;
+    }
 
-  for(auto& log_entry : fresh_logs){
-    RecoveryRecord recovery_record;
+    // Never ship a block that fails its checksum; the backup keeps its copy
+    // but still replays the log entry, so its log matches the primary's.
+    // Blocks trimmed since are shipped as unwritten, without data.
+    std::string data1, data2;
+    absl::Status status1 = ReadBlock(log_entry.address1(), &data1);
+    absl::Status status2 = log_entry.address2() != -1 ? ReadBlock(log_entry.address2(), &data2) : absl::OkStatus();
+    if(absl::IsDataLoss(status1) || absl::IsDataLoss(status2)) {
+      std::cout << "[Recovery]: (Primary) Corrupt block, sending log-only record: " << log_entry.txid() << std::endl;
+      RecoveryRecord* recovery_record = records->Add();
+      recovery_record->mutable_entry()->CopyFrom(log_entry);
+      recovery_record->set_log_only(true);
+      continue;
+    }
+    RecoveryRecord* recovery_record = records->Add();
+    recovery_record->mutable_entry()->CopyFrom(log_entry); //copy log entry
+    if(absl::IsNotFound(status1)) {
+      recovery_record->set_unwritten1(true);
+    } else {
+      recovery_record->set_codec1(EncodeRecoveryBlock(std::move(data1), codec, send_fills,
+                                                      recovery_record->mutable_data1()));
+    }
+    if(absl::IsNotFound(status2)) {
+      recovery_record->set_unwritten2(true);
+    } else if(log_entry.address2() != -1){
+      recovery_record->set_codec2(EncodeRecoveryBlock(std::move(data2), codec, send_fills,
+                                                      recovery_record->mutable_data2()));
+    }
+    sent_blocks.insert(log_entry.address1());
+    if(log_entry.address2() != -1) {
+      sent_blocks.insert(log_entry.address2());
+    }
+  }
+}
 
-    LogEntry *logentry = recovery_record.mutable_entry();
-    logentry->CopyFrom(log_entry); //copy log entry
+// A trim record of the log, as the primary's blocks are now: runs of blocks
+// that are still unwritten become trim records, blocks written since (or, for
+// a trim only the backup made, never trimmed here) go out as writes. The
+// backup ends up with the primary's blocks in any replay order.
+void BlobServer::AddTrimRecoveryRecords(const LogEntry& log_entry, blobstore::Codec codec, bool send_fills,
+                                        google::protobuf::RepeatedPtrField<RecoveryRecord>* records) {
+  int first_record = records->size();
+  int64_t run_start = -1;
+  auto end_run = [&](int64_t end) {
+    if(run_start == -1) {
+      return;
+    }
+    LogEntry* entry = records->Add()->mutable_entry();
+    entry->CopyFrom(log_entry);
+    entry->set_address1(run_start);
+    entry->set_address2(end);
+    run_start = -1;
+  };
+  for(int64_t block = log_entry.address1(); block < log_entry.address2(); block++) {
+    std::string data;
+    absl::Status status = ReadBlock(block, &data);
+    if(absl::IsNotFound(status)) {
+      if(run_start == -1) {
+        run_start = block;
+      }
+      continue;
+    }
+    end_run(block);
+    if(!status.ok()) {
+      continue;
+    }
+    RecoveryRecord* record = records->Add();
+    LogEntry* entry = record->mutable_entry();
+    entry->set_txid(log_entry.txid());
+    entry->set_address1(block);
+    entry->set_address2(-1);
+    entry->set_status(LOG_STATUS_WRITE);
+    record->set_codec1(EncodeRecoveryBlock(std::move(data), codec, send_fills, record->mutable_data1()));
+  }
+  end_run(log_entry.address2());
+  if(records->size() == first_record) {
+    // Nothing left to trim; still log the txid on the backup.
+    LogEntry* entry = records->Add()->mutable_entry();
+    entry->CopyFrom(log_entry);
+    entry->set_address2(log_entry.address1());
+  }
+}
 
-    std::ifstream file(this->root_path_ + "/" + std::to_string(log_entry.address1()));
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    recovery_record.set_data1(buffer.str());
-    file.close();
-    
-    // Clear stringstream: Not buffer.clear()
-    buffer.str("");
+void BlobServer::StartCatchUp(const std::string& ip, std::vector<LogEntry> fresh_logs,
+                              blobstore::Codec codec, bool send_fills) {
+  Peer* peer = FindPeer(ip);
+  if(peer == nullptr) {
+    std::cout << "Unknown storage server: " << ip << std::endl;
+    return;
+  }
+  int64_t round = ++peer->catch_up_round;
+  peer->catching_up = true;
+  // Writes from now on reach the backup; the ones before are in fresh_logs.
+  setBackupAlive(ip, true);
+  RunInBackground([this, peer, round, fresh_logs = std::move(fresh_logs), codec, send_fills]() mutable {
+    CatchUpPeer(peer, round, std::move(fresh_logs), codec, send_fills);
+  });
+}
+
+// Stream the blocks of fresh_logs to a backup that rejoined with online
+// recovery. Each batch reads its blocks under their block locks and takes
+// its place among the replicated writes to the same slots there, so a write
+// to a block reaches the backup either before the image sent for it (and the
+// image includes it) or after it.
+void BlobServer::CatchUpPeer(Peer* peer, int64_t round, std::vector<LogEntry> fresh_logs,
+                             blobstore::Codec codec, bool send_fills) {
+  {
+    // Wait for the Recovery RPC that started this to answer and release its
+    // pause, without pausing clients again.
+    std::vector<std::shared_lock<std::shared_timed_mutex>> recovery_locks;
+    for(auto& shard : shards_) {
+      recovery_locks.emplace_back(shard->recovery_mutex);
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+  peer->recovery_client->WaitForConnected(BACKUP_CONNECT_TIMEOUT_MS, true);
+  int64_t raw_bytes = recovery_bytes_.raw_bytes, sent_bytes = recovery_bytes_.sent_bytes;
+  std::unordered_set<int64_t> sent_blocks;
+  int64_t num_records = 0, create_records_us = 0;
+  auto current = [&]() { return state == PRIMARY && peer->alive && peer->catch_up_round == round; };
+  for(size_t i = 0; i < fresh_logs.size() && current(); i += CATCH_UP_BATCH_RECORDS) {
+    auto batch_begin = fresh_logs.cbegin() + i;
+    auto batch_end = fresh_logs.cbegin() + std::min(fresh_logs.size(), i + CATCH_UP_BATCH_RECORDS);
+    // Block locks in the order Write takes them.
+    std::vector<std::mutex*> block_mutexes;
+    std::vector<int> slots;
+    for(auto it = batch_begin; it != batch_end; it++) {
+      const LogEntry& entry = *it;
+      int64_t end = entry.status() == LOG_STATUS_TRIM ? entry.address2()
+                    : (entry.address2() != -1 ? entry.address2() + 1 : entry.address1() + 1);
+      for(int64_t block = entry.address1(); block < end; block++) {
+        block_mutexes.push_back(&GetShard(block).mutex_pool[block % NUM_MUTEXES]);
+        slots.push_back(block % NUM_MUTEXES);
+      }
+    }
+    std::sort(block_mutexes.begin(), block_mutexes.end(), std::less<std::mutex*>());
+    block_mutexes.erase(std::unique(block_mutexes.begin(), block_mutexes.end()), block_mutexes.end());
+    std::sort(slots.begin(), slots.end());
+    slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+
+    google::protobuf::Arena arena;
+    CatchUpRequest* request = google::protobuf::Arena::CreateMessage<CatchUpRequest>(&arena);
+    std::future<bool> sent;
+    {
+      std::vector<std::unique_lock<std::mutex>> block_locks;
+      for(std::mutex* mutex : block_mutexes) {
+        block_locks.emplace_back(*mutex);
+      }
+      auto create_start = std::chrono::steady_clock::now();
+      CreateRecoveryResponse(batch_begin, batch_end, sent_blocks, request->mutable_records(), codec, send_fills);
+      create_records_us += std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - create_start).count();
+      num_records += request->records_size();
+      std::lock_guard<std::mutex> lock(replication_order_mutex_);
+      sent = QueueCatchUp(peer, request, slots);
+    }
+    if(!sent.get()) {
+      return;
+    }
+  }
+  if(!current()) {
+    return;
+  }
+
+  // Cut-over: after every write replicated so far, and before any other.
+  auto pause_start = std::chrono::steady_clock::now();
+  auto recovery_locks = LockAllShards();
+  std::vector<int> slots;
+  for(int slot = 0; slot < NUM_MUTEXES; slot++) {
+    slots.push_back(slot);
+  }
+  CatchUpRequest request;
+  request.set_done(true);
+  std::future<bool> sent;
+  {
+    std::lock_guard<std::mutex> lock(replication_order_mutex_);
+    sent = QueueCatchUp(peer, &request, slots);
+  }
+  if(!sent.get()) {
+    return;
+  }
+  peer->catching_up = false;
+  auto end = std::chrono::steady_clock::now();
+  int64_t pause_us = std::chrono::duration_cast<std::chrono::microseconds>(end - pause_start).count();
+  int64_t catch_up_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+  {
+    std::lock_guard<std::mutex> lock(recovery_stats_mutex_);
+    recovery_stats_.create_records_us = create_records_us;
+    recovery_stats_.records = num_records;
+    recovery_stats_.pause_us += pause_us;
+    recovery_stats_.catch_up_us = catch_up_us;
+  }
+  std::cout << "[Recovery]: (Primary) " << peer->ip << " caught up: " << num_records << " records, "
+            << recovery_bytes_.raw_bytes - raw_bytes << " bytes of block data, "
+            << recovery_bytes_.sent_bytes - sent_bytes << " bytes sent, in " << catch_up_us / 1000
+            << " ms; cut-over " << pause_us << " us" << std::endl;
+}
+
+// Queue a CatchUp request in its place among the writes replicated to peer.
+std::future<bool> BlobServer::QueueCatchUp(Peer* peer, const CatchUpRequest* request, std::vector<int> slots) {
+  auto sent = std::make_shared<std::promise<bool>>();
+  std::future<bool> result = sent->get_future();
+  peer->replication_queue.Push(std::move(slots), [this, peer, request, sent]() {
+    CatchUpResponse response;
+    grpc::Status status = peer->recovery_client->CatchUp(*request, &response);
+    if(!status.ok()) {
+      std::cout << "[Recovery]: (Primary) CatchUp failed on " << peer->ip << ": " << status.error_message() << std::endl;
+      // Failure is assumed to be Backup Failure; it recovers again when told to.
+      DropPeer(peer);
+    }
+    sent->set_value(status.ok());
+    return true;
+  });
+  return result;
+}
 
-    if(log_entry.address2() != -1){
-      file.open(this->root_path_ + "/" + std::to_string(log_entry.address2()));
-      buffer << file.rdbuf();
-      recovery_record.set_data2(buffer.str());
-      file.close();
+int BlobServer::HandleCatchUp(const CatchUpRequest& request) {
+  std::vector<std::shared_lock<std::shared_timed_mutex>> recovery_locks;
+  for(auto& shard : shards_) {
+    recovery_locks.emplace_back(shard->recovery_mutex);
+  }
+  if(!catching_up_) {
+    std::cout << "[Backup] Unexpected CatchUp request." << std::endl;
+    return -1;
+  }
+  // Journaled writes to these blocks are older than the records.
+  auto apply_start = std::chrono::steady_clock::now();
+  DrainApplier();
+  if(ApplyRecoveryRecords(request.records()) < 0) {
+    return -1;
+  }
+  {
+    std::lock_guard<std::mutex> lock(recovery_stats_mutex_);
+    recovery_stats_.records += request.records().size();
+    recovery_stats_.replay_us += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - apply_start).count();
+  }
+  if(request.done()) {
+    std::lock_guard<std::mutex> lock(catch_up_mutex_);
+    catching_up_ = false;
+    int64_t catch_up_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - catch_up_start_).count();
+    {
+      std::lock_guard<std::mutex> stats_lock(recovery_stats_mutex_);
+      recovery_stats_.catch_up_us = catch_up_us;
     }
-    recovery_records.push_back(recovery_record);
+    catch_up_cv_.notify_all();
+    std::cout << "[Backup] Caught up with the primary in " << catch_up_us / 1000 << " ms." << std::endl;
   }
-  return recovery_records;
+  return 0;
+}
+
+bool BlobServer::WaitForCatchUp(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(catch_up_mutex_);
+  return catch_up_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return !catching_up_; });
 }
 
-int BlobServer::PrepareLocal(int64_t addr, const std::string& data) {
+int BlobServer::PrepareLocal(int64_t addr, const std::string& data, bool sync) {
   #ifdef performance_measure
   auto prepare_local_start = std::chrono::high_resolution_clock::now();
   #endif
@@ -280,20 +1130,14 @@ int BlobServer::PrepareLocal(int64_t addr, const std::string& data) {
   
   if(address % BLOCK_SIZE == 0) {
     // Directly write BLOCK_SIZE bytes to actual address.
-    std::string tmp_file_path = GetFilePath(this->tmp_path_, actual_address1);
-    std::ofstream tmp_file(tmp_file_path);
-    tmp_file << data;
-    tmp_file.close();
+    StageBlock(actual_address1, data, sync);
   } else {
     // Operations for actual_address1 -
     // Read current data from actual address1
 
-    std::string file_path1 = GetFilePath(this->root_path_, actual_address1);
     std::string buffer;
-    auto file = std::ifstream(file_path1);
-    if(file.is_open()) {
-      file >> buffer;
-      file.close();
+    if(absl::IsDataLoss(ReadBlock(actual_address1, &buffer))) {
+      return -1;
     }
     // Pad the buffer with spaces.
     buffer.resize(BLOCK_SIZE, ' ');
@@ -305,19 +1149,12 @@ int BlobServer::PrepareLocal(int64_t addr, const std::string& data) {
     buffer.replace(offset, len, data, pos, len);
     
     // Write buffer to tmp file for actual address1
-    std::string tmp_file_path1 = GetFilePath(this->tmp_path_, actual_address1);
-    auto tmp_file = std::ofstream(tmp_file_path1);
-    tmp_file << buffer;
-    tmp_file.close();
+    StageBlock(actual_address1, buffer, sync);
     
     // Operations for actual_address2 -
     // Read current data from actual address2
-    std::string file_path2 = GetFilePath(this->root_path_, actual_address2);
-    buffer.clear();
-    file = std::ifstream(file_path2);
-    if(file.is_open()) {
-      file >> buffer;
-      file.close();
+    if(absl::IsDataLoss(ReadBlock(actual_address2, &buffer))) {
+      return -1;
     }
 
     // Pad the buffer with spaces.
@@ -330,10 +1167,7 @@ int BlobServer::PrepareLocal(int64_t addr, const std::string& data) {
     buffer.replace(offset, len, data, pos, len);
     
     // Write buffer to tmp file for actual address2
-    std::string tmp_file_path2 = GetFilePath(this->tmp_path_, actual_address2);
-    tmp_file = std::ofstream(tmp_file_path2);
-    tmp_file << buffer;
-    tmp_file.close();
+    StageBlock(actual_address2, buffer, sync);
   }
     #ifdef performance_measure
     auto prepare_local_end = std::chrono::high_resolution_clock::now();
@@ -343,7 +1177,8 @@ int BlobServer::PrepareLocal(int64_t addr, const std::string& data) {
   return 0;
 }
 
-int BlobServer::Prepare(int64_t address, const std::string& data) {
+int BlobServer::Prepare(int64_t txId, int64_t address, const std::string& data,
+                        std::shared_ptr<ReplicationRound>& round, blobstore::Durability durability) {
   #ifdef debug
   std::cout << "Starting Prepare for addr: " << address << ", data size: " << data.size() << std::endl;
   #endif
@@ -352,7 +1187,7 @@ int BlobServer::Prepare(int64_t address, const std::string& data) {
   auto prepare_start = std::chrono::high_resolution_clock::now();
   #endif
 
-  int localStatus = PrepareLocal(address, data);
+  int localStatus = PrepareLocal(address, data, SyncsToDisk(durability));
   if (localStatus != 0) {
     std::cout << "Prepare for addr: " << address << ", data size: " << data.size() << " failed." << std::endl;
     return localStatus;
@@ -370,30 +1205,19 @@ int BlobServer::Prepare(int64_t address, const std::string& data) {
   }
   #endif
 
-  // Don't send prepare to backup if it is not alive.
-  if(!backupAlive) return 0;
-
-
   #ifdef debug
   std::cout << "PrepareLocal succeeded." << std::endl;
-  std::cout << "[BlobServer::Prepare] Preparing on other server" << std::endl;
+  std::cout << "[BlobServer::Prepare] Preparing on other servers" << std::endl;
   #endif
 
-  // Prepare in backup storage server.
-  PrepareRequest prepare_request;
-  PrepareResponse prepare_response;
-  prepare_request.set_address(address);
-  prepare_request.set_data(data);
-  grpc::Status status = store_internal_client_->Prepare(prepare_request, &prepare_response);
-  if (status.ok()) {
-    #ifdef debug
-    std::cout << "Prepare Remote successful." << std::endl;
-    #endif
-  } else {
-    std::cout << "Prepare Remote failed." << std::endl;
-    // Failure is assumed to be Backup Failure.
-    backupAlive = false;
+  // Prepare in backup storage servers. Backups that are not alive are skipped.
+  // Levels that don't wait for the backups leave them to catch up.
+  round = StartReplication(txId, address, data, 0, durability == blobstore::DURABILITY_REPLICATED_DISK);
+  if(!round) return 0;
+  if(WaitsForBackups(durability)) {
+    WaitForQuorum(*round, false);
   }
+
   #ifdef performance_measure
   auto prepare_remote_end = std::chrono::high_resolution_clock::now();
   std::cout << "[Perf][PrepareRemote]: " << std::chrono::duration_cast<std::chrono::microseconds>(prepare_remote_end - prepare_remote_start).count() << " us" << std::endl;
@@ -403,14 +1227,242 @@ int BlobServer::Prepare(int64_t address, const std::string& data) {
   return 0;
 }
 
-int BlobServer::CommitLocal(int64_t txId, int64_t addr) {
-  #ifdef performance_measure
-  auto commit_local_start = std::chrono::high_resolution_clock::now();
-  #endif
+// Fan a write out to every live backup. Returns nullptr if there is none.
+// Called with the block locks of the write held.
+std::shared_ptr<ReplicationRound> BlobServer::StartReplication(int64_t txId, int64_t address, const std::string& data,
+                                                               int64_t trim_blocks, bool sync) {
+  std::vector<Peer*> live_peers;
+  for(auto& peer : peers_) {
+    if(peer->alive) {
+      live_peers.push_back(peer.get());
+    }
+  }
+  if(live_peers.empty()) {
+    return nullptr;
+  }
 
-  #ifdef CRASH_TEST  
-  CrashType crash_type = Utils::get_crash_type(addr);
-  if(state == BACKUP && crash_type == CrashType::BACKUP_CRASH_AFTER_PRIMARY_PREPARE) {
+  std::shared_ptr<ReplicationRound> round = std::make_shared<ReplicationRound>();
+  round->num_peers = live_peers.size();
+  round->needed = options_.replication_quorum <= 0 ? round->num_peers
+                                                   : std::min(options_.replication_quorum, round->num_peers);
+  round->prepare_request.set_txid(txId);
+  round->prepare_request.set_address(address);
+  round->prepare_request.set_data(data);
+  round->prepare_request.set_sync(sync);
+  if(options_.compression) {
+    bool deflate = false;
+    for(Peer* peer : live_peers) {
+      deflate = deflate || peer->codec == blobstore::CODEC_DEFLATE;
+    }
+    std::string compressed;
+    if(deflate && CompressPayload(blobstore::CODEC_DEFLATE, data, options_.compression_min_bytes, &compressed)) {
+      round->compressed = true;
+      round->compressed_prepare_request.set_txid(txId);
+      round->compressed_prepare_request.set_address(address);
+      round->compressed_prepare_request.set_data(std::move(compressed));
+      round->compressed_prepare_request.set_codec(blobstore::CODEC_DEFLATE);
+      round->compressed_prepare_request.set_sync(sync);
+    }
+  }
+  round->commit_request.set_txid(txId);
+  round->commit_request.set_address(address);
+  round->commit_request.set_trim_blocks(trim_blocks);
+  round->commit_request.set_sync(sync);
+
+  int64_t routing_address = RoutingAddress(address);
+  int64_t block = routing_address / BLOCK_SIZE;
+  std::vector<int> slots = {(int)(block % NUM_MUTEXES)};
+  if(trim_blocks > 0) {
+    slots.clear();
+    for(int64_t i = 0; i < std::min<int64_t>(trim_blocks, NUM_MUTEXES); i++) {
+      slots.push_back((block + i) % NUM_MUTEXES);
+    }
+    std::sort(slots.begin(), slots.end());
+  } else if(routing_address % BLOCK_SIZE != 0 && (block + 1) % NUM_MUTEXES != slots[0]) {
+    slots.push_back((block + 1) % NUM_MUTEXES);
+    std::sort(slots.begin(), slots.end());
+  }
+  std::lock_guard<std::mutex> lock(replication_order_mutex_);
+  round->seq = ++replication_seq_;
+  auto now = std::chrono::steady_clock::now();
+  for(Peer* peer : live_peers) {
+    {
+      std::lock_guard<std::mutex> progress_lock(peer->progress_mutex);
+      peer->unfinished_rounds.emplace(round->seq, now);
+      peer->last_round_seq = round->seq;
+    }
+    peer->replication_queue.Push(slots, [this, peer, round, slots]() {
+      return PrepareOnPeer(peer, round, slots);
+    });
+  }
+  return round;
+}
+
+// Prepare one write on one backup, after the writes to the same blocks that
+// came before it. If the primary has not decided the round yet, the Commit
+// runs once it has, and the worker goes on with other writes meanwhile.
+bool BlobServer::PrepareOnPeer(Peer* peer, std::shared_ptr<ReplicationRound> round, std::vector<int> slots) {
+  int64_t block = RoutingAddress(round->prepare_request.address()) / BLOCK_SIZE;
+  StoreInternalClient* client = peer->replication_client.get();
+
+  // A trim has nothing to stage; it only has a Commit.
+  bool prepared = false;
+  if(round->commit_request.trim_blocks() > 0) {
+    prepared = peer->alive;
+  } else if(peer->alive) {
+    PrepareResponse prepare_response;
+    const PrepareRequest& prepare_request = round->compressed && peer->codec == blobstore::CODEC_DEFLATE
+                                            ? round->compressed_prepare_request : round->prepare_request;
+    replication_bytes_.Add(round->prepare_request.data().size(), prepare_request.data().size());
+    grpc::Status status;
+    if(options_.replication_stream) {
+      ReplicateMessage message;
+      *message.mutable_prepare() = prepare_request;
+      status = client->Replicate(&message, block);
+    } else {
+      status = client->Prepare(prepare_request, &prepare_response, block);
+    }
+    prepared = status.ok();
+    if (!prepared) {
+      std::cout << "Prepare Remote failed on " << peer->ip << "." << std::endl;
+      // Failure is assumed to be Backup Failure.
+      DropPeer(peer);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(round->mutex);
+    round->prepare_done++;
+    if(prepared) round->prepare_acks++;
+    round->cv.notify_all();
+    if(!round->decided) {
+      round->on_decided.push_back([this, peer, round, slots, prepared]() {
+        peer->replication_queue.Resume(slots, [this, peer, round, prepared]() {
+          CommitOnPeer(peer, round, prepared);
+          return true;
+        });
+      });
+      return false;
+    }
+  }
+  CommitOnPeer(peer, round, prepared);
+  return true;
+}
+
+// Commit, or abort, a write prepared (or not) on one backup.
+void BlobServer::CommitOnPeer(Peer* peer, std::shared_ptr<ReplicationRound> round, bool prepared) {
+  int64_t block = RoutingAddress(round->prepare_request.address()) / BLOCK_SIZE;
+  StoreInternalClient* client = peer->replication_client.get();
+  bool commit;
+  {
+    std::lock_guard<std::mutex> lock(round->mutex);
+    commit = round->commit;
+  }
+
+  bool committed = false;
+  if(prepared && commit && peer->alive) {
+    CommitResponse commit_response;
+    grpc::Status status;
+    if(options_.replication_stream) {
+      ReplicateMessage message;
+      *message.mutable_commit() = round->commit_request;
+      *message.mutable_commit()->mutable_progress() = GetReplicationProgress(peer);
+      status = client->Replicate(&message, block);
+    } else {
+      CommitRequest commit_request = round->commit_request;
+      *commit_request.mutable_progress() = GetReplicationProgress(peer);
+      status = client->Commit(commit_request, &commit_response, block);
+    }
+    committed = status.ok();
+    if (!committed) {
+      std::cout << "Commit Remote failed on " << peer->ip << "." << std::endl;
+      // Failure is assumed to be Backup Failure.
+      DropPeer(peer);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(peer->progress_mutex);
+    peer->unfinished_rounds.erase(round->seq);
+  }
+  {
+    std::lock_guard<std::mutex> lock(round->mutex);
+    round->commit_done++;
+    if(committed) round->commit_acks++;
+    round->cv.notify_all();
+  }
+}
+
+ReplicationProgress BlobServer::GetReplicationProgress(Peer* peer) {
+  ReplicationProgress progress;
+  std::lock_guard<std::mutex> lock(peer->progress_mutex);
+  if(peer->unfinished_rounds.empty()) {
+    progress.set_synced_seq(peer->last_round_seq);
+  } else {
+    auto oldest = peer->unfinished_rounds.begin();
+    progress.set_synced_seq(oldest->first - 1);
+    progress.set_lag_ms(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - oldest->second).count());
+  }
+  return progress;
+}
+
+// The progress describes the backup as of when the primary sent it; it is
+// good for hedged reads for what is left of BACKUP_READ_STALENESS_MS.
+void BlobServer::UpdateReplicationProgress(const ReplicationProgress& progress) {
+  if(state != BACKUP) {
+    return;
+  }
+  int64_t synced = synced_seq_;
+  while(progress.synced_seq() > synced && !synced_seq_.compare_exchange_weak(synced, progress.synced_seq())) {}
+  int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  fresh_until_us_ = now_us + (BACKUP_READ_STALENESS_MS - progress.lag_ms()) * 1000;
+}
+
+bool BlobServer::ServesHedge(int64_t min_seq) {
+  if(!options_.backup_reads || options_.replication_quorum != 0 || catching_up_ || rejoining_) {
+    return false;
+  }
+  int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  return synced_seq_ >= min_seq && now_us < fresh_until_us_;
+}
+
+// Wait for a quorum of acknowledgements, or for every backup to answer.
+void BlobServer::WaitForQuorum(ReplicationRound& round, bool commit_phase) {
+  std::unique_lock<std::mutex> lock(round.mutex);
+  round.cv.wait(lock, [&]() {
+    if(commit_phase) {
+      return round.commit_acks >= round.needed || round.commit_done == round.num_peers;
+    }
+    return round.prepare_acks >= round.needed || round.prepare_done == round.num_peers;
+  });
+}
+
+// Let the replication tasks of a round go on to Commit, or abort.
+void BlobServer::DecideRound(ReplicationRound& round, bool commit) {
+  std::vector<std::function<void()>> on_decided;
+  {
+    std::lock_guard<std::mutex> lock(round.mutex);
+    round.decided = true;
+    round.commit = commit;
+    round.cv.notify_all();
+    on_decided.swap(round.on_decided);
+  }
+  for(auto& resume : on_decided) {
+    resume();
+  }
+}
+
+int BlobServer::CommitLocal(int64_t txId, int64_t addr, bool sync) {
+  #ifdef performance_measure
+  auto commit_local_start = std::chrono::high_resolution_clock::now();
+  #endif
+
+  #ifdef CRASH_TEST  
+  CrashType crash_type = Utils::get_crash_type(addr);
+  if(state == BACKUP && crash_type == CrashType::BACKUP_CRASH_AFTER_PRIMARY_PREPARE) {
     printf("[Backup] Commit: %s.\n", Utils::crash_type_to_string(crash_type).c_str());
     kill(getpid(), SIGKILL);
   }
@@ -426,27 +1478,49 @@ int BlobServer::CommitLocal(int64_t txId, int64_t addr) {
   printf("CommitLocal for addr: %ld -> txId: %ld, actual_addr1: %d, actual_addr2: %d\n",
       address, txId, actual_address1, actual_address2);
   #endif
+
+  if(options_.async_apply) {
+    return CommitAsync(txId, actual_address1, actual_address2, sync);
+  }
   
-  logger_->add_entry(txId, actual_address1, actual_address2, 1);
+  if(GetShard(actual_address1).logger->add_entry(txId, actual_address1, actual_address2, LOG_STATUS_WRITE, sync) < 0) {
+    return -1;
+  }
+  ObserveTxId(txId);
 
   #ifdef performance_measure
   auto add_log_entry_end = std::chrono::high_resolution_clock::now();
   auto rename_start = std::chrono::high_resolution_clock::now();
   #endif
 
-  if(address % BLOCK_SIZE == 0) {
-    std::string tmp_file_path = GetFilePath(this->tmp_path_, actual_address1);
-    std::string file_path = GetFilePath(this->root_path_, actual_address1);
-    std::rename(tmp_file_path.c_str(), file_path.c_str());
-  } else {
-    std::string tmp_file_path1 = GetFilePath(this->tmp_path_, actual_address1);
-    std::string file_path1 = GetFilePath(this->root_path_, actual_address1);
-    std::rename(tmp_file_path1.c_str(), file_path1.c_str());
-
-    // TODO: Try to handle atomic renaming of both tmp files.
-    std::string tmp_file_path2 = GetFilePath(this->tmp_path_, actual_address2);
-    std::string file_path2 = GetFilePath(this->root_path_, actual_address2);
-    std::rename(tmp_file_path2.c_str(), file_path2.c_str());
+  // TODO: Try to handle atomic renaming of both tmp files.
+  {
+    // Lock-free readers of both blocks see neither image or both.
+    auto snapshot_lock = LockCommitsShared();
+    BlockWriteGuard guard(block_versions_, WrittenBlocks(actual_address1, actual_address2));
+    KeepSnapshotImages(actual_address1, actual_address2, false);
+    for(int64_t block : {(int64_t)actual_address1, (int64_t)actual_address2}) {
+      if(block == -1) {
+        continue;
+      }
+      bool is_fill = false;
+      char fill = 0;
+      {
+        std::lock_guard<std::mutex> lock(staged_mutex_);
+        auto it = staged_fills_.find(block);
+        if(it != staged_fills_.end()) {
+          is_fill = true;
+          fill = it->second;
+          staged_fills_.erase(it);
+        }
+      }
+      InstallBlock(block, is_fill, fill);
+    }
+  }
+  if(sync) {
+    // The renames, and the fill records of blocks that became fills.
+    allocation_map_->Sync();
+    syncPath(this->root_path_);
   }
 
   #ifdef performance_measure
@@ -463,12 +1537,19 @@ int BlobServer::CommitLocal(int64_t txId, int64_t addr) {
   return 0;
 }
 
+// Txids of a primary are <epoch:32><sequence:32>. Every promotion starts a
+// new epoch, so txids keep growing across failovers.
 int64_t BlobServer::generate_txId() {
-  return ((int64_t) rand()) << 32 | (int64_t) rand();
+  return next_txid_++;
 }
 
-int BlobServer::Commit(int64_t address) {
-  int64_t txId = generate_txId();
+void BlobServer::ObserveTxId(int64_t txId) {
+  int64_t seen = max_txid_seen_;
+  while(txId > seen && !max_txid_seen_.compare_exchange_weak(seen, txId)) {}
+}
+
+int BlobServer::Commit(int64_t txId, int64_t address, std::shared_ptr<ReplicationRound> round,
+                       blobstore::Durability durability) {
   #ifdef debug
   std::cout << "Starting Commit for addr: " << address << "txId: " << txId << std::endl;
   #endif
@@ -477,10 +1558,9 @@ int BlobServer::Commit(int64_t address) {
   auto commit_start = std::chrono::high_resolution_clock::now();
   #endif
 
-  int localStatus = CommitLocal(txId, address);
+  int localStatus = CommitLocal(txId, address, SyncsToDisk(durability));
   if (localStatus != 0) {
     std::cout << "CommitLocal[address: " << address << ", txId: " << txId << " ] failed." << std::endl;
-    return localStatus;
   }
 
   #ifdef performance_measure
@@ -489,28 +1569,19 @@ int BlobServer::Commit(int64_t address) {
 
   #ifdef CRASH_TEST  
   CrashType crash_type = Utils::get_crash_type(address);
-  if(state == PRIMARY && crash_type == CrashType::PRIMARY_CRASH_AFTER_LOCAL_COMMIT) {
+  if(localStatus == 0 && state == PRIMARY && crash_type == CrashType::PRIMARY_CRASH_AFTER_LOCAL_COMMIT) {
     printf("[Primary] Commit: %s.\n", Utils::crash_type_to_string(crash_type).c_str());
     kill(getpid(), SIGKILL);
   }
   #endif
 
-  if(!backupAlive) return 0;
+  if(!round) return localStatus;
 
-  // Commit in backup storage server.
-  CommitRequest commit_request;
-  CommitResponse commit_response;
-  commit_request.set_txid(txId);
-  commit_request.set_address(address);
-  grpc::Status status = store_internal_client_->Commit(commit_request, &commit_response);
-  if (status.ok()) {
-    #ifdef debug
-    std::cout << "Commit Remote successful." << std::endl;
-    #endif
-  } else {
-    std::cout << "Commit Remote failed." << std::endl;
-    // Failure is assumed to be Backup Failure.
-    backupAlive = false;
+  // Commit in backup storage servers, or abort the prepared write there.
+  DecideRound(*round, localStatus == 0);
+  if(localStatus != 0) return localStatus;
+  if(WaitsForBackups(durability)) {
+    WaitForQuorum(*round, true);
   }
 
   #ifdef performance_measure
@@ -528,25 +1599,875 @@ std::string BlobServer::GetFilePath(std::string root, int64_t address) {
   return file_path;
 }
 
+// Contents of a block. NotFound (and empty data) if it was never written,
+// DataLoss if its block file fails the checksum and, with repair, no peer has
+// a copy to repair it with. Committed images the applier has not written yet
+// take precedence.
+absl::Status BlobServer::ReadBlock(int64_t block, std::string* data, bool repair) {
+  uint32_t crc;
+  absl::Status status = LoadBlock(block, data, &crc);
+  if(!absl::IsDataLoss(status)) {
+    return status;
+  }
+  checksum_failures_++;
+  std::cout << "[Checksum] Block " << block << " failed its checksum" << std::endl;
+  if(!repair) {
+    data->clear();
+    return status;
+  }
+  return RepairBlock(block, crc, data);
+}
+
+absl::Status BlobServer::LoadBlock(int64_t block, std::string* data, uint32_t* crc) {
+  if(options_.async_apply) {
+    std::lock_guard<std::mutex> lock(lookaside_mutex_);
+    auto it = lookaside_.find(block);
+    if(it != lookaside_.end()) {
+      *data = it->second.data;
+      if(data->empty()) {
+        return absl::NotFoundError("Block was trimmed");
+      }
+      return absl::OkStatus();
+    }
+  }
+  char fill;
+  switch(allocation_map_->Lookup(block, &fill)) {
+    case AllocationMap::UNWRITTEN:
+      data->clear();
+      return absl::NotFoundError("Block was never written");
+    case AllocationMap::FILL:
+      data->assign(BLOCK_SIZE, fill);
+      return absl::OkStatus();
+    case AllocationMap::ALLOCATED:
+      break;
+  }
+  if(ReadBlockFile(block, data, crc)) {
+    return absl::OkStatus();
+  }
+  return absl::DataLossError("Block failed its checksum");
+}
+
+// A block file: the block and a CRC32C of it, or only the block if it was
+// written before checksums were kept (a multiple of BLOCK_SIZE long). Returns
+// false if the checksum does not match; *crc is then the stored one.
+bool BlobServer::ReadBlockFile(int64_t block, std::string* data, uint32_t* crc) {
+  std::ifstream file(GetFilePath(this->root_path_, block), std::ios::binary);
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  *data = buffer.str();
+  *crc = 0;
+  if(data->size() % BLOCK_SIZE == 0) {
+    return true;
+  }
+  if(data->size() % BLOCK_SIZE != sizeof(uint32_t)) {
+    return false;
+  }
+  size_t size = data->size() - sizeof(uint32_t);
+  memcpy(crc, data->data() + size, sizeof(uint32_t));
+  data->resize(size);
+  return Crc32c(data->data(), size) == *crc;
+}
+
+// Replace a corrupt block with a peer's copy: one with the checksum the block
+// was written with, or on a backup whatever the primary has.
+absl::Status BlobServer::RepairBlock(int64_t block, uint32_t crc, std::string* data) {
+  return InstallRepairCopy(block, crc, FetchRepairCopies(block), data);
+}
+
+std::vector<BlobServer::RepairCopy> BlobServer::FetchRepairCopies(int64_t block) {
+  std::vector<RepairCopy> copies;
+  for(auto& peer : peers_) {
+    blobstore::ReadBlocksRequest request;
+    blobstore::ReadBlocksResponse response;
+    request.add_blocks(block);
+    request.add_accept_codecs(blobstore::CODEC_DEFLATE);
+    request.add_accept_codecs(blobstore::CODEC_FILL);
+    if(!peer->recovery_client->ReadBlocks(request, &response).ok() || response.blocks_size() != 1) {
+      continue;
+    }
+    RepairCopy copy;
+    copy.ip = peer->ip;
+    copy.unwritten = response.blocks(0).unwritten();
+    if(!copy.unwritten && !DecodeBlockData(response.blocks(0), &copy.data)) {
+      continue;
+    }
+    copies.push_back(std::move(copy));
+  }
+  return copies;
+}
+
+absl::Status BlobServer::InstallRepairCopy(int64_t block, uint32_t crc, const std::vector<RepairCopy>& copies,
+                                           std::string* data) {
+  std::string primary_ip = get_other_ip();
+  for(const RepairCopy& copy : copies) {
+    if(copy.unwritten) {
+      // Trimmed on the primary; so is the copy here.
+      if(state == BACKUP && copy.ip == primary_ip) {
+        UnmapBlock(block);
+        blocks_repaired_++;
+        std::cout << "[Checksum] Block " << block << " is unwritten on " << copy.ip << "; dropped" << std::endl;
+        data->clear();
+        return absl::NotFoundError("Block was never written");
+      }
+      continue;
+    }
+    if(Crc32c(copy.data.data(), copy.data.size()) == crc || (state == BACKUP && copy.ip == primary_ip)) {
+      *data = copy.data;
+      InstallRepairedBlock(block, *data);
+      blocks_repaired_++;
+      std::cout << "[Checksum] Block " << block << " repaired from " << copy.ip << std::endl;
+      return absl::OkStatus();
+    }
+  }
+  data->clear();
+  std::cout << "[Checksum] Block " << block << " could not be repaired" << std::endl;
+  return absl::DataLossError("Block failed its checksum");
+}
+
+bool BlobServer::DecodeBlockData(const blobstore::BlockData& block, std::string* data) {
+  if(block.codec() == blobstore::CODEC_FILL) {
+    if(block.data().size() != 1) {
+      return false;
+    }
+    data->assign(BLOCK_SIZE, block.data()[0]);
+    return true;
+  }
+  return DecompressPayload(block.codec(), block.data(), data);
+}
+
+// Install a block copied from a peer. Not through the tmp file of the block,
+// which may hold a prepared write.
+void BlobServer::InstallRepairedBlock(int64_t block, const std::string& data) {
+  char fill;
+  if(IsFill(data, BLOCK_SIZE, &fill)) {
+    InstallBlock(block, true, fill);
+    return;
+  }
+  std::string tmp_file_path = GetTmpFilePath(block) + ".repair";
+  writeBlockToTmpFile(tmp_file_path, data);
+  BlockWriteGuard guard(block_versions_, {block});
+  allocation_map_->MarkAllocated(block);
+  std::rename(tmp_file_path.c_str(), GetFilePath(this->root_path_, block).c_str());
+  merkle_tree_.MarkDirty(block);
+}
+
+std::string BlobServer::GetTmpFilePath(int64_t block) {
+  return GetFilePath(GetShard(block).tmp_path, block);
+}
+
+// Hold the prepared image of a block until its commit: in the tmp file, or in
+// memory with async_apply. A fill is held in memory either way.
+void BlobServer::StageBlock(int64_t block, const std::string& data, bool sync) {
+  if(options_.async_apply) {
+    std::lock_guard<std::mutex> lock(staged_mutex_);
+    staged_blocks_[block] = data;
+    return;
+  }
+  char fill;
+  bool is_fill = IsFill(data, BLOCK_SIZE, &fill);
+  {
+    std::lock_guard<std::mutex> lock(staged_mutex_);
+    if(is_fill) {
+      staged_fills_[block] = fill;
+    } else {
+      staged_fills_.erase(block);
+    }
+  }
+  if(!is_fill) {
+    writeBlockToTmpFile(GetTmpFilePath(block), data, sync);
+  }
+}
+
+void BlobServer::WriteBlockFile(int64_t block, const std::string& data) {
+  char fill;
+  if(IsFill(data, BLOCK_SIZE, &fill)) {
+    InstallBlock(block, true, fill);
+    return;
+  }
+  writeBlockToTmpFile(GetTmpFilePath(block), data);
+  InstallBlock(block, false, 0);
+}
+
+// Make a staged image the contents of block: a fill goes to the allocation
+// map and replaces the block file, anything else is renamed from the tmp file.
+void BlobServer::InstallBlock(int64_t block, bool is_fill, char fill) {
+  std::string file_path = GetFilePath(this->root_path_, block);
+  BlockWriteGuard guard(block_versions_, {block});
+  if(is_fill) {
+    if(allocation_map_->MarkFill(block, fill) == AllocationMap::ALLOCATED) {
+      std::remove(file_path.c_str());
+    }
+  } else {
+    allocation_map_->MarkAllocated(block);
+    std::string tmp_file_path = GetTmpFilePath(block);
+    std::rename(tmp_file_path.c_str(), file_path.c_str());
+  }
+  merkle_tree_.MarkDirty(block);
+}
+
+// Free a block: it reads as never written from now on.
+void BlobServer::UnmapBlock(int64_t block) {
+  BlockWriteGuard guard(block_versions_, {block});
+  if(allocation_map_->MarkUnwritten(block) == AllocationMap::ALLOCATED) {
+    std::remove(GetFilePath(this->root_path_, block).c_str());
+  }
+  merkle_tree_.MarkDirty(block);
+}
+
+// Whether block has contents, committed or in the lookaside.
+bool BlobServer::BlockMapped(int64_t block) {
+  if(options_.async_apply) {
+    std::lock_guard<std::mutex> lock(lookaside_mutex_);
+    auto it = lookaside_.find(block);
+    if(it != lookaside_.end()) {
+      return !it->second.data.empty();
+    }
+  }
+  char fill;
+  return allocation_map_->Lookup(block, &fill) != AllocationMap::UNWRITTEN;
+}
+
+// async_apply commit: journal the staged images, log the commit, and leave the
+// block files to the applier. Reads see the images through the lookaside.
+int BlobServer::CommitAsync(int64_t txId, int64_t block1, int64_t block2, bool sync) {
+  JournalRecord record;
+  record.txid = txId;
+  record.block1 = block1;
+  record.block2 = block2;
+  {
+    std::lock_guard<std::mutex> lock(staged_mutex_);
+    auto it1 = staged_blocks_.find(block1);
+    auto it2 = staged_blocks_.find(block2);
+    if(it1 == staged_blocks_.end() || (block2 != -1 && it2 == staged_blocks_.end())) {
+      std::cout << "CommitAsync[txId: " << txId << "]: block " << block1 << " was not prepared." << std::endl;
+      return -1;
+    }
+    record.data1 = std::move(it1->second);
+    staged_blocks_.erase(it1);
+    if(block2 != -1) {
+      record.data2 = std::move(it2->second);
+      staged_blocks_.erase(it2);
+    }
+  }
+  return CommitJournaled(std::move(record), sync);
+}
+
+// Journal a committed record, log it, and queue it for the applier. Reads see
+// its images (empty for trimmed blocks) through the lookaside until then.
+// With sync the journal and log are on disk when it returns, which is enough
+// for the record to survive a crash.
+int BlobServer::CommitJournaled(JournalRecord record, bool sync) {
+  int shard_index = GetShardIndex(record.block1);
+  Shard& shard = *shards_[shard_index];
+  {
+    std::lock_guard<std::mutex> lock(shard.journal_mutex);
+    if(shard.journal->append(record, sync) < 0) {
+      return -1;
+    }
+    shard.unapplied++;
+  }
+  if(shard.logger->add_entry(record.txid, record.block1, record.block2,
+                             record.trim ? LOG_STATUS_TRIM : LOG_STATUS_WRITE, sync) < 0) {
+    std::lock_guard<std::mutex> lock(shard.journal_mutex);
+    shard.unapplied--;
+    return -1;
+  }
+  ObserveTxId(record.txid);
+
+  {
+    auto snapshot_lock = LockCommitsShared();
+    BlockWriteGuard guard(block_versions_, RecordBlocks(record));
+    KeepSnapshotImages(record.block1, record.block2, record.trim);
+    std::lock_guard<std::mutex> lock(lookaside_mutex_);
+    if(record.trim) {
+      for(int64_t block = record.block1; block < record.block2; block++) {
+        lookaside_[block] = LookasideEntry{record.txid, ""};
+      }
+    } else {
+      lookaside_[record.block1] = LookasideEntry{record.txid, record.data1};
+      if(record.block2 != -1) {
+        lookaside_[record.block2] = LookasideEntry{record.txid, record.data2};
+      }
+    }
+  }
+  if(record.trim) {
+    for(int64_t block = record.block1; block < record.block2; block++) {
+      merkle_tree_.MarkDirty(block);
+    }
+  } else {
+    merkle_tree_.MarkDirty(record.block1);
+    if(record.block2 != -1) {
+      merkle_tree_.MarkDirty(record.block2);
+    }
+  }
+  std::unique_lock<std::mutex> lock(apply_mutex_);
+  apply_cv_.wait(lock, [this]() { return apply_queue_.size() < APPLY_QUEUE_LIMIT; });
+  apply_queue_.emplace_back(shard_index, std::move(record));
+  apply_cv_.notify_all();
+  return 0;
+}
+
+// Writes committed images to the block files in commit order.
+void BlobServer::RunApplier() {
+  std::unique_lock<std::mutex> lock(apply_mutex_);
+  while(true) {
+    apply_cv_.wait(lock, [this]() { return stop_applier_ || !apply_queue_.empty(); });
+    if(apply_queue_.empty()) {
+      return;
+    }
+    int shard_index = apply_queue_.front().first;
+    const JournalRecord& record = apply_queue_.front().second;
+    lock.unlock();
+
+    ApplyJournalRecord(record);
+    {
+      // A later commit of the same block keeps its own entry.
+      std::lock_guard<std::mutex> lookaside_lock(lookaside_mutex_);
+      auto release = [&](int64_t block) {
+        auto it = lookaside_.find(block);
+        if(it != lookaside_.end() && it->second.txid == record.txid) {
+          lookaside_.erase(it);
+        }
+      };
+      if(record.trim) {
+        for(int64_t block = record.block1; block < record.block2; block++) {
+          release(block);
+        }
+      } else {
+        release(record.block1);
+        if(record.block2 != -1) {
+          release(record.block2);
+        }
+      }
+    }
+    {
+      Shard& shard = *shards_[shard_index];
+      std::lock_guard<std::mutex> journal_lock(shard.journal_mutex);
+      shard.unapplied--;
+      if(shard.unapplied == 0 && shard.journal->size() > JOURNAL_TRUNCATE_BYTES) {
+        shard.journal->clear();
+      }
+    }
+
+    lock.lock();
+    apply_queue_.pop_front();
+    apply_cv_.notify_all();
+  }
+}
+
+void BlobServer::ApplyJournalRecord(const JournalRecord& record) {
+  BlockWriteGuard guard(block_versions_, RecordBlocks(record));
+  if(record.trim) {
+    for(int64_t block = record.block1; block < record.block2; block++) {
+      UnmapBlock(block);
+    }
+    return;
+  }
+  WriteBlockFile(record.block1, record.data1);
+  if(record.block2 != -1) {
+    WriteBlockFile(record.block2, record.data2);
+  }
+}
+
+// Wait until every committed image is in its block file.
+void BlobServer::DrainApplier() {
+  if(!options_.async_apply) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(apply_mutex_);
+  apply_cv_.wait(lock, [this]() { return apply_queue_.empty(); });
+}
+
+// Apply the journals left by a previous run, then start them afresh. An
+// unaligned write can sit in another shard's journal than an earlier write of
+// the same block, so records are applied in txid (commit) order.
+void BlobServer::ReplayJournals() {
+  std::vector<JournalRecord> records;
+  for(auto& shard : shards_) {
+    std::vector<JournalRecord> shard_records = shard->journal->read_records();
+    std::move(shard_records.begin(), shard_records.end(), std::back_inserter(records));
+  }
+  if(records.empty()) {
+    return;
+  }
+  std::cout << "Applying " << records.size() << " journaled writes" << std::endl;
+  std::stable_sort(records.begin(), records.end(),
+                   [](const JournalRecord& a, const JournalRecord& b) { return a.txid < b.txid; });
+  for(auto& record : records) {
+    ApplyJournalRecord(record);
+  }
+  for(auto& shard : shards_) {
+    shard->journal->clear();
+  }
+}
+
+void BlobServer::RunAntiEntropy() {
+  std::unique_lock<std::mutex> lock(periodic_mutex_);
+  while(!periodic_cv_.wait_for(lock, std::chrono::seconds(options_.anti_entropy_interval_s),
+                               [this]() { return stop_periodic_; })) {
+    lock.unlock();
+    if(state == BACKUP) {
+      // FailedPrecondition: this server became primary, or is catching up.
+      absl::Status status = AntiEntropy();
+      if(!status.ok() && !absl::IsFailedPrecondition(status)) {
+        std::cout << "[AntiEntropy] Pass failed: " << status.message() << std::endl;
+      }
+    }
+    lock.lock();
+  }
+}
+
+void BlobServer::RunHeatmap() {
+  std::unique_lock<std::mutex> lock(periodic_mutex_);
+  while(!periodic_cv_.wait_for(lock, std::chrono::seconds(options_.heatmap_interval_s),
+                               [this]() { return stop_periodic_; })) {
+    lock.unlock();
+    LogHeatmap();
+    access_profile_->Decay();
+    lock.lock();
+  }
+}
+
+void BlobServer::LogHeatmap() {
+  int64_t reads = access_profile_->get_reads(), writes = access_profile_->get_writes();
+  if(reads == 0 && writes == 0) {
+    return;
+  }
+  std::stringstream out;
+  out << "[Heatmap] " << reads << " reads, " << writes << " writes. Blocks:";
+  for(const auto& block : access_profile_->TopBlocks(HEATMAP_ENTRIES)) {
+    out << " " << block.block << ":" << block.accesses;
+  }
+  out << ". Regions of " << access_profile_->get_region_blocks() << " blocks (reads/writes):";
+  for(const auto& region : access_profile_->TopRegions(HEATMAP_ENTRIES)) {
+    out << " " << region.region << ":" << region.reads << "/" << region.writes;
+  }
+  std::vector<int64_t> slot_writes = access_profile_->LockSlotWrites();
+  auto hottest_slot = std::max_element(slot_writes.begin(), slot_writes.end());
+  out << ". Hottest lock slot: " << hottest_slot - slot_writes.begin() << " with " << *hottest_slot
+      << " writes (mean " << writes / (int64_t)slot_writes.size() << ")";
+  std::cout << out.str() << std::endl;
+}
+
+void BlobServer::RecordAccess(int64_t address, bool write) {
+  if(!access_profile_) {
+    return;
+  }
+  int64_t routing_address = RoutingAddress(address);
+  access_profile_->Record(routing_address / BLOCK_SIZE, write);
+  if(routing_address % BLOCK_SIZE != 0) {
+    access_profile_->Record(routing_address / BLOCK_SIZE + 1, write);
+  }
+}
+
+void BlobServer::GetHeatmap(const blobstore::HeatmapRequest& request, blobstore::HeatmapResponse* response) {
+  if(!access_profile_) {
+    response->set_enabled(false);
+    return;
+  }
+  response->set_enabled(true);
+  response->set_region_blocks(access_profile_->get_region_blocks());
+  response->set_reads(access_profile_->get_reads());
+  response->set_writes(access_profile_->get_writes());
+  size_t num_blocks = request.num_blocks() > 0 ? request.num_blocks() : HEATMAP_ENTRIES;
+  for(const auto& block : access_profile_->TopBlocks(num_blocks)) {
+    blobstore::BlockHeat* heat = response->add_blocks();
+    heat->set_block(block.block);
+    heat->set_accesses(block.accesses);
+  }
+  size_t num_regions = request.num_regions() > 0 ? request.num_regions() : HEATMAP_ENTRIES;
+  for(const auto& region : access_profile_->TopRegions(num_regions)) {
+    blobstore::RegionHeat* heat = response->add_regions();
+    heat->set_region(region.region);
+    heat->set_reads(region.reads);
+    heat->set_writes(region.writes);
+  }
+  for(int64_t writes : access_profile_->LockSlotWrites()) {
+    response->add_lock_slot_writes(writes);
+  }
+}
+
+// Re-read the block files, scrub_blocks_per_s of them a second, and verify
+// their checksums.
+void BlobServer::RunScrubber() {
+  auto interval = std::chrono::microseconds(1000000 / options_.scrub_blocks_per_s);
+  std::unique_lock<std::mutex> lock(periodic_mutex_);
+  while(!stop_periodic_) {
+    auto start = std::chrono::steady_clock::now();
+    int64_t failures = checksum_failures_, repaired = blocks_repaired_, scrubbed = 0;
+    for(int64_t block : allocation_map_->Blocks()) {
+      char fill;
+      if(allocation_map_->Lookup(block, &fill) != AllocationMap::ALLOCATED) {
+        continue;
+      }
+      if(periodic_cv_.wait_for(lock, interval, [this]() { return stop_periodic_; })) {
+        return;
+      }
+      lock.unlock();
+      ScrubBlock(block);
+      scrubbed++;
+      lock.lock();
+    }
+    if(scrubbed == 0) {
+      periodic_cv_.wait_for(lock, std::chrono::seconds(1), [this]() { return stop_periodic_; });
+      continue;
+    }
+    std::cout << "[Scrub] " << scrubbed << " block files in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+              << " ms, " << checksum_failures_ - failures << " checksum failures, "
+              << blocks_repaired_ - repaired << " repaired" << std::endl;
+  }
+}
+
+void BlobServer::ScrubBlock(int64_t block) {
+  std::string data;
+  uint32_t crc;
+  if(ReadBlockFile(block, &data, &crc)) {
+    return;
+  }
+  checksum_failures_++;
+  std::cout << "[Checksum] Block " << block << " failed its checksum" << std::endl;
+  // NotFound means it was trimmed meanwhile.
+  absl::Status status = RepairCorruptBlock(block);
+  if(!status.ok() && !absl::IsNotFound(status)) {
+    std::cout << "[Scrub] Block " << block << " could not be repaired: " << status.message() << std::endl;
+  }
+}
+
+absl::Status BlobServer::RepairCorruptBlock(int64_t block) {
+  std::string data;
+  uint32_t crc;
+  absl::Status status = LoadBlock(block, &data, &crc);
+  if(!absl::IsDataLoss(status)) {
+    return status;
+  }
+  // A peer may be slow to answer: ask before locking anything.
+  std::vector<RepairCopy> copies = FetchRepairCopies(block);
+  // Keep writes away from the block, including unaligned ones starting in the
+  // block before, then check again; it may have been rewritten meanwhile.
+  std::vector<int> shard_ids = {GetShardIndex(block)};
+  if(block > 0 && GetShardIndex(block - 1) != shard_ids[0]) {
+    shard_ids.push_back(GetShardIndex(block - 1));
+    std::sort(shard_ids.begin(), shard_ids.end());
+  }
+  std::vector<std::unique_lock<std::shared_timed_mutex>> locks;
+  for(int id : shard_ids) {
+    locks.emplace_back(shards_[id]->recovery_mutex);
+  }
+  status = LoadBlock(block, &data, &crc);
+  if(!absl::IsDataLoss(status)) {
+    return status;
+  }
+  return InstallRepairCopy(block, crc, copies, &data);
+}
+
+absl::Status BlobServer::AntiEntropy(AntiEntropyStats* stats) {
+  std::lock_guard<std::mutex> pass_lock(anti_entropy_mutex_);
+  auto start = std::chrono::steady_clock::now();
+  AntiEntropyStats pass_stats;
+  if(stats == nullptr) {
+    stats = &pass_stats;
+  }
+  *stats = AntiEntropyStats();
+  if(state == PRIMARY) {
+    return absl::FailedPreconditionError("Anti-entropy runs on backups");
+  }
+  if(catching_up_) {
+    return absl::FailedPreconditionError("Backup is catching up");
+  }
+  Peer* primary = FindPeer(get_other_ip());
+  if(primary == nullptr) {
+    return absl::UnavailableError("Unknown primary");
+  }
+  merkle_tree_.Refresh([this](int64_t block, std::string* data) { return ReadBlock(block, data).ok(); });
+
+  // Walk down from the root, one request per level, expanding only the nodes
+  // whose hashes differ. What is left after level 0 are blocks.
+  std::vector<int64_t> nodes = {0};
+  for(int level = MERKLE_LEVELS - 1; level >= 0 && !nodes.empty(); level--) {
+    blobstore::MerkleNodesRequest request;
+    blobstore::MerkleNodesResponse response;
+    request.set_level(level);
+    for(int64_t node : nodes) {
+      request.add_nodes(node);
+    }
+    grpc::Status status = primary->recovery_client->GetMerkleNodes(request, &response);
+    stats->messages++;
+    if(!status.ok()) {
+      std::cout << "[AntiEntropy] GetMerkleNodes failed: " << status.error_message() << std::endl;
+      return absl::UnavailableError("GetMerkleNodes failed");
+    }
+    std::map<int64_t, uint64_t> local;
+    for(int64_t node : nodes) {
+      for(auto& child : merkle_tree_.Children(level, node)) {
+        local.insert(child);
+      }
+    }
+    std::vector<int64_t> divergent;
+    for(const auto& child : response.children()) {
+      auto it = local.find(child.id());
+      if(it == local.end() || it->second != child.hash()) {
+        divergent.push_back(child.id());
+      }
+      if(it != local.end()) {
+        local.erase(it);
+      }
+      stats->nodes_compared++;
+    }
+    for(auto& child : local) {
+      divergent.push_back(child.first);
+      stats->nodes_compared++;
+    }
+    std::sort(divergent.begin(), divergent.end());
+    nodes = std::move(divergent);
+  }
+  stats->divergent_blocks = nodes.size();
+
+  if(!nodes.empty()) {
+    // Copy the blocks while no write reaches this backup. A write the primary
+    // commits meanwhile is at least as new as what it sends here.
+    auto recovery_locks = LockAllShards();
+    DrainApplier();
+    for(size_t i = 0; i < nodes.size(); i += ANTI_ENTROPY_BATCH_BLOCKS) {
+      google::protobuf::Arena arena;
+      auto& request = *google::protobuf::Arena::CreateMessage<blobstore::ReadBlocksRequest>(&arena);
+      auto& response = *google::protobuf::Arena::CreateMessage<blobstore::ReadBlocksResponse>(&arena);
+      request.add_accept_codecs(blobstore::CODEC_DEFLATE);
+      request.add_accept_codecs(blobstore::CODEC_FILL);
+      for(size_t j = i; j < nodes.size() && j < i + ANTI_ENTROPY_BATCH_BLOCKS; j++) {
+        request.add_blocks(nodes[j]);
+      }
+      grpc::Status status = primary->recovery_client->ReadBlocks(request, &response);
+      stats->messages++;
+      if(!status.ok()) {
+        std::cout << "[AntiEntropy] ReadBlocks failed: " << status.error_message() << std::endl;
+        return absl::UnavailableError("ReadBlocks failed");
+      }
+      for(const auto& block : response.blocks()) {
+        std::string data;
+        if(block.unwritten()) {
+          UnmapBlock(block.block());
+        } else if(DecodeBlockData(block, &data)) {
+          InstallRepairedBlock(block.block(), data);
+        } else {
+          std::cout << "[AntiEntropy] Corrupt block from primary: " << block.block() << std::endl;
+          return absl::DataLossError("Corrupt block from primary");
+        }
+      }
+    }
+  }
+  stats->elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "[AntiEntropy] " << stats->nodes_compared << " nodes compared in " << stats->messages
+            << " messages, " << stats->divergent_blocks << " blocks repaired, " << stats->elapsed_ms << " ms" << std::endl;
+  return absl::OkStatus();
+}
+
+void BlobServer::GetMerkleNodes(const blobstore::MerkleNodesRequest& request,
+                                blobstore::MerkleNodesResponse* response) {
+  // A pass starts at the top; bring the tree up to date for it.
+  if(request.level() == MERKLE_LEVELS - 1) {
+    merkle_tree_.Refresh([this](int64_t block, std::string* data) { return ReadBlock(block, data).ok(); });
+  }
+  if(request.level() < 0 || request.level() >= MERKLE_LEVELS) {
+    return;
+  }
+  for(int64_t node : request.nodes()) {
+    for(auto& child : merkle_tree_.Children(request.level(), node)) {
+      blobstore::MerkleNode* out = response->add_children();
+      out->set_id(child.first);
+      out->set_hash(child.second);
+    }
+  }
+}
+
+void BlobServer::ReadBlocks(const blobstore::ReadBlocksRequest& request, blobstore::ReadBlocksResponse* response) {
+  bool deflate = false, send_fills = false;
+  for(int codec : request.accept_codecs()) {
+    deflate = deflate || codec == blobstore::CODEC_DEFLATE;
+    send_fills = send_fills || codec == blobstore::CODEC_FILL;
+  }
+  blobstore::Codec codec = deflate && options_.compression ? blobstore::CODEC_DEFLATE : blobstore::CODEC_NONE;
+  for(int64_t block : request.blocks()) {
+    blobstore::BlockData* out = response->add_blocks();
+    out->set_block(block);
+    std::string data;
+    // A peer asking for a block repairs its own copy; don't ask it back.
+    absl::Status status = ReadBlock(block, &data, false);
+    if(absl::IsNotFound(status)) {
+      out->set_unwritten(true);
+      continue;
+    }
+    if(!status.ok()) {
+      // Leave the caller's copy alone.
+      response->mutable_blocks()->RemoveLast();
+      continue;
+    }
+    out->set_codec(EncodeRecoveryBlock(std::move(data), codec, send_fills, out->mutable_data()));
+  }
+}
+
 bool BlobServer::CheckPrimaryFailure() {
   // Check if primary is alive
+  Peer* primary = FindPeer(get_other_ip());
+  if(primary == nullptr) {
+    return true;
+  }
   PingRequest ping_request;
   PingResponse ping_response;
-  grpc::Status primaryStatus = store_internal_client_->Ping(ping_request, &ping_response);
+  grpc::Status primaryStatus = primary->control_client->Ping(ping_request, &ping_response);
   if(primaryStatus.ok()){
     return false;
-  } else { // Primary is dead, Backup becomes the new Primary
+  } else { // Primary is dead, a Backup becomes the new Primary
     return true;
   }
 }
 
+// Called on a backup. Returns true if this server is (now) the primary,
+// false if clients should go to get_other_ip().
+bool BlobServer::TakeOverAsPrimary() {
+  std::lock_guard<std::mutex> lock(failover_mutex_);
+  if(state == PRIMARY) {
+    return true;
+  }
+  if(catching_up_ || rejoining_) {
+    // Only part of the blocks are here; wait for the primary to return.
+    return false;
+  }
+  if(!CheckPrimaryFailure()) {
+    return false;
+  }
+  std::cout << "[Backup] Primary failure detected." << std::endl;
+  // The surviving server with the most history takes over.
+  std::string failed_ip = get_other_ip();
+  std::string best_ip = self_ip_;
+  int64_t best_txid = max_txid_seen_;
+  for(auto& peer : peers_) {
+    if(peer->ip == failed_ip) {
+      continue;
+    }
+    PingRequest ping_request;
+    PingResponse ping_response;
+    if(!peer->control_client->Ping(ping_request, &ping_response).ok()) {
+      continue;
+    }
+    if(ping_response.status() == "PRIMARY") {
+      best_ip = peer->ip;
+      break;
+    }
+    if(IsBetterCandidate(ping_response.last_txid(), peer->ip, best_txid, best_ip)) {
+      best_txid = ping_response.last_txid();
+      best_ip = peer->ip;
+    }
+  }
+  if(best_ip == self_ip_) {
+    PromoteLocked();
+    return true;
+  }
+  std::cout << "[Backup] " << best_ip << " takes over as the new Primary." << std::endl;
+  {
+    std::lock_guard<std::mutex> ip_lock(primary_ip_mutex_);
+    primary_ip_ = best_ip;
+  }
+  // Let it know, in case no client reaches it first.
+  Peer* best = FindPeer(best_ip);
+  RunInBackground([best]() {
+    PingRequest ping_request;
+    PingResponse ping_response;
+    ping_request.set_primary_ip(best->ip);
+    best->control_client->Ping(ping_request, &ping_response);
+  });
+  return false;
+}
 
-absl::Status BlobServer::Read(int64_t addr, std::string* data) {
+// A seqlock read: the blocks as they were between two equal, stable version
+// reads. Nothing that makes an image visible happens outside BlockWriteGuards,
+// and recovery holds an AllShardsLock, so a read that saw neither is one the
+// locked path could have returned.
+bool BlobServer::ReadLockFree(int64_t address, std::string* data) {
+  int64_t block1 = address / BLOCK_SIZE;
+  bool aligned = address % BLOCK_SIZE == 0;
+  for(int attempt = 0; attempt < LOCK_FREE_READ_ATTEMPTS; attempt++) {
+    if(all_shards_holders_ > 0 || state != PRIMARY) {
+      return false;
+    }
+    uint64_t version1 = block_versions_.Get(block1);
+    uint64_t version2 = aligned ? 0 : block_versions_.Get(block1 + 1);
+    if(!BlockVersions::Stable(version1) || !BlockVersions::Stable(version2)) {
+      lock_free_read_retries_++;
+      std::this_thread::yield();
+      continue;
+    }
+    std::string data1, data2;
+    uint32_t crc;
+    absl::Status status1 = LoadBlock(block1, &data1, &crc);
+    absl::Status status2 = aligned ? absl::OkStatus() : LoadBlock(block1 + 1, &data2, &crc);
+    if(block_versions_.Get(block1) != version1 || (!aligned && block_versions_.Get(block1 + 1) != version2)) {
+      lock_free_read_retries_++;
+      continue;
+    }
+    // A checksum failure is repaired under the locks.
+    if(absl::IsDataLoss(status1) || absl::IsDataLoss(status2)) {
+      return false;
+    }
+    if(aligned) {
+      *data = std::move(data1);
+      return true;
+    }
+    // Blocks that were never written read as padding.
+    data1.resize(BLOCK_SIZE, ' ');
+    data2.resize(BLOCK_SIZE, ' ');
+    int offset = address % BLOCK_SIZE;
+    *data = data1.substr(offset, BLOCK_SIZE - offset) + data2.substr(0, offset);
+    return true;
+  }
+  return false;
+}
+
+absl::Status BlobServer::Read(int64_t addr, std::string* data, bool hedge, int64_t min_seq) {
+  bool record_access = true;
+  if(options_.lock_free_reads && state == PRIMARY && all_shards_holders_ == 0) {
+    #ifdef CRASH_TEST
+    CrashType crash_type = Utils::get_crash_type(addr);
+    if(crash_type == CrashType::PRIMARY_CRASH_BEFORE_READ) {
+      printf("[Primary] Read: %s.\n", Utils::crash_type_to_string(crash_type).c_str());
+      kill(getpid(), SIGKILL);
+    }
+    #endif
+    RecordAccess(addr, false);
+    if(ReadLockFree(RoutingAddress(addr), data)) {
+      return absl::OkStatus();
+    }
+    locked_reads_++;
+    record_access = false;
+  }
+  absl::Status status = ReadLocked(addr, data, hedge, record_access, min_seq);
+  if(!absl::IsDataLoss(status)) {
+    return status;
+  }
+  // Repair the block(s) without the locks, then read again.
+  int64_t address = RoutingAddress(addr);
+  for(int64_t block = address / BLOCK_SIZE; block <= (address + BLOCK_SIZE - 1) / BLOCK_SIZE; block++) {
+    status = RepairCorruptBlock(block);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
+  }
+  return ReadLocked(addr, data, hedge, false, min_seq);
+}
+
+absl::Status BlobServer::ReadLocked(int64_t addr, std::string* data, bool hedge, bool record_access,
+                                    int64_t min_seq) {
   #ifdef performance_measure
   auto lock_acquire_start = std::chrono::high_resolution_clock::now();
   #endif
-  std::shared_lock<std::shared_timed_mutex> recovery_lock(this->recovery_mutex_);
-  std::shared_lock<std::shared_timed_mutex> read_lock(this->mutex_);
+  std::vector<int> shard_ids = GetShardIndexes(RoutingAddress(addr));
+  std::vector<std::shared_lock<std::shared_timed_mutex>> recovery_locks, read_locks;
+  for(int id : shard_ids) {
+    recovery_locks.emplace_back(shards_[id]->recovery_mutex);
+  }
+  for(int id : shard_ids) {
+    read_locks.emplace_back(shards_[id]->mutex);
+  }
 
   #ifdef performance_measure
   auto lock_acquire_end = std::chrono::high_resolution_clock::now();
@@ -561,15 +2482,14 @@ absl::Status BlobServer::Read(int64_t addr, std::string* data) {
   auto read_start = std::chrono::high_resolution_clock::now();
   #endif
 
-  if(this->state == BACKUP){
-    bool primaryFailure = CheckPrimaryFailure();
-    if(!primaryFailure) {
-      absl::string_view err_msg("Please contact primary.");
-      return absl::NotFoundError(err_msg);
-    }
-    std::cout << "[Backup] Primary failure detected. Taking over as the new Primary." << std::endl;
-    this->state = PRIMARY;
-    backupAlive = false;
+  // The primary is only slow when a hedge arrives: no reason to take over.
+  if(this->state == BACKUP && (hedge ? !ServesHedge(min_seq) : !TakeOverAsPrimary())){
+    absl::string_view err_msg("Please contact primary.");
+    return absl::NotFoundError(err_msg);
+  }
+
+  if(record_access) {
+    RecordAccess(addr, false);
   }
 
   #ifdef CRASH_TEST
@@ -583,25 +2503,25 @@ absl::Status BlobServer::Read(int64_t addr, std::string* data) {
   int64_t address = addr;
   #endif
 
-  // aligned read
+  // aligned read; Read repairs a checksum failure once the locks are released.
   if(address % BLOCK_SIZE == 0){
-    std::string file_path = GetFilePath(this->root_path_, address / BLOCK_SIZE);
-    std::ifstream file(file_path);
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    *data = buffer.str();
+    absl::Status status = ReadBlock(address / BLOCK_SIZE, data, false);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
   } else { // unaligned read
-    std::string file_path1 = GetFilePath(this->root_path_, address / BLOCK_SIZE);
-    std::ifstream file1(file_path1);
-    std::stringstream buffer1;
-    buffer1 << file1.rdbuf();
-    std::string data1 = buffer1.str();
-
-    std::string file_path2 = GetFilePath(this->root_path_, address / BLOCK_SIZE + 1);
-    std::ifstream file2(file_path2);
-    std::stringstream buffer2;
-    buffer2 << file2.rdbuf();
-    std::string data2 = buffer2.str();
+    // Blocks that were never written read as padding.
+    std::string data1, data2;
+    absl::Status status = ReadBlock(address / BLOCK_SIZE, &data1, false);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
+    data1.resize(BLOCK_SIZE, ' ');
+    status = ReadBlock(address / BLOCK_SIZE + 1, &data2, false);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
+    data2.resize(BLOCK_SIZE, ' ');
 
     int offset = address % BLOCK_SIZE;
     int len = BLOCK_SIZE - offset;
@@ -616,13 +2536,330 @@ absl::Status BlobServer::Read(int64_t addr, std::string* data) {
   return absl::OkStatus();
 }
 
-absl::Status BlobServer::Write(int64_t address, const std::string& data) {
+absl::Status BlobServer::ReadRange(int64_t address, int64_t length, int chunk_size,
+                                   const std::function<bool(int64_t address, std::string& chunk)>& emit,
+                                   int64_t snapshot) {
+  if(address < 0 || length < 0) {
+    return absl::InvalidArgumentError("Invalid range");
+  }
+  int64_t seq = -1;
+  if(snapshot != 0) {
+    if(this->state != PRIMARY) {
+      return absl::NotFoundError("Please contact primary.");
+    }
+    seq = snapshots_->Sequence(snapshot);
+    if(seq < 0) {
+      return absl::FailedPreconditionError("Unknown or expired snapshot");
+    }
+  }
+  if(chunk_size <= 0) {
+    chunk_size = READ_RANGE_CHUNK_BYTES;
+  }
+  chunk_size = std::min(chunk_size, READ_RANGE_MAX_CHUNK_BYTES);
+  int64_t end = address + length;
+  ReadAhead(address, std::min(end, address + chunk_size));
+  for(int64_t chunk_start = address; chunk_start < end; chunk_start += chunk_size) {
+    int64_t chunk_end = std::min(end, chunk_start + chunk_size);
+    int64_t first_block = chunk_start / BLOCK_SIZE;
+    int64_t last_block = (chunk_end - 1) / BLOCK_SIZE;
+    std::string chunk;
+    chunk.reserve(chunk_end - chunk_start);
+    if(seq >= 0) {
+      // Images a snapshot reads do not change: no locks.
+      std::string data;
+      for(int64_t block = first_block; block <= last_block; block++) {
+        if(access_profile_) {
+          access_profile_->Record(block, false);
+        }
+        absl::Status status = ReadBlockAt(block, seq, &data);
+        if(absl::IsDataLoss(status)) {
+          return status;
+        }
+        data.resize(BLOCK_SIZE, ' ');
+        int64_t from = std::max(chunk_start, block * BLOCK_SIZE) - block * BLOCK_SIZE;
+        int64_t to = std::min(chunk_end, (block + 1) * BLOCK_SIZE) - block * BLOCK_SIZE;
+        chunk.append(data, from, to - from);
+      }
+      // Its images stay until it expires.
+      if(snapshots_->Sequence(snapshot) < 0) {
+        return absl::FailedPreconditionError("Unknown or expired snapshot");
+      }
+    } else {
+      std::vector<bool> touched(shards_.size(), false);
+      for(int64_t block = first_block; block <= last_block; block++) {
+        touched[GetShardIndex(block)] = true;
+        if(access_profile_) {
+          access_profile_->Record(block, false);
+        }
+      }
+      // A block that fails its checksum is repaired without the locks, and
+      // the chunk read again.
+      int64_t corrupt_block;
+      do {
+        corrupt_block = -1;
+        chunk.clear();
+        std::vector<std::shared_lock<std::shared_timed_mutex>> recovery_locks, read_locks;
+        for(size_t id = 0; id < shards_.size(); id++) {
+          if(touched[id]) {
+            recovery_locks.emplace_back(shards_[id]->recovery_mutex);
+          }
+        }
+        for(size_t id = 0; id < shards_.size(); id++) {
+          if(touched[id]) {
+            read_locks.emplace_back(shards_[id]->mutex);
+          }
+        }
+
+        if(this->state == BACKUP && !TakeOverAsPrimary()){
+          return absl::NotFoundError("Please contact primary.");
+        }
+
+        std::string data;
+        for(int64_t block = first_block; block <= last_block; block++) {
+          absl::Status status = ReadBlock(block, &data, false);
+          if(absl::IsDataLoss(status)) {
+            corrupt_block = block;
+            break;
+          }
+          data.resize(BLOCK_SIZE, ' ');
+          int64_t from = std::max(chunk_start, block * BLOCK_SIZE) - block * BLOCK_SIZE;
+          int64_t to = std::min(chunk_end, (block + 1) * BLOCK_SIZE) - block * BLOCK_SIZE;
+          chunk.append(data, from, to - from);
+        }
+        if(corrupt_block >= 0) {
+          read_locks.clear();
+          recovery_locks.clear();
+          absl::Status status = RepairCorruptBlock(corrupt_block);
+          if(absl::IsDataLoss(status)) {
+            return status;
+          }
+        }
+      } while(corrupt_block >= 0);
+    }
+    // Start the disk on the next chunk while this one is on the wire.
+    ReadAhead(chunk_end, std::min(end, chunk_end + chunk_size));
+    if(!emit(chunk_start, chunk)) {
+      return absl::CancelledError("Range read cancelled");
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status BlobServer::CreateSnapshot(int64_t* snapshot) {
+  if(this->state != PRIMARY) {
+    return absl::NotFoundError("Please contact primary.");
+  }
+  int64_t seq;
+  {
+    // Between two commits: every image made visible so far, and none after.
+    // Commits hold snapshot_mutex_ shared, and keep on taking it while the
+    // gate is open: close it first.
+    std::lock_guard<std::mutex> gate(snapshot_gate_);
+    std::unique_lock<std::shared_timed_mutex> lock(snapshot_mutex_);
+    seq = commit_seq_;
+    *snapshot = snapshots_->Create(seq);
+  }
+  SnapshotStats stats = snapshots_->get_stats();
+  std::cout << "[Snapshot] Created snapshot " << *snapshot << " at commit " << seq << ": " << stats.snapshots
+            << " live, " << stats.versions << " images kept (" << stats.bytes << " bytes)" << std::endl;
+  return absl::OkStatus();
+}
+
+absl::Status BlobServer::ReleaseSnapshot(int64_t snapshot) {
+  if(!snapshots_->Release(snapshot)) {
+    return absl::FailedPreconditionError("Unknown or expired snapshot");
+  }
+  SnapshotStats stats = snapshots_->get_stats();
+  std::cout << "[Snapshot] Released snapshot " << snapshot << ": " << stats.snapshots << " live, "
+            << stats.versions << " images kept (" << stats.bytes << " bytes)" << std::endl;
+  return absl::OkStatus();
+}
+
+absl::Status BlobServer::ReadAt(int64_t snapshot, int64_t addr, std::string* data) {
+  if(this->state != PRIMARY) {
+    return absl::NotFoundError("Please contact primary.");
+  }
+  int64_t seq = snapshots_->Sequence(snapshot);
+  if(seq < 0) {
+    return absl::FailedPreconditionError("Unknown or expired snapshot");
+  }
+  RecordAccess(addr, false);
+  int64_t address = RoutingAddress(addr);
+  if(address % BLOCK_SIZE == 0) {
+    absl::Status status = ReadBlockAt(address / BLOCK_SIZE, seq, data);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
+  } else {
+    // Blocks that were never written read as padding.
+    std::string data1, data2;
+    absl::Status status = ReadBlockAt(address / BLOCK_SIZE, seq, &data1);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
+    status = ReadBlockAt(address / BLOCK_SIZE + 1, seq, &data2);
+    if(absl::IsDataLoss(status)) {
+      return status;
+    }
+    data1.resize(BLOCK_SIZE, ' ');
+    data2.resize(BLOCK_SIZE, ' ');
+    int offset = address % BLOCK_SIZE;
+    *data = data1.substr(offset, BLOCK_SIZE - offset) + data2.substr(0, offset);
+  }
+  // Its images stay until it expires.
+  if(snapshots_->Sequence(snapshot) < 0) {
+    return absl::FailedPreconditionError("Unknown or expired snapshot");
+  }
+  return absl::OkStatus();
+}
+
+// The image kept for the snapshot, or else the block as it is now if no
+// commit replaced it meanwhile: one that did has kept the image by the time
+// the block's version changes back to stable.
+absl::Status BlobServer::ReadBlockAt(int64_t block, int64_t seq, std::string* data) {
+  while(true) {
+    uint64_t version = block_versions_.Get(block);
+    if(!BlockVersions::Stable(version)) {
+      std::this_thread::yield();
+      continue;
+    }
+    absl::Status status;
+    if(snapshots_->Find(block, seq, &status, data)) {
+      return status;
+    }
+    uint32_t crc;
+    status = LoadBlock(block, data, &crc);
+    if(block_versions_.Get(block) == version) {
+      return status;
+    }
+  }
+}
+
+std::shared_lock<std::shared_timed_mutex> BlobServer::LockCommitsShared() {
+  {
+    std::lock_guard<std::mutex> gate(snapshot_gate_);
+  }
+  return std::shared_lock<std::shared_timed_mutex>(snapshot_mutex_);
+}
+
+void BlobServer::KeepSnapshotImages(int64_t block1, int64_t block2, bool trim) {
+  int64_t seq = ++commit_seq_;
+  std::vector<int64_t> blocks = trim ? std::vector<int64_t>() : WrittenBlocks(block1, block2);
+  if(trim && snapshots_->HasSnapshots()) {
+    for(int64_t block = block1; block < block2; block++) {
+      blocks.push_back(block);
+    }
+  }
+  for(int64_t block : blocks) {
+    if(!snapshots_->NeedsImage(block)) {
+      continue;
+    }
+    std::string data;
+    uint32_t crc;
+    absl::Status status = LoadBlock(block, &data, &crc);
+    // A block that stays unwritten has nothing to keep.
+    if(trim && absl::IsNotFound(status)) {
+      continue;
+    }
+    snapshots_->Keep(block, seq, status, std::move(data));
+  }
+}
+
+// Ask the kernel to start reading the block files behind [address, end).
+void BlobServer::ReadAhead(int64_t address, int64_t end) {
+  char fill;
+  for(int64_t block = address / BLOCK_SIZE; block * BLOCK_SIZE < end; block++) {
+    if(allocation_map_->Lookup(block, &fill) != AllocationMap::ALLOCATED) {
+      continue;
+    }
+    int fd = open(GetFilePath(this->root_path_, block).c_str(), O_RDONLY);
+    if(fd < 0) {
+      continue;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+}
+
+absl::Status BlobServer::Write(int64_t address, const std::string& data, blobstore::Durability durability) {
   // Data size must be a fixed size
   assert(data.size() == BLOCK_SIZE);
+  if(!blobstore::Durability_IsValid(durability)) {
+    return absl::InvalidArgumentError("Unknown durability level");
+  }
+  RecordAccess(address, true);
+  absl::Status status = options_.coalesce_writes ? CoalesceWrite(address, data, durability)
+                                                 : WriteOne(address, data, durability);
+  if(status.ok()) {
+    durability_writes_[durability]++;
+  }
+  return status;
+}
+
+// The first write to an address that finds none in progress writes it. The
+// writes that arrive meanwhile queue up; when it is done the oldest of them
+// writes, on behalf of all of them, the last one's data at the strongest of
+// their durability levels. Every write covers the same bytes, so applying
+// them in order leaves that image, and as none of them was acknowledged
+// before, nobody could have seen the ones in between.
+absl::Status BlobServer::CoalesceWrite(int64_t address, const std::string& data, blobstore::Durability durability) {
+  Shard& shard = GetShard(RoutingAddress(address) / BLOCK_SIZE);
+  QueuedWrite self;
+  self.data = &data;
+  self.durability = durability;
+  WriteQueue* queue;
+  std::vector<QueuedWrite*> batch;
+  {
+    std::unique_lock<std::mutex> lock(shard.write_queue_mutex);
+    queue = &shard.write_queues[address];
+    queue->waiting.push_back(&self);
+    self.cv.wait(lock, [&]() { return self.done || (!queue->writing && queue->waiting.front() == &self); });
+    if(self.done) {
+      return self.status;
+    }
+    queue->writing = true;
+    batch.assign(queue->waiting.begin(), queue->waiting.end());
+    queue->waiting.clear();
+  }
+
+  bool sync = false, wait = false;
+  for(QueuedWrite* write : batch) {
+    sync = sync || SyncsToDisk(write->durability);
+    wait = wait || WaitsForBackups(write->durability);
+  }
+  blobstore::Durability batch_durability =
+      wait ? (sync ? blobstore::DURABILITY_REPLICATED_DISK : blobstore::DURABILITY_REPLICATED_MEMORY)
+           : (sync ? blobstore::DURABILITY_LOCAL_DISK : blobstore::DURABILITY_PRIMARY_MEMORY);
+  absl::Status status = WriteOne(address, *batch.back()->data, batch_durability);
+  if(status.ok()) {
+    coalesced_writes_ += batch.size() - 1;
+  }
+
+  std::lock_guard<std::mutex> lock(shard.write_queue_mutex);
+  // Acknowledge in arrival order, then hand over to the next write.
+  for(QueuedWrite* write : batch) {
+    write->status = status;
+    write->done = true;
+    write->cv.notify_one();
+  }
+  queue->writing = false;
+  if(queue->waiting.empty()) {
+    shard.write_queues.erase(address);
+  } else {
+    queue->waiting.front()->cv.notify_one();
+  }
+  return status;
+}
+
+absl::Status BlobServer::WriteOne(int64_t address, const std::string& data, blobstore::Durability durability) {
   #ifdef performance_measure
   auto lock_acquire_start = std::chrono::high_resolution_clock::now();
   #endif
-  std::shared_lock<std::shared_timed_mutex> recovery_lock(this->recovery_mutex_);
+  std::vector<int> shard_ids = GetShardIndexes(RoutingAddress(address));
+  std::vector<std::shared_lock<std::shared_timed_mutex>> recovery_locks;
+  for(int id : shard_ids) {
+    recovery_locks.emplace_back(shards_[id]->recovery_mutex);
+  }
   #ifdef debug
   std::cout << "[BlobServer::Write()]: " << address << std::endl;
   #endif
@@ -633,38 +2870,37 @@ absl::Status BlobServer::Write(int64_t address, const std::string& data) {
   std::cout << "[Perf][LockAcquire]: " << std::chrono::duration_cast<std::chrono::microseconds>(lock_acquire_end - lock_acquire_start).count() << " us" << std::endl;
   #endif
 
-  {
-    int64_t block_address = address / BLOCK_SIZE;
-    int id1 = block_address % NUM_MUTEXES, id2 = (block_address + 1) % NUM_MUTEXES;
-    if(id1 > id2)
-        std::swap(id1, id2);
-
-    // Acquire locks for both adjacent blocks
-    std::unique_lock<std::mutex> lock1(this->mutex_pool_[id1]);
-    std::unique_lock<std::mutex> lock2(this->mutex_pool_[id2]);
-    
-    if(this->state == BACKUP) {
-      bool primaryFailure = CheckPrimaryFailure();
-      if(!primaryFailure) {
-        absl::string_view err_msg("Please contact primary.");
-        return absl::NotFoundError(err_msg);
-      }
-      std::cout << "[Backup] Primary failure detected. Taking over as the new Primary." << std::endl;
-      this->state = PRIMARY;
-      backupAlive = false;
-    }
-    
-    int rc = Prepare(address, data);
-    if(rc != 0){
-      std::cout << "[Write]: " << address << ", Prepare failure: " << rc << std::endl;
-      return absl::CancelledError();
-   }
+  int64_t block_address = RoutingAddress(address) / BLOCK_SIZE;
+  std::mutex* lock_ptr1 = &GetShard(block_address).mutex_pool[block_address % NUM_MUTEXES];
+  std::mutex* lock_ptr2 = &GetShard(block_address + 1).mutex_pool[(block_address + 1) % NUM_MUTEXES];
+  if(std::less<std::mutex*>()(lock_ptr2, lock_ptr1))
+      std::swap(lock_ptr1, lock_ptr2);
+
+  // Acquire locks for both adjacent blocks. They are held until the commit so
+  // that a second write to the block can't replace the prepared tmp file.
+  std::unique_lock<std::mutex> lock1(*lock_ptr1);
+  std::unique_lock<std::mutex> lock2(*lock_ptr2);
+
+  if(this->state == BACKUP && !TakeOverAsPrimary()) {
+    absl::string_view err_msg("Please contact primary.");
+    return absl::NotFoundError(err_msg);
   }
 
-  // Coarse-grained locking for commit
-  std::unique_lock<std::shared_timed_mutex> write_lock(this->mutex_);
+  int64_t txId = generate_txId();
+  std::shared_ptr<ReplicationRound> round;
+  int rc = Prepare(txId, address, data, round, durability);
+  if(rc != 0){
+    std::cout << "[Write]: " << address << ", Prepare failure: " << rc << std::endl;
+    return absl::CancelledError();
+  }
 
-  int rc = Commit(address);
+  // Coarse-grained locking for commit, per shard
+  std::vector<std::unique_lock<std::shared_timed_mutex>> write_locks;
+  for(int id : shard_ids) {
+    write_locks.emplace_back(shards_[id]->mutex);
+  }
+
+  rc = Commit(txId, address, round, durability);
   #ifdef performance_measure
   auto write_end = std::chrono::high_resolution_clock::now();
   std::cout << "[Perf][Write]: " << std::chrono::duration_cast<std::chrono::microseconds>(write_end - write_start).count() << " us" << std::endl;
@@ -674,6 +2910,100 @@ absl::Status BlobServer::Write(int64_t address, const std::string& data) {
     std::cout << "[Write]: " << address << ", Commit failure: " << rc << std::endl;
     return absl::CancelledError();
   }
+  return absl::OkStatus();
+}
+absl::Status BlobServer::Trim(int64_t address, int64_t length) {
+  if(address < 0 || length < 0 || address % BLOCK_SIZE != 0 || length % BLOCK_SIZE != 0) {
+    return absl::InvalidArgumentError("Trim range must be block aligned");
+  }
+  #ifdef debug
+  std::cout << "[BlobServer::Trim()]: " << address << " +" << length << std::endl;
+  #endif
+  int64_t end_block = (address + length) / BLOCK_SIZE;
+  for(int64_t block = address / BLOCK_SIZE; block < end_block; ) {
+    int64_t stripe_end = std::min(end_block, (block / SHARD_STRIPE_BLOCKS + 1) * SHARD_STRIPE_BLOCKS);
+    absl::Status status = TrimStripe(block, stripe_end);
+    if(!status.ok()) {
+      return status;
+    }
+    block = stripe_end;
+  }
+  return absl::OkStatus();
+}
+
+// One transaction, like a write of every block of the piece: the block locks
+// of the piece are held throughout, and the shard lock for the commit.
+absl::Status BlobServer::TrimStripe(int64_t first_block, int64_t end_block) {
+  Shard& shard = GetShard(first_block);
+  std::shared_lock<std::shared_timed_mutex> recovery_lock(shard.recovery_mutex);
+  std::vector<int> slots;
+  for(int64_t block = first_block; block < end_block && (int)slots.size() < NUM_MUTEXES; block++) {
+    slots.push_back(block % NUM_MUTEXES);
+  }
+  std::sort(slots.begin(), slots.end());
+  std::vector<std::unique_lock<std::mutex>> block_locks;
+  for(int slot : slots) {
+    block_locks.emplace_back(shard.mutex_pool[slot]);
+  }
+
+  if(this->state == BACKUP && !TakeOverAsPrimary()) {
+    return absl::NotFoundError("Please contact primary.");
+  }
+
+  // Trimming free blocks is a no-op; don't log or replicate it.
+  bool mapped = false;
+  for(int64_t block = first_block; block < end_block && !mapped; block++) {
+    mapped = BlockMapped(block);
+  }
+  if(!mapped) {
+    return absl::OkStatus();
+  }
+
+  int64_t txId = generate_txId();
+  std::shared_ptr<ReplicationRound> round = StartReplication(txId, first_block * BLOCK_SIZE, "",
+                                                             end_block - first_block);
+  if(round) {
+    WaitForQuorum(*round, false);
+  }
 
+  int rc;
+  {
+    std::unique_lock<std::shared_timed_mutex> write_lock(shard.mutex);
+    rc = TrimLocal(txId, first_block, end_block);
+  }
+  if(round) {
+    DecideRound(*round, rc == 0);
+    if(rc == 0) {
+      WaitForQuorum(*round, true);
+    }
+  }
+  if(rc != 0) {
+    std::cout << "[Trim]: blocks " << first_block << "-" << end_block << ", Commit failure: " << rc << std::endl;
+    return absl::CancelledError();
+  }
   return absl::OkStatus();
-}
\ No newline at end of file
+}
+
+// Log the trim, then free the blocks. With async_apply the trim is journaled
+// and applied behind the writes before it.
+int BlobServer::TrimLocal(int64_t txId, int64_t first_block, int64_t end_block) {
+  if(options_.async_apply) {
+    JournalRecord record;
+    record.txid = txId;
+    record.block1 = first_block;
+    record.block2 = end_block;
+    record.trim = true;
+    return CommitJournaled(std::move(record));
+  }
+  if(GetShard(first_block).logger->add_entry(txId, first_block, end_block, LOG_STATUS_TRIM) < 0) {
+    return -1;
+  }
+  ObserveTxId(txId);
+  auto snapshot_lock = LockCommitsShared();
+  BlockWriteGuard guard(block_versions_, TrimmedBlocks(first_block, end_block));
+  KeepSnapshotImages(first_block, end_block, true);
+  for(int64_t block = first_block; block < end_block; block++) {
+    UnmapBlock(block);
+  }
+  return 0;
+}
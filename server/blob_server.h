@@ -4,8 +4,29 @@
 #include "absl/status/status.h"
 #include <grpcpp/grpcpp.h>
 #include "logger.h"
+#include "journal.h"
+#include "compression.h"
+#include "allocation_map.h"
+#include "merkle_tree.h"
+#include "access_profile.h"
+#include "snapshot_store.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <shared_mutex>
 #include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
 
 #ifdef BAZEL_BUILD
 #else
@@ -13,48 +34,680 @@
 #endif
 
 #define NUM_MUTEXES 32
+#define BLOCK_SIZE 4096
+static_assert(JOURNAL_MAX_DATA_BYTES == BLOCK_SIZE, "journal records hold block images");
+#define BACKUP_CONNECT_TIMEOUT_MS 5000
+// A peer that does not answer a Ping within this long counts as down, so a
+// hung primary is taken over like a crashed one.
+#define PING_DEADLINE_MS 2000
+// A backup that does not answer a Prepare or Commit within this long counts
+// as down: the write goes on without it, and it catches up once back. Well
+// under the clients' own deadline, so that the write still succeeds.
+#define REPLICATION_DEADLINE_MS 2000
+// How often the primary sends its live backups their replication progress,
+// and retries telling a backup it dropped to rejoin.
+#define PEER_PING_INTERVAL_MS 500
+// A backup answers hedged reads only while the oldest write it may be
+// missing is at most this old, as far as it last heard from the primary.
+#define BACKUP_READ_STALENESS_MS 1000
+// Blocks are striped across shards in runs of this many blocks (1 MB).
+#define SHARD_STRIPE_BLOCKS 256
+// Separates peers in the <other-ip:port> argument.
+#define PEER_LIST_SEPARATOR ','
+// With async_apply, commits wait once this many writes are waiting for the applier.
+#define APPLY_QUEUE_LIMIT 4096
+// Prepare/Commit and CatchUp requests queued for one peer, and the threads
+// sending them. Writes wait once the queue of a live peer is full.
+#define REPLICATION_QUEUE_LIMIT 1024
+#define REPLICATION_WORKERS 16
+// Log records per contiguous range shipped in a RecoveryRequest.
+#define LOG_RANGE_RECORDS 65536
+// Log records per CatchUp request of an online recovery.
+#define CATCH_UP_BATCH_RECORDS 256
+// A fully applied journal is truncated once it grows past this size.
+#define JOURNAL_TRUNCATE_BYTES (16 << 20)
+// Blocks fetched per ReadBlocks call when repairing a backup.
+#define ANTI_ENTROPY_BATCH_BLOCKS 256
+// A peer that does not answer a ReadBlocks call within this long has no copy
+// to give: a read repairing a block still answers within the clients' deadline.
+#define READ_BLOCKS_DEADLINE_MS 2000
+// Default and largest chunk streamed by ReadRange; the largest stays under
+// gRPC's default 4 MB receive limit.
+#define READ_RANGE_CHUNK_BYTES (1 << 20)
+#define READ_RANGE_MAX_CHUNK_BYTES (2 << 20)
+// Blocks and regions in a heatmap dump, and by default in GetHeatmap.
+#define HEATMAP_ENTRIES 16
+// Version slots blocks are hashed to for lock-free reads (BlockVersions).
+#define BLOCK_VERSION_SLOTS 4096
+// Lock-free attempts of a read before it takes the shard locks.
+#define LOCK_FREE_READ_ATTEMPTS 8
 
 enum BlobServerState {
   PRIMARY,
   BACKUP,
 };
 
+// What the Replicate streams to the peers carried.
+struct ReplicationStreamStats {
+  // Streams opened, including ones reopened after a peer came back.
+  int64_t streams = 0;
+  int64_t messages = 0;
+  // Acks received; each covers every message up to the one it names.
+  int64_t acks = 0;
+};
+
+// A long-lived Replicate stream over one connection. Any thread sends a
+// message on it and waits for the ack that covers it. A stream that breaks
+// (the peer went away) fails the messages waiting on it, and the next
+// message opens a new one.
+class ReplicationStream {
+  public:
+    explicit ReplicationStream(blobstore::StoreInternal::Stub* stub) : stub_(stub) {}
+    ~ReplicationStream() {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      CloseLocked();
+    }
+
+    // Number message, send it and wait for its ack, for at most
+    // REPLICATION_DEADLINE_MS.
+    grpc::Status Send(blobstore::ReplicateMessage* message) {
+      std::shared_ptr<Open> open;
+      int64_t seq;
+      {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if(!open_ || open_->broken) {
+          CloseLocked();
+          open_ = std::make_shared<Open>();
+          open_->stream = stub_->Replicate(&open_->context);
+          open_->reader = std::thread(&ReplicationStream::ReadAcks, this, open_.get());
+          streams_++;
+        }
+        open = open_;
+        seq = ++open->sent;
+        message->set_seq(seq);
+        messages_++;
+        if(!open->stream->Write(*message)) {
+          open->context.TryCancel();
+        }
+      }
+      std::unique_lock<std::mutex> lock(open->mutex);
+      if(!open->cv.wait_for(lock, std::chrono::milliseconds(REPLICATION_DEADLINE_MS),
+                            [&]() { return open->acked >= seq || open->broken; })) {
+        // The peer stopped acknowledging. Close the stream, failing every
+        // message still waiting on it; the next Send opens a new one.
+        open->broken = true;
+        open->cv.notify_all();
+        lock.unlock();
+        open->context.TryCancel();
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, "Replication ack timed out");
+      }
+      if(open->acked < seq) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Replication stream broke");
+      }
+      if(open->failed.erase(seq) > 0) {
+        return grpc::Status(grpc::StatusCode::INTERNAL, "Replicated message failed");
+      }
+      return grpc::Status::OK;
+    }
+
+    void AddStats(ReplicationStreamStats* stats) {
+      stats->streams += streams_;
+      stats->messages += messages_;
+      stats->acks += acks_;
+    }
+
+  private:
+    struct Open {
+      grpc::ClientContext context;
+      std::unique_ptr<grpc::ClientReaderWriter<blobstore::ReplicateMessage, blobstore::ReplicateAck>> stream;
+      std::thread reader;
+      // Under write_mutex_.
+      int64_t sent = 0;
+      std::mutex mutex;
+      std::condition_variable cv;
+      int64_t acked = 0;
+      std::unordered_set<int64_t> failed;
+      std::atomic<bool> broken{false};
+    };
+
+    void ReadAcks(Open* open) {
+      blobstore::ReplicateAck ack;
+      while(open->stream->Read(&ack)) {
+        acks_++;
+        std::lock_guard<std::mutex> lock(open->mutex);
+        open->acked = ack.seq();
+        open->failed.insert(ack.failed_seq().begin(), ack.failed_seq().end());
+        open->cv.notify_all();
+      }
+      std::lock_guard<std::mutex> lock(open->mutex);
+      open->broken = true;
+      open->cv.notify_all();
+    }
+
+    // Under write_mutex_, so that no Write is in progress.
+    void CloseLocked() {
+      if(!open_) {
+        return;
+      }
+      open_->context.TryCancel();
+      open_->reader.join();
+      open_->stream->Finish();
+      open_.reset();
+    }
+
+    blobstore::StoreInternal::Stub* stub_;
+    // Serializes Writes, and so numbers messages in the order they are sent.
+    std::mutex write_mutex_;
+    std::shared_ptr<Open> open_;
+    std::atomic<int64_t> streams_{0};
+    std::atomic<int64_t> messages_{0};
+    std::atomic<int64_t> acks_{0};
+};
+
+// StoreInternal stub over a pool of connections to one peer. Every channel
+// gets its own subchannel pool, so gRPC opens a separate HTTP/2 connection
+// per channel instead of sharing one.
 class StoreInternalClient {
   public:
-    StoreInternalClient(std::shared_ptr<grpc::Channel> channel)
-        : stub_(blobstore::StoreInternal::NewStub(channel)) {}
+    StoreInternalClient(const std::string& address, int num_channels = 1) {
+      for(int i = 0; i < std::max(1, num_channels); i++) {
+        grpc::ChannelArguments ch_args;
+        ch_args.SetMaxReceiveMessageSize(-1);
+        ch_args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        channels_.push_back(grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), ch_args));
+        stubs_.push_back(blobstore::StoreInternal::NewStub(channels_.back()));
+        streams_.push_back(std::make_unique<ReplicationStream>(stubs_.back().get()));
+      }
+    }
+
+    int num_channels() {
+      return channels_.size();
+    }
+
+    // Block until the channels are connected. A channel to a server that was
+    // down sits in reconnect backoff for a while after the server returns;
+    // reset_backoff (the server is known to be back) retries right away.
+    bool WaitForConnected(int timeout_ms, bool reset_backoff = false) {
+      auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(timeout_ms);
+      bool connected = true;
+      for(auto& channel : channels_) {
+        if(reset_backoff) {
+          grpc::experimental::ChannelResetConnectionBackoff(channel.get());
+        }
+        connected = channel->WaitForConnected(deadline) && connected;
+      }
+      return connected;
+    }
 
     grpc::Status Ping(const blobstore::PingRequest& request, blobstore::PingResponse* response) {
       grpc::ClientContext context;
-      return stub_->Ping(&context, request, response);
+      context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(PING_DEADLINE_MS));
+      return stubs_[0]->Ping(&context, request, response);
     }
   
-    grpc::Status Prepare(const blobstore::PrepareRequest& request, blobstore::PrepareResponse* response) {
+    // Requests with the same key (the block) always use the same channel.
+    grpc::Status Prepare(const blobstore::PrepareRequest& request, blobstore::PrepareResponse* response,
+                         int64_t key = 0) {
       grpc::ClientContext context;
-      return stub_->Prepare(&context, request, response);
+      context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(REPLICATION_DEADLINE_MS));
+      return Stub(key)->Prepare(&context, request, response);
     }
   
-    grpc::Status Commit(const blobstore::CommitRequest& request, blobstore::CommitResponse* response) {
+    grpc::Status Commit(const blobstore::CommitRequest& request, blobstore::CommitResponse* response,
+                        int64_t key = 0) {
       grpc::ClientContext context;
-      return stub_->Commit(&context, request, response);
+      context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(REPLICATION_DEADLINE_MS));
+      return Stub(key)->Commit(&context, request, response);
     }
   
+    // A Prepare or Commit on the Replicate stream of the key's channel.
+    grpc::Status Replicate(blobstore::ReplicateMessage* message, int64_t key = 0) {
+      return streams_[(uint64_t)key % streams_.size()]->Send(message);
+    }
+
+    void AddStreamStats(ReplicationStreamStats* stats) {
+      for(auto& stream : streams_) {
+        stream->AddStats(stats);
+      }
+    }
+
+    grpc::Status GetMerkleNodes(const blobstore::MerkleNodesRequest& request, blobstore::MerkleNodesResponse* response) {
+      grpc::ClientContext context;
+      return stubs_[0]->GetMerkleNodes(&context, request, response);
+    }
+
+    grpc::Status ReadBlocks(const blobstore::ReadBlocksRequest& request, blobstore::ReadBlocksResponse* response) {
+      grpc::ClientContext context;
+      context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(READ_BLOCKS_DEADLINE_MS));
+      return stubs_[0]->ReadBlocks(&context, request, response);
+    }
+
+    grpc::Status GetHeatmap(const blobstore::HeatmapRequest& request, blobstore::HeatmapResponse* response) {
+      grpc::ClientContext context;
+      return stubs_[0]->GetHeatmap(&context, request, response);
+    }
+
     grpc::Status Recovery(const blobstore::RecoveryRequest& request, blobstore::RecoveryResponse* response) {
       grpc::ClientContext context;
       // Receive recovery records from primary
       // Replace log entries
       // For each record: Create tmp file and rename to actual file
-      return stub_->Recovery(&context, request, response);
+      return stubs_[0]->Recovery(&context, request, response);
+    }
+
+    grpc::Status CatchUp(const blobstore::CatchUpRequest& request, blobstore::CatchUpResponse* response) {
+      grpc::ClientContext context;
+      return stubs_[0]->CatchUp(&context, request, response);
     }
   
   private:
-    std::unique_ptr<blobstore::StoreInternal::Stub> stub_;
+    blobstore::StoreInternal::Stub* Stub(int64_t key) {
+      return stubs_[(uint64_t)key % stubs_.size()].get();
+    }
+
+    std::vector<std::shared_ptr<grpc::Channel>> channels_;
+    std::vector<std::unique_ptr<blobstore::StoreInternal::Stub>> stubs_;
+    // One per stub, opened by the first message sent on it.
+    std::vector<std::unique_ptr<ReplicationStream>> streams_;
+};
+
+// Tunables, read from the optional server config file (see resources/server.conf).
+struct ServerOptions {
+  // Number of independent shards the block address space is split into.
+  // Must be the same on all replicas and across restarts of a store.
+  int num_shards = 1;
+  // Backups that must acknowledge each Prepare/Commit before a write returns.
+  // 0 waits for every live backup; stragglers always finish in the background.
+  int replication_quorum = 0;
+  // Acknowledge a commit once the block images and the commit record are in
+  // the logs; a background applier writes the block files, and reads go
+  // through the images it has not written yet.
+  bool async_apply = false;
+  // Connections to each peer for Prepare/Commit, picked by block.
+  // 0: one per shard.
+  int replication_channels = 0;
+  // Send Prepare/Commit as messages of a long-lived Replicate stream per
+  // connection, acknowledged in batches; false makes a unary call for each.
+  bool replication_stream = true;
+  // Deflate block payloads of Prepare requests and recovery records sent to
+  // peers that accept it, if at least compression_min_bytes long.
+  bool compression = false;
+  int compression_min_bytes = 512;
+  // A backup compares its blocks with the primary's and repairs the ones that
+  // differ every anti_entropy_interval_s seconds; 0 only on demand.
+  int anti_entropy_interval_s = 0;
+  // Block files a background scrubber re-reads and verifies per second;
+  // 0 disables it.
+  int scrub_blocks_per_s = 0;
+  // Client requests of each kind (read, write, trim, range read) served at
+  // once; more are rejected with RESOURCE_EXHAUSTED. 0 admits everything.
+  // The bound shrinks while reads take longer than admission_read_latency_us
+  // or writes and trims longer than admission_write_latency_us (0: never).
+  int admission_limit = 0;
+  int admission_read_latency_us = 0;
+  int admission_write_latency_us = 0;
+  // A backup answers hedged reads from its own copy. Only taken up with
+  // replication_quorum 0, where acknowledged writes at the replicated
+  // durability levels are on every live backup.
+  bool backup_reads = false;
+  // A rejoining backup asks for online recovery: the primary pauses clients
+  // only to merge the logs and for the final cut-over, and streams the
+  // blocks the backup missed while it serves them.
+  bool online_recovery = false;
+  // Writes to an address that queue up behind one in progress are folded
+  // into a single write of the last of them, with one log record and one
+  // replication round; each of them is acknowledged when it is committed.
+  bool coalesce_writes = false;
+  // Profile the blocks and regions clients read and write (see
+  // AccessProfile); every heatmap_interval_s seconds the profile is logged
+  // and its counts halved. 0 disables the profiler.
+  int heatmap_interval_s = 0;
+  // The primary reads blocks without the shard locks, retrying a read that
+  // raced with a commit to its blocks (see BlockVersions); false takes the
+  // shard locks for every read.
+  bool lock_free_reads = true;
+  // Block images kept for snapshots (see SnapshotStore), in MB; past it the
+  // oldest snapshots expire. Snapshots not released within snapshot_ttl_s
+  // seconds expire too.
+  int snapshot_max_mb = 256;
+  int snapshot_ttl_s = 600;
+};
+
+// Outcome of one BlobServer::AntiEntropy pass.
+struct AntiEntropyStats {
+  // GetMerkleNodes and ReadBlocks calls.
+  int messages = 0;
+  int64_t nodes_compared = 0;
+  int64_t divergent_blocks = 0;
+  int64_t elapsed_ms = 0;
+};
+
+// Phase timings of the last recovery: the backup fills in the log read, the
+// Recovery RPC and the replay, the primary that served it the merge and the
+// creation of the recovery records.
+struct RecoveryStats {
+  int64_t log_entries = 0;
+  int64_t records = 0;
+  int64_t read_logs_us = 0;
+  // Round trip, including the primary's merge and record creation.
+  int64_t rpc_us = 0;
+  int64_t replay_us = 0;
+  int64_t merge_us = 0;
+  int64_t create_records_us = 0;
+  // Online recovery: streaming the records after the Recovery RPC.
+  int64_t catch_up_us = 0;
+  // Primary: time clients were paused for it.
+  int64_t pause_us = 0;
+};
+
+// A client write waiting in a WriteQueue.
+struct QueuedWrite {
+  const std::string* data;
+  blobstore::Durability durability;
+  // Under the shard's write_queue_mutex.
+  std::condition_variable cv;
+  bool done = false;
+  absl::Status status;
+};
+
+// coalesce_writes: the writes to one address that wait for the one in progress.
+struct WriteQueue {
+  std::deque<QueuedWrite*> waiting;
+  bool writing = false;
+};
+
+// A slice of the block address space with its own log, locks and tmp
+// directory. A write is logged in the shard of its first block.
+struct Shard {
+  std::string dir_path;
+  std::string tmp_path;
+  std::shared_ptr<Logger> logger;
+  // Commit (exclusive) vs read (shared).
+  std::shared_timed_mutex mutex;
+  // Per-block locks held from prepare to commit.
+  std::array<std::mutex, NUM_MUTEXES> mutex_pool;
+  std::shared_timed_mutex recovery_mutex;
+  // async_apply only: committed block images not yet in the block files.
+  std::shared_ptr<Journal> journal;
+  std::mutex journal_mutex;
+  // Records in the journal the applier has not written (under journal_mutex).
+  int unapplied = 0;
+  // coalesce_writes: queued writes by address.
+  std::mutex write_queue_mutex;
+  std::unordered_map<int64_t, WriteQueue> write_queues;
+};
+
+// A block image that was committed but not yet written to its block file.
+struct LookasideEntry {
+  int64_t txid;
+  std::string data;
+};
+
+// The replication work for one peer, run by a fixed pool of workers. Every
+// item names the block slots it touches and starts only once the items
+// queued before it on any of them have finished, so a peer sees writes to a
+// block in the order the primary queued them, with its block locks held,
+// even when their Prepare/Commit finish after the client was answered. An
+// item whose step waits for something else (a Prepare waiting for the
+// primary's decision) returns false and gives its worker back; it keeps its
+// slots until Resume runs its last step.
+class ReplicationQueue {
+  public:
+    // One step of an item; true once the item is done.
+    using Step = std::function<bool()>;
+
+    ~ReplicationQueue() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cv_.notify_all();
+      }
+      for(auto& worker : workers_) {
+        worker.join();
+      }
+    }
+
+    void Start(int num_workers) {
+      for(int i = 0; i < num_workers; i++) {
+        workers_.emplace_back(&ReplicationQueue::Run, this);
+      }
+    }
+
+    // Blocks while REPLICATION_QUEUE_LIMIT items are queued or in progress.
+    void Push(std::vector<int> slots, Step step) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      space_cv_.wait(lock, [&]() { return size_ < REPLICATION_QUEUE_LIMIT; });
+      size_++;
+      pending_.push_back(Item{std::move(slots), std::move(step)});
+      cv_.notify_one();
+    }
+
+    // Run the next step of an item whose step returned false.
+    void Resume(std::vector<int> slots, Step step) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      resumed_.push_back(Item{std::move(slots), std::move(step)});
+      cv_.notify_one();
+    }
+
+    void WaitUntilEmpty() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      space_cv_.wait(lock, [&]() { return size_ == 0; });
+    }
+
+  private:
+    struct Item {
+      std::vector<int> slots;
+      Step step;
+    };
+
+    // A resumed item, or else the first queued one none of whose slots is
+    // held or wanted by an item ahead of it.
+    bool TakeLocked(Item* item) {
+      if(!resumed_.empty()) {
+        *item = std::move(resumed_.front());
+        resumed_.pop_front();
+        return true;
+      }
+      std::bitset<NUM_MUTEXES> ahead = held_;
+      for(auto it = pending_.begin(); it != pending_.end() && !ahead.all(); it++) {
+        bool free = true;
+        for(int slot : it->slots) {
+          free = free && !ahead[slot];
+        }
+        if(free) {
+          for(int slot : it->slots) {
+            held_[slot] = true;
+          }
+          *item = std::move(*it);
+          pending_.erase(it);
+          return true;
+        }
+        for(int slot : it->slots) {
+          ahead[slot] = true;
+        }
+      }
+      return false;
+    }
+
+    void Run() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while(true) {
+        Item item;
+        cv_.wait(lock, [&]() { return stop_ || TakeLocked(&item); });
+        if(!item.step) {
+          return;
+        }
+        lock.unlock();
+        bool done = item.step();
+        lock.lock();
+        if(done) {
+          for(int slot : item.slots) {
+            held_[slot] = false;
+          }
+          size_--;
+          space_cv_.notify_all();
+          // Items behind it on its slots may start.
+          cv_.notify_all();
+        }
+      }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable space_cv_;
+    std::deque<Item> pending_;
+    std::deque<Item> resumed_;
+    // Slots of the items in progress.
+    std::bitset<NUM_MUTEXES> held_;
+    // Items queued or in progress.
+    int size_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+// Seqlock over what blocks read as, for reads that take no locks. Every
+// change that makes a block image visible (a commit's renames, fills,
+// lookaside entries, trims, repairs) runs between BeginWrite and EndWrite
+// of its blocks. A reader takes Get of its blocks before and after reading
+// them and keeps the result only if both are the same and Stable. Blocks
+// share BLOCK_VERSION_SLOTS slots, so a commit to another block of the slot
+// also makes a reader retry.
+//
+// The low bits of a slot count the writers in progress, so that writers may
+// overlap (the applier and a repair, say); the bits above are a generation
+// bumped by every EndWrite.
+class BlockVersions {
+  public:
+    void BeginWrite(int64_t block) {
+      slots_[Slot(block)].fetch_add(1);
+    }
+    void EndWrite(int64_t block) {
+      slots_[Slot(block)].fetch_add(GENERATION - 1);
+    }
+    uint64_t Get(int64_t block) {
+      return slots_[Slot(block)].load();
+    }
+    static bool Stable(uint64_t version) {
+      return (version & (GENERATION - 1)) == 0;
+    }
+  private:
+    static const uint64_t GENERATION = 1 << 20;
+    static size_t Slot(int64_t block) {
+      return (uint64_t)block % BLOCK_VERSION_SLOTS;
+    }
+    std::array<std::atomic<uint64_t>, BLOCK_VERSION_SLOTS> slots_{};
+};
+
+// Holds BlockVersions::BeginWrite on a set of blocks for its lifetime.
+class BlockWriteGuard {
+  public:
+    BlockWriteGuard(BlockVersions& versions, std::vector<int64_t> blocks)
+        : versions_(versions), blocks_(std::move(blocks)) {
+      for(int64_t block : blocks_) {
+        versions_.BeginWrite(block);
+      }
+    }
+    ~BlockWriteGuard() {
+      for(int64_t block : blocks_) {
+        versions_.EndWrite(block);
+      }
+    }
+  private:
+    BlockVersions& versions_;
+    std::vector<int64_t> blocks_;
+};
+
+// Exclusive hold on every shard's recovery lock (BlobServer::LockAllShards).
+// While one is held, or waited for, reads take the shard locks instead of
+// reading lock-free.
+class AllShardsLock {
+  public:
+    explicit AllShardsLock(std::atomic<int>* holders) : holders_(holders) {
+      (*holders_)++;
+    }
+    AllShardsLock(AllShardsLock&& other) : holders_(other.holders_), locks_(std::move(other.locks_)) {
+      other.holders_ = nullptr;
+    }
+    AllShardsLock(const AllShardsLock&) = delete;
+    AllShardsLock& operator=(const AllShardsLock&) = delete;
+    ~AllShardsLock() {
+      locks_.clear();
+      if(holders_ != nullptr) {
+        (*holders_)--;
+      }
+    }
+    void Lock(std::shared_timed_mutex& mutex) {
+      locks_.emplace_back(mutex);
+    }
+  private:
+    std::atomic<int>* holders_;
+    std::vector<std::unique_lock<std::shared_timed_mutex>> locks_;
+};
+
+// Another replica of the store.
+struct Peer {
+  std::string ip;
+  // Ping.
+  std::unique_ptr<StoreInternalClient> control_client;
+  // Recovery and anti-entropy, on its own connection so that bulk log and
+  // data transfers don't hold up pings or replication.
+  std::unique_ptr<StoreInternalClient> recovery_client;
+  // Prepare/Commit, spread over a pool of connections by block, each with
+  // its Replicate stream.
+  std::unique_ptr<StoreInternalClient> replication_client;
+  // Whether the primary replicates to this peer; set when it rejoins through Recovery.
+  std::atomic<bool> alive{false};
+  // Payload codec the peer accepted when it last rejoined.
+  std::atomic<blobstore::Codec> codec{blobstore::CODEC_NONE};
+  // Rejoined through online recovery and still receiving the blocks it
+  // missed; writes are replicated to it already.
+  std::atomic<bool> catching_up{false};
+  // Dropped after a failed Prepare, Commit or CatchUp; the primary keeps
+  // telling it to rejoin until it has.
+  std::atomic<bool> dropped{false};
+  // Replication rounds pushed to the peer and not finished there yet, with
+  // when they were pushed, and the last round pushed.
+  std::mutex progress_mutex;
+  std::map<int64_t, std::chrono::steady_clock::time_point> unfinished_rounds;
+  int64_t last_round_seq = 0;
+  // Bumped by every online recovery; an older catch-up stream stops.
+  std::atomic<int64_t> catch_up_round{0};
+  // Prepare/Commit and CatchUp requests to send to the peer, in order.
+  ReplicationQueue replication_queue;
+};
+
+// One write being replicated. Every live peer runs Prepare then Commit from
+// its ReplicationQueue; the primary only waits for the quorum of each phase.
+struct ReplicationRound {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int num_peers = 0;
+  // Numbers rounds in the order they were pushed to the peers.
+  int64_t seq = 0;
+  // Acknowledgements that complete a phase.
+  int needed = 0;
+  int prepare_acks = 0;
+  int prepare_done = 0;
+  int commit_acks = 0;
+  int commit_done = 0;
+  // Set by the primary once its local commit finished (or failed).
+  bool decided = false;
+  bool commit = false;
+  // Resume the Commits of peers whose Prepare finished before the decision.
+  std::vector<std::function<void()>> on_decided;
+  blobstore::PrepareRequest prepare_request;
+  // prepare_request with the data compressed, for peers accepting CODEC_DEFLATE.
+  bool compressed = false;
+  blobstore::PrepareRequest compressed_prepare_request;
+  blobstore::CommitRequest commit_request;
 };
 
 class BlobServer {
   public:
+  // Where clients should go: the primary as far as this server knows.
   std::string get_other_ip(){
-    return other_ip_;
+    std::lock_guard<std::mutex> lock(primary_ip_mutex_);
+    return primary_ip_;
   }
   BlobServerState get_state(){
     return state;
@@ -63,49 +716,347 @@ class BlobServer {
     this->state = state;
   }
 
-  std::shared_timed_mutex& getMutex() {
-    return recovery_mutex_;
+  int get_num_shards(){
+    return shards_.size();
+  }
+  const ServerOptions& get_options(){
+    return options_;
+  }
+
+  // Recovery lock of the shard that logs writes to address.
+  std::shared_timed_mutex& getMutex(int64_t address) {
+    return shards_[GetShardIndex(RoutingAddress(address) / BLOCK_SIZE)]->recovery_mutex;
+  }
+
+  // Exclusive hold on every shard's recovery lock, taken in shard order.
+  AllShardsLock LockAllShards();
+
+  // Block payload bytes sent in Prepare requests and recovery records.
+  const PayloadCounters& get_replication_bytes() {
+    return replication_bytes_;
+  }
+  const PayloadCounters& get_recovery_bytes() {
+    return recovery_bytes_;
+  }
+  ReplicationStreamStats get_replication_stream_stats();
+
+  RecoveryStats get_recovery_stats() {
+    std::lock_guard<std::mutex> lock(recovery_stats_mutex_);
+    return recovery_stats_;
   }
+  // Primary: timings of a Recovery RPC it served.
+  void RecordRecoveryServed(int64_t merge_us, int64_t create_records_us, int64_t records, int64_t pause_us);
+  // Backup: whether an online recovery is still streaming blocks to it, and
+  // wait up to timeout_ms for it to finish. Returns whether it finished.
+  bool is_catching_up() {
+    return catching_up_;
+  }
+  bool WaitForCatchUp(int timeout_ms);
+  // Primary: replication rounds started so far; see WriteResponse.
+  int64_t get_replication_seq() {
+    return replication_seq_;
+  }
+  // Backup: what it has of the primary's writes, from a Commit or a heartbeat.
+  void UpdateReplicationProgress(const blobstore::ReplicationProgress& progress);
 
-  void setBackupAlive(bool alive) {
-    backupAlive = alive;
+  // Block files that failed their checksum, and how many of them were
+  // repaired from a peer.
+  int64_t get_checksum_failures() {
+    return checksum_failures_;
   }
+  int64_t get_blocks_repaired() {
+    return blocks_repaired_;
+  }
+
+  // Writes acknowledged at each durability level.
+  int64_t get_writes(blobstore::Durability durability) {
+    return durability_writes_[durability];
+  }
+  // Acknowledged writes that were folded into a later write to the same address.
+  int64_t get_coalesced_writes() {
+    return coalesced_writes_;
+  }
+  // Lock-free reads retried after racing with a commit, and reads that went
+  // on to take the shard locks.
+  int64_t get_lock_free_read_retries() {
+    return lock_free_read_retries_;
+  }
+  int64_t get_locked_reads() {
+    return locked_reads_;
+  }
+  SnapshotStats get_snapshot_stats() {
+    return snapshots_->get_stats();
+  }
+
+  // Backup: compare the block contents with the primary's hash tree and copy
+  // the blocks that differ from the primary.
+  absl::Status AntiEntropy(AntiEntropyStats* stats = nullptr);
+  void GetMerkleNodes(const blobstore::MerkleNodesRequest& request, blobstore::MerkleNodesResponse* response);
+  void ReadBlocks(const blobstore::ReadBlocksRequest& request, blobstore::ReadBlocksResponse* response);
+  // Admin: the access profile, if heatmap_interval_s is set.
+  void GetHeatmap(const blobstore::HeatmapRequest& request, blobstore::HeatmapResponse* response);
+
+  // Start or stop replicating to the peer at ip.
+  void setBackupAlive(const std::string& ip, bool alive);
 
   BlobServer() = delete;
+  // other_ips is a comma-separated list of the other replicas.
   explicit BlobServer(std::string root_path, 
                       std::string self_ip, 
-                      std::string other_ip);
+                      std::string other_ips,
+                      ServerOptions options = ServerOptions());
+  // Waits for background replication and failover tasks.
+  ~BlobServer();
+  // Waits for them without stopping; writes that did not wait for the backups
+  // have reached them afterwards.
+  void WaitForBackgroundTasks();
     
-  absl::Status Read(int64_t address, std::string* data);
-  absl::Status Write(int64_t address, const std::string& data);
-  int PrepareLocal(int64_t address, const std::string& data);
-  int CommitLocal(int64_t txId, int64_t address);
-  std::vector<blobstore::LogEntry>  MergeAndRefreshLogsLocal(std::vector<blobstore::LogEntry>& backup_logs);
-  std::vector<blobstore::RecoveryRecord> CreateRecoveryResponse(std::vector<blobstore::LogEntry>& fresh_logs);
+  // hedge, min_seq: see ReadRequest.
+  absl::Status Read(int64_t address, std::string* data, bool hedge = false, int64_t min_seq = 0);
+  absl::Status Write(int64_t address, const std::string& data,
+                     blobstore::Durability durability = blobstore::DURABILITY_REPLICATED_MEMORY);
+  // Hand [address, address + length) to emit in address order, chunk_size
+  // bytes at a time (0: READ_RANGE_CHUNK_BYTES). Each chunk is read under
+  // the read locks of every shard it touches, or with snapshot (non-zero)
+  // without locks as of the snapshot; emit runs with no locks held and
+  // stops the scan by returning false.
+  absl::Status ReadRange(int64_t address, int64_t length, int chunk_size,
+                         const std::function<bool(int64_t address, std::string& chunk)>& emit,
+                         int64_t snapshot = 0);
+  // Primary: a point-in-time view of every block, read with ReadAt and
+  // ReadRange until it is released. Reads of a snapshot block no writes.
+  absl::Status CreateSnapshot(int64_t* snapshot);
+  absl::Status ReleaseSnapshot(int64_t snapshot);
+  // Read as of a snapshot; FailedPrecondition if it expired.
+  absl::Status ReadAt(int64_t snapshot, int64_t address, std::string* data);
+  // Release the blocks of [address, address + length), which must be block
+  // aligned. Each stripe of the range is trimmed in a transaction of its own.
+  absl::Status Trim(int64_t address, int64_t length);
+  // sync: the write is on disk when they return.
+  int PrepareLocal(int64_t address, const std::string& data, bool sync = false);
+  int CommitLocal(int64_t txId, int64_t address, bool sync = false);
+  // Commit a trim of blocks [first_block, end_block), all in one stripe.
+  int TrimLocal(int64_t txId, int64_t first_block, int64_t end_block);
+  // Moves the entries out of backup_logs.
+  std::vector<blobstore::LogEntry>  MergeAndRefreshLogsLocal(std::vector<blobstore::LogEntry>& backup_logs,
+                                                             const std::string& backup_ip);
+  // Records the codec a rejoining peer accepts and returns the one to
+  // encode its recovery records with.
+  blobstore::Codec NegotiateCodec(const blobstore::RecoveryRequest& request);
+  // Appends the recovery records of the log entries [begin, end) to records,
+  // in place. send_fills: encode blocks of one repeated byte as CODEC_FILL.
+  // sent_blocks: blocks that went out with earlier records of the recovery;
+  // entries whose blocks all did are log-only. The blocks sent are added.
+  void CreateRecoveryResponse(std::vector<blobstore::LogEntry>::const_iterator begin,
+                              std::vector<blobstore::LogEntry>::const_iterator end,
+                              std::unordered_set<int64_t>& sent_blocks,
+                              google::protobuf::RepeatedPtrField<blobstore::RecoveryRecord>* records,
+                              blobstore::Codec codec = blobstore::CODEC_NONE, bool send_fills = false);
+  // Primary, online recovery: replicate to the backup at ip from now on and
+  // stream it the blocks of fresh_logs in the background. Called with every
+  // shard's recovery lock held.
+  void StartCatchUp(const std::string& ip, std::vector<blobstore::LogEntry> fresh_logs,
+                    blobstore::Codec codec, bool send_fills);
+  // Backup: apply a CatchUp request.
+  int HandleCatchUp(const blobstore::CatchUpRequest& request);
   void ServerInit();
+  // Answer a peer's Ping; a ping naming a new primary makes a backup rejoin it.
+  void HandlePing(const blobstore::PingRequest& request, blobstore::PingResponse* response);
+  // Take the primary role (no-op if already primary) and tell the other peers.
+  void BecomePrimary();
   private:
-  void ConnectToOtherBlobServer();
+  void PromoteLocked();
+  void RunInBackground(std::function<void()> task);
+  void ConnectToOtherBlobServers();
+  Peer* FindPeer(const std::string& ip);
   bool CheckPrimaryFailure();
+  bool TakeOverAsPrimary();
+  void NotifyPeersOfPrimary();
+  void Rejoin(const std::string& primary_ip);
+  // Primary: stop replicating to peer after a failure, and make it rejoin.
+  void DropPeer(Peer* peer);
+  void RunPeerPinger();
+  blobstore::ReplicationProgress GetReplicationProgress(Peer* peer);
+  // Backup: whether it may answer a hedged read needing writes up to min_seq.
+  bool ServesHedge(int64_t min_seq);
   absl::Status Recovery();
   int ReplayRecoveryRecords(blobstore::RecoveryResponse& recovery_response);
+  void ClearLogsForRecovery();
+  int ApplyRecoveryRecords(const google::protobuf::RepeatedPtrField<blobstore::RecoveryRecord>& records);
+  void CatchUpPeer(Peer* peer, int64_t round, std::vector<blobstore::LogEntry> fresh_logs,
+                   blobstore::Codec codec, bool send_fills);
+  // Called under replication_order_mutex_ with the block locks of slots held;
+  // the future tells whether the peer applied the request.
+  std::future<bool> QueueCatchUp(Peer* peer, const blobstore::CatchUpRequest* request, std::vector<int> slots);
+  blobstore::Codec EncodeRecoveryBlock(std::string data, blobstore::Codec codec, bool send_fills,
+                                       std::string* payload);
+  void AddTrimRecoveryRecords(const blobstore::LogEntry& log_entry, blobstore::Codec codec, bool send_fills,
+                              google::protobuf::RepeatedPtrField<blobstore::RecoveryRecord>* records);
   absl::Status GetLogEntries(std::vector<blobstore::LogEntry>& entries);
   std::string GetFilePath(std::string root, int64_t address);
-  int Prepare(int64_t address, const std::string& data);
-  int Commit(int64_t address);
+  std::string GetTmpFilePath(int64_t block);
+  absl::Status ReadBlock(int64_t block, std::string* data, bool repair = true);
+  bool ReadBlockFile(int64_t block, std::string* data, uint32_t* crc);
+  void ReadAhead(int64_t address, int64_t end);
+  absl::Status RepairBlock(int64_t block, uint32_t crc, std::string* data);
+  // The peers' copies of a block, for repairing it; unwritten if trimmed there.
+  struct RepairCopy {
+    std::string ip;
+    bool unwritten = false;
+    std::string data;
+  };
+  std::vector<RepairCopy> FetchRepairCopies(int64_t block);
+  absl::Status InstallRepairCopy(int64_t block, uint32_t crc, const std::vector<RepairCopy>& copies,
+                                 std::string* data);
+  // Repair a block that failed its checksum, taking its locks only once the
+  // peers' copies are in. NotFound if it reads as never written by then.
+  absl::Status RepairCorruptBlock(int64_t block);
+  bool DecodeBlockData(const blobstore::BlockData& block, std::string* data);
+  void InstallRepairedBlock(int64_t block, const std::string& data);
+  void RunScrubber();
+  void ScrubBlock(int64_t block);
+  void RunAntiEntropy();
+  void RunHeatmap();
+  void LogHeatmap();
+  // Count a client access to the block(s) at address.
+  void RecordAccess(int64_t address, bool write);
+  // Primary: read the BLOCK_SIZE bytes at address without the shard locks.
+  // False if it could not (a checksum failure, or commits kept racing).
+  bool ReadLockFree(int64_t address, std::string* data);
+  // Read under the shard locks; the access was recorded unless record_access.
+  // A checksum failure is left for Read to repair.
+  absl::Status ReadLocked(int64_t addr, std::string* data, bool hedge, bool record_access, int64_t min_seq = 0);
+  // A block as it is now, without counting or repairing a checksum failure.
+  absl::Status LoadBlock(int64_t block, std::string* data, uint32_t* crc);
+  // A block as a snapshot at commit sequence seq reads it.
+  absl::Status ReadBlockAt(int64_t block, int64_t seq, std::string* data);
+  // A commit is about to make new images of block1 and block2 (-1 if
+  // aligned), or of [block1, block2) for a trim, visible: number it and keep
+  // the images the live snapshots read. Called with snapshot_mutex_ shared,
+  // inside the commit's BlockWriteGuard.
+  void KeepSnapshotImages(int64_t block1, int64_t block2, bool trim);
+  // snapshot_mutex_ shared, once no snapshot is being created.
+  std::shared_lock<std::shared_timed_mutex> LockCommitsShared();
+  void StageBlock(int64_t block, const std::string& data, bool sync);
+  void WriteBlockFile(int64_t block, const std::string& data);
+  void InstallBlock(int64_t block, bool is_fill, char fill);
+  void UnmapBlock(int64_t block);
+  bool BlockMapped(int64_t block);
+  absl::Status TrimStripe(int64_t first_block, int64_t end_block);
+  // One write from prepare to commit.
+  absl::Status WriteOne(int64_t address, const std::string& data, blobstore::Durability durability);
+  absl::Status CoalesceWrite(int64_t address, const std::string& data, blobstore::Durability durability);
+  int CommitAsync(int64_t txId, int64_t block1, int64_t block2, bool sync);
+  int CommitJournaled(JournalRecord record, bool sync = false);
+  void ApplyJournalRecord(const JournalRecord& record);
+  void RunApplier();
+  void DrainApplier();
+  void ReplayJournals();
+  int GetShardIndex(int64_t block);
+  Shard& GetShard(int64_t block);
+  std::vector<int> GetShardIndexes(int64_t address);
+  int64_t RoutingAddress(int64_t addr);
+  int Prepare(int64_t txId, int64_t address, const std::string& data,
+              std::shared_ptr<ReplicationRound>& round, blobstore::Durability durability);
+  int Commit(int64_t txId, int64_t address, std::shared_ptr<ReplicationRound> round,
+             blobstore::Durability durability);
+  // trim_blocks: replicate a trim of that many blocks from address instead.
+  // sync: backups sync the write to disk.
+  std::shared_ptr<ReplicationRound> StartReplication(int64_t txId, int64_t address, const std::string& data,
+                                                     int64_t trim_blocks = 0, bool sync = false);
+  // Steps of a round's item in a peer's ReplicationQueue.
+  bool PrepareOnPeer(Peer* peer, std::shared_ptr<ReplicationRound> round, std::vector<int> slots);
+  void CommitOnPeer(Peer* peer, std::shared_ptr<ReplicationRound> round, bool prepared);
+  void WaitForQuorum(ReplicationRound& round, bool commit_phase);
+  void DecideRound(ReplicationRound& round, bool commit);
+  void ObserveTxId(int64_t txId);
   int64_t generate_txId();
   
   private:
-  BlobServerState state;
-  bool backupAlive;
+  std::atomic<BlobServerState> state{BACKUP};
   std::string root_path_;
-  std::string tmp_path_;
   std::string self_ip_;
-  std::string other_ip_;
-  std::unique_ptr<StoreInternalClient> store_internal_client_;
-  std::shared_ptr<Logger> logger_;
-  std::shared_timed_mutex mutex_;
-  std::array<std::mutex, NUM_MUTEXES> mutex_pool_;
-  std::shared_timed_mutex recovery_mutex_;
+  std::mutex primary_ip_mutex_;
+  std::string primary_ip_;
+  ServerOptions options_;
+  std::vector<std::unique_ptr<Peer>> peers_;
+  // Replication work is queued for all peers under this lock, so that every
+  // peer orders concurrent writes the same way.
+  std::mutex replication_order_mutex_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  // Serializes failure detection and promotion.
+  std::mutex failover_mutex_;
+  // Largest txid in the local logs; candidates with more history win elections.
+  std::atomic<int64_t> max_txid_seen_{0};
+  // Txids grow monotonically within a primary's epoch (the high 32 bits).
+  std::atomic<int64_t> next_txid_{0};
+  // Primary: replication rounds, numbered in the txid epoch so that the
+  // numbers keep growing across failovers.
+  std::atomic<int64_t> replication_seq_{0};
+  // Backup: rounds up to synced_seq_ are here, and hedged reads are fresh
+  // enough until fresh_until_us_ (steady clock).
+  std::atomic<int64_t> synced_seq_{0};
+  std::atomic<int64_t> fresh_until_us_{0};
+  // async_apply: images staged by PrepareLocal, the lookaside of committed
+  // images the applier has not written, and the applier's queue.
+  std::mutex staged_mutex_;
+  std::unordered_map<int64_t, std::string> staged_blocks_;
+  // Prepared fills, which have no tmp file.
+  std::unordered_map<int64_t, char> staged_fills_;
+  std::mutex lookaside_mutex_;
+  std::unordered_map<int64_t, LookasideEntry> lookaside_;
+  std::mutex apply_mutex_;
+  std::condition_variable apply_cv_;
+  std::deque<std::pair<int, JournalRecord>> apply_queue_;
+  bool stop_applier_ = false;
+  std::thread applier_;
+  std::mutex background_mutex_;
+  std::condition_variable background_cv_;
+  int background_tasks_ = 0;
+  std::unique_ptr<AllocationMap> allocation_map_;
+  MerkleTree merkle_tree_;
+  // Serializes anti-entropy passes.
+  std::mutex anti_entropy_mutex_;
+  // Stops the anti-entropy, scrubber, heatmap and peer ping threads.
+  std::mutex periodic_mutex_;
+  std::condition_variable periodic_cv_;
+  bool stop_periodic_ = false;
+  std::thread anti_entropy_thread_;
+  std::thread peer_pinger_thread_;
+  std::thread scrubber_thread_;
+  std::thread heatmap_thread_;
+  std::unique_ptr<AccessProfile> access_profile_;
+  std::unique_ptr<SnapshotStore> snapshots_;
+  // Held shared by commits while they make images visible, and exclusively
+  // to create a snapshot, which then falls between two commits.
+  std::shared_timed_mutex snapshot_mutex_;
+  std::mutex snapshot_gate_;
+  // Commits numbered in the order their images became visible.
+  std::atomic<int64_t> commit_seq_{0};
+  std::atomic<int64_t> checksum_failures_{0};
+  std::atomic<int64_t> blocks_repaired_{0};
+  std::array<std::atomic<int64_t>, blobstore::Durability_ARRAYSIZE> durability_writes_{};
+  std::atomic<int64_t> coalesced_writes_{0};
+  BlockVersions block_versions_;
+  // AllShardsLocks held or waited for; lock-free reads wait for none.
+  std::atomic<int> all_shards_holders_{0};
+  std::atomic<int64_t> lock_free_read_retries_{0};
+  std::atomic<int64_t> locked_reads_{0};
+  PayloadCounters replication_bytes_;
+  PayloadCounters recovery_bytes_;
+  std::mutex recovery_stats_mutex_;
+  RecoveryStats recovery_stats_;
+  // Backup: an online recovery is streaming blocks here.
+  std::atomic<bool> catching_up_{false};
+  // Backup: told to rejoin and not recovered since, so it may have missed
+  // writes; like one catching up, it must not take over.
+  std::atomic<bool> rejoining_{false};
+  // The primary a Rejoin is running against, if any.
+  std::mutex rejoin_mutex_;
+  std::string rejoin_ip_;
+  std::mutex catch_up_mutex_;
+  std::condition_variable catch_up_cv_;
+  std::chrono::steady_clock::time_point catch_up_start_;
 };
 
 #endif // BLOB_SERVER_H_
\ No newline at end of file
@@ -0,0 +1,431 @@
+#include "blob_service.h"
+#include "resources/utils.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using grpc::ServerContext;
+using blobstore::ReadRequest;
+using blobstore::ReadResponse;
+using blobstore::ReadRangeRequest;
+using blobstore::ReadRangeResponse;
+using blobstore::TrimRequest;
+using blobstore::TrimResponse;
+using blobstore::WriteRequest;
+using blobstore::WriteResponse;
+using blobstore::PingRequest;
+using blobstore::PingResponse;
+using blobstore::PrepareRequest;
+using blobstore::PrepareResponse;
+using blobstore::CommitRequest;
+using blobstore::CommitResponse;
+using blobstore::ReplicateMessage;
+using blobstore::ReplicateAck;
+using blobstore::RecoveryRequest;
+using blobstore::RecoveryResponse;
+using blobstore::RecoveryRecord;
+using blobstore::CatchUpRequest;
+using blobstore::CatchUpResponse;
+using blobstore::LogEntry;
+
+// #define performance_measure
+
+BlobStoreImpl::BlobStoreImpl(std::shared_ptr<BlobServer> blobserver)
+    : blobserver_(blobserver),
+      read_limiter_(blobserver->get_options().admission_limit, blobserver->get_options().admission_read_latency_us),
+      write_limiter_(blobserver->get_options().admission_limit, blobserver->get_options().admission_write_latency_us),
+      trim_limiter_(blobserver->get_options().admission_limit, blobserver->get_options().admission_write_latency_us),
+      range_limiter_(blobserver->get_options().admission_limit, 0),
+      snapshot_limiter_(blobserver->get_options().admission_limit, blobserver->get_options().admission_write_latency_us) {}
+
+// Over the admission limit: the client learns when to come back from the
+// trailing metadata, since a reply with an error status carries no message.
+grpc::Status BlobStoreImpl::rejectRequest(ServerContext* context, const AdmissionTicket& ticket) {
+  context->AddTrailingMetadata(RETRY_AFTER_METADATA_KEY, std::to_string(ticket.retry_after_ms()));
+  return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Server overloaded");
+}
+
+grpc::Status BlobStoreImpl::handleStatusCode(absl::Status status){
+  if (status != absl::OkStatus()) {
+      if(status.code() == absl::StatusCode::kNotFound) {
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, "Please contact other server");
+      } else if(status.code() == absl::StatusCode::kDataLoss) {
+        return grpc::Status(grpc::StatusCode::DATA_LOSS, "Block is corrupt");
+      } else if(status.code() == absl::StatusCode::kInvalidArgument) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, std::string(status.message()));
+      } else if(status.code() == absl::StatusCode::kFailedPrecondition) {
+        return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, std::string(status.message()));
+      } else if(status.code() == absl::StatusCode::kCancelled) {
+        return grpc::Status(grpc::StatusCode::CANCELLED, "Cancelled");
+      } else {
+          return grpc::Status(grpc::StatusCode::INTERNAL, "Internal error");
+      }
+  } else {
+    return grpc::Status::OK;
+  }
+}
+
+grpc::Status BlobStoreImpl::Read(ServerContext* context, const ReadRequest* request,
+                                 ReadResponse* response) {
+  #ifdef debug
+  std::cout << "[Read]: " << request->address() << std::endl;
+  #endif
+  AdmissionTicket ticket(read_limiter_);
+  if(!ticket.admitted())
+    return rejectRequest(context, ticket);
+  absl::Status status = request->snapshot() != 0
+                        ? blobserver_->ReadAt(request->snapshot(), request->address(), response->mutable_data())
+                        : blobserver_->Read(request->address(), response->mutable_data(), request->hedge(),
+                                            request->min_seq());
+  
+  // Redirect to Primary by sending primary address
+  if(status.code() == absl::StatusCode::kNotFound)
+    response->set_primary_ip(blobserver_->get_other_ip());
+  grpc::Status clientStatus = handleStatusCode(status);
+  return clientStatus;
+}
+
+grpc::Status BlobStoreImpl::Write(ServerContext* context, const WriteRequest* request,
+             WriteResponse* response) {
+  #ifdef debug
+  std::cout << "[Write]: " << request->address() << std::endl;
+  #endif
+  AdmissionTicket ticket(write_limiter_);
+  if(!ticket.admitted())
+    return rejectRequest(context, ticket);
+  // return StoreInternal::Write(request, response);
+  absl::Status status = blobserver_->Write(request->address(), request->data(), request->durability());
+  // Hedged reads after this write must see it
+  response->set_replication_seq(blobserver_->get_replication_seq());
+  
+  // Redirect to Primary by sending primary address
+  if(status.code() == absl::StatusCode::kNotFound)
+    response->set_primary_ip(blobserver_->get_other_ip());
+
+  grpc::Status clientStatus = handleStatusCode(status);
+  return clientStatus;
+}
+
+grpc::Status BlobStoreImpl::Trim(ServerContext* context, const TrimRequest* request,
+                                 TrimResponse* response) {
+  #ifdef debug
+  std::cout << "[Trim]: " << request->address() << " +" << request->length() << std::endl;
+  #endif
+  AdmissionTicket ticket(trim_limiter_);
+  if(!ticket.admitted())
+    return rejectRequest(context, ticket);
+  absl::Status status = blobserver_->Trim(request->address(), request->length());
+  response->set_replication_seq(blobserver_->get_replication_seq());
+
+  // Redirect to Primary by sending primary address
+  if(status.code() == absl::StatusCode::kNotFound)
+    response->set_primary_ip(blobserver_->get_other_ip());
+  return handleStatusCode(status);
+}
+
+grpc::Status BlobStoreImpl::CreateSnapshot(ServerContext* context, const blobstore::CreateSnapshotRequest* request,
+                                           blobstore::CreateSnapshotResponse* response) {
+  // Taking a snapshot holds off every commit for a moment: under load it is
+  // paced like a write.
+  AdmissionTicket ticket(snapshot_limiter_);
+  if(!ticket.admitted())
+    return rejectRequest(context, ticket);
+  int64_t snapshot = 0;
+  absl::Status status = blobserver_->CreateSnapshot(&snapshot);
+  if(status.code() == absl::StatusCode::kNotFound)
+    response->set_primary_ip(blobserver_->get_other_ip());
+  response->set_snapshot(snapshot);
+  return handleStatusCode(status);
+}
+
+grpc::Status BlobStoreImpl::ReleaseSnapshot(ServerContext* context, const blobstore::ReleaseSnapshotRequest* request,
+                                            blobstore::ReleaseSnapshotResponse* response) {
+  AdmissionTicket ticket(snapshot_limiter_);
+  if(!ticket.admitted())
+    return rejectRequest(context, ticket);
+  return handleStatusCode(blobserver_->ReleaseSnapshot(request->snapshot()));
+}
+
+// Chunks go out as they are read. Write blocks while the client's flow
+// control window is full, so the scan never runs more than a chunk (plus
+// readahead) ahead of the reader.
+grpc::Status BlobStoreImpl::ReadRange(ServerContext* context, const ReadRangeRequest* request,
+                                      grpc::ServerWriter<ReadRangeResponse>* writer) {
+  #ifdef debug
+  std::cout << "[ReadRange]: " << request->address() << " +" << request->length() << std::endl;
+  #endif
+  // A stream lasts as long as its range, so its duration says nothing
+  // about load: only the count of open streams is bounded.
+  AdmissionTicket ticket(range_limiter_, false);
+  if(!ticket.admitted())
+    return rejectRequest(context, ticket);
+  absl::Status status = blobserver_->ReadRange(request->address(), request->length(), request->chunk_size(),
+                                               [context, writer](int64_t address, std::string& chunk) {
+    if(context->IsCancelled()) {
+      return false;
+    }
+    ReadRangeResponse response;
+    response.set_address(address);
+    response.set_data(std::move(chunk));
+    return writer->Write(response);
+  }, request->snapshot());
+
+  // Redirect to Primary: the stream ends with NOT_FOUND, so the address
+  // goes out in a message of its own.
+  if(status.code() == absl::StatusCode::kNotFound) {
+    ReadRangeResponse response;
+    response.set_status("FAILURE");
+    response.set_primary_ip(blobserver_->get_other_ip());
+    writer->Write(response);
+  }
+  return handleStatusCode(status);
+}
+
+grpc::Status StoreInternalImpl::Ping(ServerContext* context, const PingRequest* request,
+            PingResponse* response) {
+  blobserver_->HandlePing(*request, response);
+  return grpc::Status::OK;
+}
+
+grpc::Status StoreInternalImpl::Prepare(ServerContext* context, const PrepareRequest* request,
+               PrepareResponse* response) {
+  return applyPrepare(*request);
+}
+
+grpc::Status StoreInternalImpl::Commit(ServerContext* context, const CommitRequest* request,
+              CommitResponse* response) {
+  return applyCommit(*request);
+}
+
+// The backup applies the messages one at a time in stream order, which
+// keeps the order the primary's replication queue sends them in. Acks go out
+// from a thread of their own, so that each covers every message applied
+// while the one before it was being written.
+grpc::Status StoreInternalImpl::Replicate(ServerContext* context,
+                 grpc::ServerReaderWriter<ReplicateAck, ReplicateMessage>* stream) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int64_t applied = 0;
+  std::vector<int64_t> failed;
+  bool done = false;
+  std::thread acker([&]() {
+    int64_t acked = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+      cv.wait(lock, [&]() { return applied > acked || done; });
+      if(applied == acked) {
+        return;
+      }
+      ReplicateAck ack;
+      ack.set_seq(applied);
+      for(int64_t seq : failed) {
+        ack.add_failed_seq(seq);
+      }
+      failed.clear();
+      acked = applied;
+      lock.unlock();
+      bool sent = stream->Write(ack);
+      lock.lock();
+      if(!sent) {
+        return;
+      }
+    }
+  });
+
+  ReplicateMessage message;
+  while(stream->Read(&message)) {
+    grpc::Status status;
+    if(message.has_prepare()) {
+      status = applyPrepare(message.prepare());
+    } else if(message.has_commit()) {
+      status = applyCommit(message.commit());
+    } else {
+      status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Empty replication message");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    applied = message.seq();
+    if(!status.ok()) {
+      failed.push_back(message.seq());
+    }
+    cv.notify_one();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    cv.notify_one();
+  }
+  acker.join();
+  return grpc::Status::OK;
+}
+
+grpc::Status StoreInternalImpl::applyPrepare(const PrepareRequest& request) {
+  #ifdef debug
+  std::cout << "Prepare for Backup" << std::endl;
+  #endif
+  #ifdef performance_measure
+  auto lock_acquire_start = std::chrono::high_resolution_clock::now();
+  #endif
+
+  // Acquire lock for commit to isolate request processing from recovery
+  std::shared_lock<std::shared_timed_mutex> lock(blobserver_->getMutex(request.address()));
+  #ifdef performance_measure
+  auto lock_acquire_end = std::chrono::high_resolution_clock::now();
+  std::cout << "[Perf][LockAcquire]: " << std::chrono::duration_cast<std::chrono::microseconds>(lock_acquire_end - lock_acquire_start).count() << " us" << std::endl;
+  #endif
+  const std::string* data = &request.data();
+  std::string decompressed;
+  if(request.codec() != blobstore::CODEC_NONE) {
+    if(!DecompressPayload(request.codec(), request.data(), &decompressed)) {
+      return grpc::Status(grpc::StatusCode::DATA_LOSS, "Corrupt prepare payload");
+    }
+    data = &decompressed;
+  }
+  int status = blobserver_->PrepareLocal(request.address(), *data, request.sync());
+
+  if (status != 0) {
+    return grpc::Status(grpc::StatusCode::INTERNAL, "Prepare failed");
+  } else {
+    return grpc::Status::OK;
+  }
+}
+
+grpc::Status StoreInternalImpl::applyCommit(const CommitRequest& request) {
+  #ifdef debug
+  std::cout << "Commit for Backup" << std::endl;
+  #endif
+
+  #ifdef performance_measure
+  auto lock_acquire_start = std::chrono::high_resolution_clock::now();
+  #endif
+
+  // Acquire lock for commit to isolate request processing from recovery
+  std::shared_lock<std::shared_timed_mutex> lock(blobserver_->getMutex(request.address()));
+  #ifdef performance_measure
+  auto lock_acquire_end = std::chrono::high_resolution_clock::now();
+  std::cout << "[Perf][LockAcquire]: " << std::chrono::duration_cast<std::chrono::microseconds>(lock_acquire_end - lock_acquire_start).count() << " us" << std::endl;
+  #endif
+  int status;
+  if(request.trim_blocks() > 0) {
+    int64_t first_block = request.address() / BLOCK_SIZE;
+    status = blobserver_->TrimLocal(request.txid(), first_block, first_block + request.trim_blocks());
+  } else {
+    status = blobserver_->CommitLocal(request.txid(), request.address(), request.sync());
+  }
+
+  if (status != 0) {
+    return grpc::Status(grpc::StatusCode::INTERNAL, "Commit failed");
+  } else {
+    if(request.has_progress())
+      blobserver_->UpdateReplicationProgress(request.progress());
+    return grpc::Status::OK;
+  }
+}
+
+grpc::Status StoreInternalImpl::Recovery(ServerContext* context, const RecoveryRequest* request,
+                RecoveryResponse* response) {
+  // Pause writing/reading new data (Ensure no inflight requests)
+  std::cout << "Acquire lock to pause all read/write requests and start recovery process" << std::endl;
+  auto pause_start = std::chrono::high_resolution_clock::now();
+  auto recovery_locks = blobserver_->LockAllShards();
+
+  int num_shards = std::max(1, request->num_shards());
+  if(num_shards != blobserver_->get_num_shards()) {
+    std::cout << "[Recovery]: (Primary) Shard count mismatch: backup " << num_shards << ", primary " << blobserver_->get_num_shards() << std::endl;
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Shard count mismatch");
+  }
+
+  auto log_ship_start = std::chrono::high_resolution_clock::now();
+
+  // Set state to Primary if not already
+  blobserver_->BecomePrimary();
+
+  std::cout << "[Recovery]: (Primary) Received recovery request" << std::endl;
+  std::vector<LogEntry> backup_logs(request->entry().begin(), request->entry().end());
+  for(const std::string& range : request->log_records()) {
+    LogReader reader(range.data(), range.size());
+    Logger::read_entries(reader, backup_logs);
+  }
+  // merge with logger, update local log
+  std::cout << "[Recovery]: (Primary) Start merging log" << std::endl;
+  std::vector<LogEntry> fresh_logs = blobserver_->MergeAndRefreshLogsLocal(backup_logs, request->ip()); //Removing earlier log, considering one server is up untill recovery
+
+  auto merge_and_refresh_logs_end = std::chrono::high_resolution_clock::now();
+  auto create_recovery_records_start = std::chrono::high_resolution_clock::now();
+
+  bool send_fills = std::find(request->accept_codecs().begin(), request->accept_codecs().end(),
+                              blobstore::CODEC_FILL) != request->accept_codecs().end();
+  blobstore::Codec codec = blobserver_->NegotiateCodec(*request);
+  size_t num_records = 0;
+  if(request->online()) {
+    // Step 3 happens after the pause: the records follow in CatchUp requests.
+    std::cout << "[Recovery]: (Primary) Catching up " << request->ip() << " online: " << fresh_logs.size() << " log records" << std::endl;
+    blobserver_->StartCatchUp(request->ip(), std::move(fresh_logs), codec, send_fills);
+    response->set_online(true);
+  } else {
+    // Step 3: Create response structure to send to backup and send logs
+    //Create response with files - data from fresh_logs
+    std::cout << "[Recovery]: (Primary) Create Response Records" << std::endl;
+    const PayloadCounters& recovery_bytes = blobserver_->get_recovery_bytes();
+    int64_t raw_bytes = recovery_bytes.raw_bytes, sent_bytes = recovery_bytes.sent_bytes;
+    std::unordered_set<int64_t> sent_blocks;
+    // The response belongs to gRPC; the records are built in it directly.
+    blobserver_->CreateRecoveryResponse(fresh_logs.cbegin(), fresh_logs.cend(), sent_blocks,
+                                        response->mutable_records(), codec, send_fills);
+    std::cout << "[Recovery]: (Primary) Block data: " << recovery_bytes.raw_bytes - raw_bytes << " bytes, "
+              << recovery_bytes.sent_bytes - sent_bytes << " bytes sent" << std::endl;
+    num_records = response->records_size();
+
+    #ifdef debug
+    std::cout << "[Recovery]: (Primary) Send Recovery Response: " << num_records << " log records." << std::endl;
+    #endif
+    // Set other server state(backup) to be alive
+    blobserver_->setBackupAlive(request->ip(), true);
+  }
+
+  auto create_recovery_records_end = std::chrono::high_resolution_clock::now();
+  blobserver_->RecordRecoveryServed(
+      std::chrono::duration_cast<std::chrono::microseconds>(merge_and_refresh_logs_end - log_ship_start).count(),
+      std::chrono::duration_cast<std::chrono::microseconds>(create_recovery_records_end - create_recovery_records_start).count(),
+      num_records,
+      std::chrono::duration_cast<std::chrono::microseconds>(create_recovery_records_end - pause_start).count());
+
+  #ifdef performance_measure
+  std::cout << "[Perf][MergeRefreshLogs]: " << std::chrono::duration_cast<std::chrono::milliseconds>(merge_and_refresh_logs_end - log_ship_start).count() << " ms" << std::endl;
+  std::cout << "[Perf][CreateRecoveryRecords]: " << std::chrono::duration_cast<std::chrono::milliseconds>(create_recovery_records_end - create_recovery_records_start).count() << " ms" << std::endl;
+  #endif
+
+  std::cout << "Releasing the recovery lock to allow normal request processing" << std::endl;
+  return grpc::Status::OK;
+}
+
+grpc::Status StoreInternalImpl::CatchUp(ServerContext* context, const CatchUpRequest* request,
+                CatchUpResponse* response) {
+  if(blobserver_->HandleCatchUp(*request) != 0) {
+    return grpc::Status(grpc::StatusCode::INTERNAL, "CatchUp failed");
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status StoreInternalImpl::GetMerkleNodes(ServerContext* context, const blobstore::MerkleNodesRequest* request,
+                blobstore::MerkleNodesResponse* response) {
+  blobserver_->GetMerkleNodes(*request, response);
+  return grpc::Status::OK;
+}
+
+grpc::Status StoreInternalImpl::ReadBlocks(ServerContext* context, const blobstore::ReadBlocksRequest* request,
+                blobstore::ReadBlocksResponse* response) {
+  blobserver_->ReadBlocks(*request, response);
+  return grpc::Status::OK;
+}
+
+grpc::Status StoreInternalImpl::GetHeatmap(ServerContext* context, const blobstore::HeatmapRequest* request,
+                blobstore::HeatmapResponse* response) {
+  blobserver_->GetHeatmap(*request, response);
+  return grpc::Status::OK;
+}
@@ -0,0 +1,78 @@
+#ifndef BLOB_SERVICE_H_
+#define BLOB_SERVICE_H_
+#include <memory>
+#include <string>
+#include "absl/status/status.h"
+#include <grpcpp/grpcpp.h>
+#include "admission.h"
+#include "blob_server.h"
+
+#ifdef BAZEL_BUILD
+#else
+#include "protos/blobstore.grpc.pb.h"
+#endif
+
+// gRPC front-ends of a BlobServer: BlobStore serves clients, StoreInternal
+// serves the other replica. Shared by the server binary and the in-process
+// cluster harness.
+
+class BlobStoreImpl final : public blobstore::BlobStore::Service {
+  private:
+  std::shared_ptr<BlobServer>  blobserver_;
+  AdmissionLimiter read_limiter_;
+  AdmissionLimiter write_limiter_;
+  AdmissionLimiter trim_limiter_;
+  AdmissionLimiter range_limiter_;
+  AdmissionLimiter snapshot_limiter_;
+  grpc::Status handleStatusCode(absl::Status status);
+  grpc::Status rejectRequest(grpc::ServerContext* context, const AdmissionTicket& ticket);
+  public:
+  BlobStoreImpl(std::shared_ptr<BlobServer> blobserver);
+  // Requests turned away by admission control.
+  int64_t get_rejected() {
+    return read_limiter_.get_rejected() + write_limiter_.get_rejected() + trim_limiter_.get_rejected() +
+           range_limiter_.get_rejected() + snapshot_limiter_.get_rejected();
+  }
+  grpc::Status Read(grpc::ServerContext* context, const blobstore::ReadRequest* request,
+              blobstore::ReadResponse* response) override;
+  grpc::Status Write(grpc::ServerContext* context, const blobstore::WriteRequest* request,
+               blobstore::WriteResponse* response) override;
+  grpc::Status ReadRange(grpc::ServerContext* context, const blobstore::ReadRangeRequest* request,
+                   grpc::ServerWriter<blobstore::ReadRangeResponse>* writer) override;
+  grpc::Status Trim(grpc::ServerContext* context, const blobstore::TrimRequest* request,
+              blobstore::TrimResponse* response) override;
+  grpc::Status CreateSnapshot(grpc::ServerContext* context, const blobstore::CreateSnapshotRequest* request,
+                        blobstore::CreateSnapshotResponse* response) override;
+  grpc::Status ReleaseSnapshot(grpc::ServerContext* context, const blobstore::ReleaseSnapshotRequest* request,
+                         blobstore::ReleaseSnapshotResponse* response) override;
+};
+
+class StoreInternalImpl final : public blobstore::StoreInternal::Service {
+  private:
+  std::shared_ptr<BlobServer>  blobserver_;
+  // Prepare and Commit, as unary calls or messages of a Replicate stream.
+  grpc::Status applyPrepare(const blobstore::PrepareRequest& request);
+  grpc::Status applyCommit(const blobstore::CommitRequest& request);
+  public:
+  StoreInternalImpl(std::shared_ptr<BlobServer> blobserver) : blobserver_(blobserver) {}
+  grpc::Status Ping(grpc::ServerContext* context, const blobstore::PingRequest* request,
+              blobstore::PingResponse* response) override;
+  grpc::Status Prepare(grpc::ServerContext* context, const blobstore::PrepareRequest* request,
+                 blobstore::PrepareResponse* response) override;
+  grpc::Status Commit(grpc::ServerContext* context, const blobstore::CommitRequest* request,
+                blobstore::CommitResponse* response) override;
+  grpc::Status Replicate(grpc::ServerContext* context,
+                   grpc::ServerReaderWriter<blobstore::ReplicateAck, blobstore::ReplicateMessage>* stream) override;
+  grpc::Status Recovery(grpc::ServerContext* context, const blobstore::RecoveryRequest* request,
+                  blobstore::RecoveryResponse* response) override;
+  grpc::Status CatchUp(grpc::ServerContext* context, const blobstore::CatchUpRequest* request,
+                 blobstore::CatchUpResponse* response) override;
+  grpc::Status GetMerkleNodes(grpc::ServerContext* context, const blobstore::MerkleNodesRequest* request,
+                        blobstore::MerkleNodesResponse* response) override;
+  grpc::Status ReadBlocks(grpc::ServerContext* context, const blobstore::ReadBlocksRequest* request,
+                    blobstore::ReadBlocksResponse* response) override;
+  grpc::Status GetHeatmap(grpc::ServerContext* context, const blobstore::HeatmapRequest* request,
+                    blobstore::HeatmapResponse* response) override;
+};
+
+#endif // BLOB_SERVICE_H_
@@ -0,0 +1,52 @@
+#include "compression.h"
+
+#include <zlib.h>
+
+bool CompressPayload(blobstore::Codec codec, const std::string& data, size_t min_bytes, std::string* out) {
+  if(codec != blobstore::CODEC_DEFLATE || data.size() < min_bytes) {
+    return false;
+  }
+  uLongf size = compressBound(data.size());
+  std::string compressed(size, '\0');
+  int rc = compress2((Bytef*)&compressed[0], &size, (const Bytef*)data.data(), data.size(), Z_BEST_SPEED);
+  if(rc != Z_OK || size >= data.size()) {
+    return false;
+  }
+  compressed.resize(size);
+  *out = std::move(compressed);
+  return true;
+}
+
+bool DecompressPayload(blobstore::Codec codec, const std::string& payload, std::string* out) {
+  if(codec == blobstore::CODEC_NONE) {
+    *out = payload;
+    return true;
+  }
+  if(codec != blobstore::CODEC_DEFLATE) {
+    return false;
+  }
+  z_stream stream = {};
+  if(inflateInit(&stream) != Z_OK) {
+    return false;
+  }
+  stream.next_in = (Bytef*)payload.data();
+  stream.avail_in = payload.size();
+  std::string data;
+  char chunk[16384];
+  int rc;
+  do {
+    stream.next_out = (Bytef*)chunk;
+    stream.avail_out = sizeof(chunk);
+    rc = inflate(&stream, Z_NO_FLUSH);
+    if(rc != Z_OK && rc != Z_STREAM_END) {
+      break;
+    }
+    data.append(chunk, sizeof(chunk) - stream.avail_out);
+  } while(rc != Z_STREAM_END);
+  inflateEnd(&stream);
+  if(rc != Z_STREAM_END) {
+    return false;
+  }
+  *out = std::move(data);
+  return true;
+}
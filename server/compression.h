@@ -0,0 +1,32 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "protos/blobstore.grpc.pb.h"
+
+// Block payload compression for Prepare requests and recovery records.
+
+// Encodes data with codec into out. Returns false, leaving out untouched, if
+// the codec is CODEC_NONE, data is shorter than min_bytes or would not shrink;
+// the payload is then sent as is.
+bool CompressPayload(blobstore::Codec codec, const std::string& data, size_t min_bytes, std::string* out);
+
+// Decodes a payload sent with codec into out. Returns false on corrupt input
+// or an unknown codec.
+bool DecompressPayload(blobstore::Codec codec, const std::string& payload, std::string* out);
+
+// Payload bytes before encoding and as sent.
+struct PayloadCounters {
+  std::atomic<int64_t> raw_bytes{0};
+  std::atomic<int64_t> sent_bytes{0};
+
+  void Add(size_t raw, size_t sent) {
+    raw_bytes += raw;
+    sent_bytes += sent;
+  }
+};
+
+#endif // COMPRESSION_H
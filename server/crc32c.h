@@ -0,0 +1,70 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C (Castagnoli), as used by iSCSI/ext4. Uses the SSE4.2 crc32
+// instruction when the CPU has it, and a table-driven version otherwise.
+inline const std::array<uint32_t, 256>& Crc32cTable() {
+  static const std::array<uint32_t, 256> table = []() {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; k++) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+      }
+      t[i] = crc;
+    }
+    return t;
+  }();
+  return table;
+}
+
+inline uint32_t Crc32cPortable(const void* data, size_t size, uint32_t crc = 0) {
+  const std::array<uint32_t, 256>& table = Crc32cTable();
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+// Eight bytes per instruction; compiled for SSE4.2 regardless of -march and
+// only called once the CPU is known to support it.
+__attribute__((target("sse4.2")))
+inline uint32_t Crc32cSse42(const void* data, size_t size, uint32_t crc = 0) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  uint64_t crc64 = ~crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  uint32_t crc32 = (uint32_t)crc64;
+  for (; size > 0; size--, p++) {
+    crc32 = _mm_crc32_u8(crc32, *p);
+  }
+  return ~crc32;
+}
+#endif
+
+inline uint32_t Crc32c(const void* data, size_t size, uint32_t crc = 0) {
+#if defined(__x86_64__)
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  if (has_sse42) {
+    return Crc32cSse42(data, size, crc);
+  }
+#endif
+  return Crc32cPortable(data, size, crc);
+}
+
+#endif
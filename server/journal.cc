@@ -0,0 +1,107 @@
+#include "journal.h"
+#include "crc32c.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+Journal::Journal(std::string journal_file_path) : journal_file_path_(journal_file_path), size_(0) {
+    ofs.open(journal_file_path_, std::ios::app | std::ios::binary);
+    if(!ofs.is_open()){
+        std::cout << "Journal::Journal() - Failed to open journal file: " << journal_file_path << std::endl;
+        exit(1);
+    }
+    sync_fd_ = ::open(journal_file_path_.c_str(), O_RDONLY);
+}
+
+Journal::~Journal() {
+    if(sync_fd_ >= 0){
+        ::close(sync_fd_);
+    }
+}
+
+void Journal::clear() {
+    if(ofs.is_open()){
+        ofs.close();
+    }
+    ofs.open(journal_file_path_, std::ios::trunc | std::ios::binary);
+    ofs.close();
+    ofs.open(journal_file_path_, std::ios::app | std::ios::binary);
+    size_ = 0;
+}
+
+int Journal::append(const JournalRecord& record, bool sync){
+    int64_t header[5] = {record.txid, record.block1, record.block2,
+                         record.trim ? -1 : (int64_t)record.data1.size(), (int64_t)record.data2.size()};
+    uint32_t frame[2];
+    frame[0] = sizeof(header) + record.data1.size() + record.data2.size();
+    frame[1] = Crc32c(record.data2.data(), record.data2.size(),
+                      Crc32c(record.data1.data(), record.data1.size(), Crc32c(header, sizeof(header))));
+    ofs.write((char*)frame, sizeof(frame));
+    ofs.write((char*)header, sizeof(header));
+    ofs.write(record.data1.data(), record.data1.size());
+    ofs.write(record.data2.data(), record.data2.size());
+    ofs.flush();
+    if(ofs.fail()){
+        std::cout << "Journal::append() - Failed to write to journal file: " << journal_file_path_ << std::endl;
+        return -1;
+    }
+    if(sync && ::fdatasync(sync_fd_) != 0){
+        std::cout << "Journal::append() - Failed to sync journal file: " << journal_file_path_ << std::endl;
+        return -1;
+    }
+    size_ += sizeof(frame) + frame[0];
+    return 0;
+}
+
+std::vector<JournalRecord> Journal::read_records(){
+    std::vector<JournalRecord> records;
+    std::ifstream ifs(journal_file_path_, std::ios::binary);
+    if(!ifs.is_open()){
+        std::cout << "Journal::read_records() - Failed to open journal file: " << journal_file_path_ << std::endl;
+        exit(1);
+    }
+
+    // A record cut short by a crash was never acknowledged; replay stops
+    // there, and at anything else that is not a whole record.
+    int64_t header[5];
+    const uint32_t max_length = sizeof(header) + 2 * JOURNAL_MAX_DATA_BYTES;
+    std::string payload;
+    while(true){
+        uint32_t frame[2];
+        if(!ifs.read((char*)frame, sizeof(frame))){
+            break;
+        }
+        if(frame[0] < sizeof(header) || frame[0] > max_length){
+            std::cout << "Journal::read_records() - Bad record length " << frame[0] << " in " << journal_file_path_
+                      << ", dropping the rest" << std::endl;
+            break;
+        }
+        payload.resize(frame[0]);
+        if(!ifs.read(&payload[0], frame[0])){
+            break;
+        }
+        if(Crc32c(payload.data(), payload.size()) != frame[1]){
+            std::cout << "Journal::read_records() - Corrupt record in " << journal_file_path_
+                      << ", dropping the rest" << std::endl;
+            break;
+        }
+        memcpy(header, payload.data(), sizeof(header));
+        JournalRecord record;
+        record.txid = header[0];
+        record.block1 = header[1];
+        record.block2 = header[2];
+        record.trim = header[3] == -1;
+        int64_t length1 = record.trim ? 0 : header[3];
+        if(length1 < 0 || length1 > JOURNAL_MAX_DATA_BYTES || header[4] < 0 || header[4] > JOURNAL_MAX_DATA_BYTES ||
+           sizeof(header) + length1 + header[4] != frame[0]){
+            std::cout << "Journal::read_records() - Bad record in " << journal_file_path_
+                      << ", dropping the rest" << std::endl;
+            break;
+        }
+        record.data1.assign(payload, sizeof(header), length1);
+        record.data2.assign(payload, sizeof(header) + length1, header[4]);
+        records.push_back(std::move(record));
+    }
+    return records;
+}
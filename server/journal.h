@@ -0,0 +1,55 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// Journal record format (integers little endian), framed like the log's:
+//   uint32 payload length | uint32 crc32c(payload) | payload
+//   payload: int64 txid | int64 block1 | int64 block2 | int64 length of data1
+//            | int64 length of data2 | data1 | data2
+// A trim has length -1 for data1, and no data. Each data is at most a block.
+#define JOURNAL_MAX_DATA_BYTES 4096
+
+// A committed write whose block images are not in the block files yet, or a
+// trim of blocks [block1, block2), which has no data.
+struct JournalRecord {
+  int64_t txid;
+  int64_t block1;
+  int64_t block2;  // -1 for an aligned write
+  std::string data1;
+  std::string data2;
+  bool trim = false;
+};
+
+// Append-only file of JournalRecords, used when block files are written by a
+// background applier (ServerOptions::async_apply). Records that made it to
+// the file are re-applied on restart.
+class Journal {
+private:
+  std::string journal_file_path_;
+  std::ofstream ofs;
+  int64_t size_;
+  // for fdatasync; the journal file keeps its inode when it is cleared
+  int sync_fd_;
+
+public:
+  Journal(std::string journal_file_path);
+  ~Journal();
+
+  // clear journal file
+  void clear();
+
+  // append a record to the journal file; with sync, wait until it is on disk
+  int append(const JournalRecord& record, bool sync = false);
+
+  // read the records in the journal file up to the first torn or corrupt one
+  std::vector<JournalRecord> read_records();
+
+  // bytes appended since the journal was last cleared
+  int64_t size() { return size_; }
+};
+
+#endif
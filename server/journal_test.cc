@@ -0,0 +1,123 @@
+// Checks that a journal replays the records that made it to disk, and stops
+// at whatever a crash or a bad disk left after them: a torn record, a zeroed
+// tail, a garbage length or a corrupt payload.
+#include "journal.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+string log_prefix_ = "[JournalTest]:";
+string test_dir;
+int failures = 0;
+
+void check(bool ok, const string& test, const string& what) {
+  if (!ok) {
+    fprintf(stderr, "%s %s: %s\n", log_prefix_.c_str(), test.c_str(), what.c_str());
+    failures++;
+  }
+}
+
+void write_raw(const string& path, const string& data) {
+  ofstream ofs(path, ios::binary | ios::trunc);
+  ofs.write(data.data(), data.size());
+}
+
+string read_raw(const string& path) {
+  ifstream ifs(path, ios::binary);
+  return string(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+}
+
+// A journal holding an aligned write, an unaligned write and a trim; returns
+// its contents.
+string three_records(const string& path) {
+  Journal journal(path);
+  journal.clear();
+  JournalRecord write1 = {1, 10, -1, string(4096, 'a'), ""};
+  JournalRecord write2 = {2, 20, 21, string(4096, 'b'), string(4096, 'c')};
+  JournalRecord trim = {3, 30, 40, "", "", true};
+  check(journal.append(write1) == 0 && journal.append(write2) == 0 && journal.append(trim, true) == 0, path,
+        "append failed");
+  return read_raw(path);
+}
+
+// The journal replays the first n of three_records.
+void check_records(const string& test, const string& path, size_t n) {
+  Journal journal(path);
+  vector<JournalRecord> records = journal.read_records();
+  check(records.size() == n, test, "expected " + to_string(n) + " records, read " + to_string(records.size()));
+  if (records.size() > 0) {
+    check(records[0].txid == 1 && records[0].block1 == 10 && records[0].block2 == -1 && !records[0].trim &&
+          records[0].data1 == string(4096, 'a') && records[0].data2.empty(), test, "wrong aligned write");
+  }
+  if (records.size() > 1) {
+    check(records[1].txid == 2 && records[1].block1 == 20 && records[1].block2 == 21 &&
+          records[1].data1 == string(4096, 'b') && records[1].data2 == string(4096, 'c'), test,
+          "wrong unaligned write");
+  }
+  if (records.size() > 2) {
+    check(records[2].txid == 3 && records[2].trim && records[2].block1 == 30 && records[2].block2 == 40 &&
+          records[2].data1.empty(), test, "wrong trim");
+  }
+}
+
+void test_round_trip() {
+  string path = test_dir + "/round_trip";
+  string data = three_records(path);
+  check_records("round trip", path, 3);
+  Journal journal(path);
+  check(journal.size() == 0, "round trip", "size counts records appended before it was opened");
+  journal.clear();
+  check(journal.read_records().empty(), "round trip", "records left after clear");
+}
+
+void test_torn_record() {
+  string path = test_dir + "/torn";
+  string data = three_records(path);
+  // Cut into the second record.
+  write_raw(path, data.substr(0, data.size() - 100));
+  check_records("torn record", path, 1);
+}
+
+void test_zero_tail() {
+  string path = test_dir + "/zero_tail";
+  string data = three_records(path);
+  write_raw(path, data + string(8192, '\0'));
+  check_records("zero tail", path, 3);
+}
+
+void test_garbage_length() {
+  string path = test_dir + "/garbage_length";
+  string data = three_records(path);
+  write_raw(path, data + string(64, '\xff'));
+  check_records("garbage length", path, 3);
+}
+
+void test_corrupt_payload() {
+  string path = test_dir + "/corrupt";
+  string data = three_records(path);
+  // A byte of the second record's data.
+  size_t second = 8 + 40 + 4096;
+  data[second + 8 + 40 + 100] ^= 1;
+  write_raw(path, data);
+  check_records("corrupt payload", path, 1);
+}
+
+int main(int argc, char* argv[]) {
+  test_dir = filesystem::temp_directory_path().string() + "/journal_test_" + to_string(getpid());
+  filesystem::create_directories(test_dir);
+
+  test_round_trip();
+  test_torn_record();
+  test_zero_tail();
+  test_garbage_length();
+  test_corrupt_payload();
+
+  filesystem::remove_all(test_dir);
+  fprintf(stderr, "%s %s\n", log_prefix_.c_str(), failures == 0 ? "All tests passed." : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
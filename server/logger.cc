@@ -1,14 +1,190 @@
 #include "logger.h"
+#include "crc32c.h"
+#include <cstring>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+LogReader::LogReader(const std::string& log_file_path) {
+    int fd = ::open(log_file_path.c_str(), O_RDONLY);
+    if(fd < 0){
+        return;
+    }
+    struct stat st;
+    if(::fstat(fd, &st) == 0 && st.st_size > 0){
+        map_ = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map_ == MAP_FAILED){
+            std::cout << "LogReader::LogReader() - Failed to map log file: " << log_file_path << std::endl;
+            map_ = nullptr;
+        } else {
+            map_size_ = st.st_size;
+            data_ = static_cast<const char*>(map_);
+            size_ = st.st_size;
+        }
+    }
+    ::close(fd);
+    if(size_ == 0){
+        return;
+    }
+
+    LogFileHeader header;
+    if(size_ >= sizeof(header)){
+        std::memcpy(&header, data_, sizeof(header));
+    }
+    if(size_ < sizeof(header) || std::memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0){
+        // Version 1 logs are bare records, the last one possibly torn; anything
+        // shorter than a record is a torn header.
+        legacy_ = size_ >= sizeof(LogRecord);
+        torn_ = size_ % sizeof(LogRecord) != 0;
+        pos_ = size_ = 0;
+        return;
+    }
+    if(header.version != LOG_VERSION || header.header_size < sizeof(header) || header.header_size > size_){
+        std::cout << "LogReader::LogReader() - Unsupported log version " << header.version << ": " << log_file_path << std::endl;
+        exit(1);
+    }
+    pos_ = header.header_size;
+}
+
+LogReader::LogReader(const char* data, size_t size) : data_(data), size_(size) {}
+
+LogReader::~LogReader() {
+    if(map_ != nullptr){
+        ::munmap(map_, map_size_);
+    }
+}
+
+bool LogReader::Next(LogRecord* record) {
+    LogRecordHeader header;
+    if(pos_ + sizeof(header) > size_){
+        torn_ = torn_ || pos_ != size_;
+        return false;
+    }
+    std::memcpy(&header, data_ + pos_, sizeof(header));
+    const char* payload = data_ + pos_ + sizeof(header);
+    if(header.length < sizeof(LogRecord) || header.length > size_ - pos_ - sizeof(header) ||
+       Crc32c(payload, header.length) != header.crc){
+        torn_ = true;
+        return false;
+    }
+    std::memcpy(record, payload, sizeof(LogRecord));
+    pos_ += sizeof(header) + header.length;
+    return true;
+}
+
+std::string_view LogReader::NextRange(size_t max_records, size_t* num_records) {
+    size_t start = pos_;
+    size_t count = 0;
+    LogRecord record;
+    while(count < max_records && Next(&record)){
+        count++;
+    }
+    if(num_records != nullptr){
+        *num_records = count;
+    }
+    return std::string_view(data_ + start, pos_ - start);
+}
 
 Logger::Logger(std::string log_file_path) : log_file_path_(log_file_path) {
-    ofs.open(log_file_path_, std::ios::app | std::ios::binary);
+    std::vector<LogEntry> legacy_entries;
+    size_t valid_size = 0;
+    bool legacy = false;
+    bool torn = false;
+    {
+        LogReader reader(log_file_path_);
+        legacy = reader.legacy();
+        LogRecord record;
+        while(reader.Next(&record)){}
+        valid_size = reader.offset();
+        torn = reader.torn();
+        if(torn && !legacy){
+            std::cout << "Logger::Logger() - Dropping torn log tail at offset " << valid_size << ": " << log_file_path_ << std::endl;
+        }
+    }
+    if(legacy){
+        // Version 1: bare int64[4] records; a torn last record is left behind.
+        std::ifstream ifs(log_file_path_, std::ios::binary);
+        LogRecord record;
+        while(ifs.read((char*)&record, sizeof(record))){
+            LogEntry entry;
+            entry.set_txid(record.txid);
+            entry.set_address1(record.address1);
+            entry.set_address2(record.address2);
+            entry.set_status(record.status);
+            legacy_entries.push_back(entry);
+        }
+        std::cout << "Logger::Logger() - Converting " << legacy_entries.size() << " entries to log version " << LOG_VERSION
+                  << (torn ? ", dropping a torn last record" : "") << ": " << log_file_path_ << std::endl;
+        // The old log stays in place until its converted copy is on disk.
+        std::string tmp_path = log_file_path_ + ".tmp";
+        if(!write_file(tmp_path, legacy_entries) || ::rename(tmp_path.c_str(), log_file_path_.c_str()) != 0){
+            std::cout << "Logger::Logger() - Failed to convert log file: " << log_file_path_ << std::endl;
+            exit(1);
+        }
+        size_t slash = log_file_path_.rfind('/');
+        int dir_fd = ::open(slash == std::string::npos ? "." : log_file_path_.substr(0, slash + 1).c_str(), O_RDONLY);
+        if(dir_fd >= 0){
+            ::fsync(dir_fd);
+            ::close(dir_fd);
+        }
+        ofs.open(log_file_path_, std::ios::app | std::ios::binary);
+    } else if(valid_size == 0){
+        // New, or torn before the first record: start over with a header.
+        reset_file();
+    } else {
+        // Appends continue right after the last good record.
+        if(::truncate(log_file_path_.c_str(), valid_size) != 0){
+            std::cout << "Logger::Logger() - Failed to truncate log file: " << log_file_path_ << std::endl;
+            exit(1);
+        }
+        ofs.open(log_file_path_, std::ios::app | std::ios::binary);
+    }
     if(!ofs.is_open()){
         std::cout << "Logger::Logger() - Failed to open log file: " << log_file_path << std::endl;
         exit(1);
     }
+    sync_fd_ = ::open(log_file_path_.c_str(), O_RDONLY);
 }
 
-void Logger::clear_logs() {
+Logger::~Logger() {
+    if(sync_fd_ >= 0){
+        ::close(sync_fd_);
+    }
+}
+
+bool Logger::write_file(const std::string& path, const std::vector<LogEntry>& entries) {
+    std::string buffer(sizeof(LogFileHeader), '\0');
+    LogFileHeader* header = reinterpret_cast<LogFileHeader*>(&buffer[0]);
+    std::memcpy(header->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header->version = LOG_VERSION;
+    header->header_size = sizeof(LogFileHeader);
+    for(const auto& entry : entries){
+        LogRecord record = {entry.txid(), entry.address1(), entry.address2(), entry.status()};
+        LogRecordHeader record_header = {sizeof(record), Crc32c(&record, sizeof(record))};
+        buffer.append((const char*)&record_header, sizeof(record_header));
+        buffer.append((const char*)&record, sizeof(record));
+    }
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return false;
+    }
+    size_t written = 0;
+    while(written < buffer.size()){
+        ssize_t n = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if(n <= 0){
+            ::close(fd);
+            return false;
+        }
+        written += n;
+    }
+    bool synced = ::fdatasync(fd) == 0;
+    return ::close(fd) == 0 && synced;
+}
+
+void Logger::reset_file() {
     // Close file if already open
     if(ofs.is_open()){
         ofs.close();
@@ -16,82 +192,96 @@ void Logger::clear_logs() {
 
     // Truncate file
     ofs.open(log_file_path_, std::ios::trunc | std::ios::binary);
+    LogFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header.version = LOG_VERSION;
+    header.header_size = sizeof(header);
+    ofs.write((char*)&header, sizeof(header));
     ofs.close();
 
     // Open file for appending log entries
     ofs.open(log_file_path_, std::ios::app | std::ios::binary);
 }
 
-int Logger::add_entry(int64_t txid, int64_t address1, int64_t address2, int64_t status){
-    std::vector<int64_t> entry = {txid, address1, address2, status};
-    ofs.write((char*)(entry.data()), entry.size() * sizeof(int64_t));
+void Logger::clear_logs() {
+    reset_file();
+}
+
+int Logger::add_entry(int64_t txid, int64_t address1, int64_t address2, int64_t status, bool sync){
+    // Header and payload go out in one write so a crash tears at most this record.
+    char buffer[sizeof(LogRecordHeader) + sizeof(LogRecord)];
+    LogRecord record = {txid, address1, address2, status};
+    LogRecordHeader header = {sizeof(record), Crc32c(&record, sizeof(record))};
+    std::memcpy(buffer, &header, sizeof(header));
+    std::memcpy(buffer + sizeof(header), &record, sizeof(record));
+    ofs.write(buffer, sizeof(buffer));
     ofs.flush();
     if(ofs.fail()){
         std::cout << "Logger::add_entry() - Failed to write to log file: " << log_file_path_ << std::endl;
         return -1;
     }
+    if(sync && ::fdatasync(sync_fd_) != 0){
+        std::cout << "Logger::add_entry() - Failed to sync log file: " << log_file_path_ << std::endl;
+        return -1;
+    }
     #ifdef debug
     std::cout << "Wrote to log file: " << log_file_path_ << std::endl;
     #endif
     return 0;
 }
 
-std::vector<LogEntry> Logger::read_logs(){ 
-
-    std::vector<LogEntry> logs;
-    std::ifstream ifs(log_file_path_, std::ios::binary);
-    if(!ifs.is_open()){
-        std::cout << "Logger::read_logs() - Failed to open log file: " << log_file_path_ << std::endl;
-        exit(1);
-    }
-
-    while(!ifs.eof()){
-        int entry_size = 4;
-        std::vector<int64_t> read_entry(entry_size);
-        // Read 1 log entry
-        ifs.read((char*)(read_entry.data()), read_entry.size() * sizeof(int64_t));
-        
+void Logger::read_entries(LogReader& reader, std::vector<LogEntry>& entries){
+    LogRecord record;
+    while(reader.Next(&record)){
         #ifdef debug
-        std::cout << "Read from log file " << log_file_path_ << " : " << read_entry[0] << " " << read_entry[1] << " " << read_entry[2] << " " << read_entry[3] << std::endl;
+        std::cout << "Read log record: " << record.txid << " " << record.address1 << " " << record.address2 << " " << record.status << std::endl;
         #endif
-        LogEntry entry;
-        entry.set_txid(read_entry[0]);
-        entry.set_address1(read_entry[1]);
-        entry.set_address2(read_entry[2]);
-        entry.set_status(read_entry[3]);
-
-        if(!read_entry[0] == 0){ //to_be_implemented/checked again, because of eof? reading into vector giving one entry with all zeroes even if file is empty
-            logs.push_back(entry);
-        }
+        LogEntry& entry = entries.emplace_back();
+        entry.set_txid(record.txid);
+        entry.set_address1(record.address1);
+        entry.set_address2(record.address2);
+        entry.set_status(record.status);
     }
+}
+
+std::vector<LogEntry> Logger::read_logs(){ 
+    std::vector<LogEntry> logs;
+    LogReader reader(log_file_path_);
+    read_entries(reader, logs);
     return logs;
 }
 
-std::vector<LogEntry> Logger::merge_logs(std::vector<LogEntry>& backup_logs){
+std::vector<LogEntry> Logger::merge_logs(std::vector<LogEntry>& backup_logs, std::vector<LogEntry>& divergent_logs){
     std::vector<LogEntry> self_logs = read_logs();
 
     std::cout << "Primary: " << self_logs.size() << " entries, Backup: " << backup_logs.size() << " entries." << std::endl;
 
     std::cout << "[Recovery]: (Primary) Start merging logs" << std::endl;
-    if(self_logs.empty() || backup_logs.empty()){
-        return self_logs;
+    // Backups apply writes in parallel, so their logs are ordered differently
+    // from the primary's; match entries by txid instead of by position.
+    std::unordered_set<int64_t> self_txids, backup_txids;
+    for(auto& entry : self_logs){
+        self_txids.insert(entry.txid());
+    }
+    for(auto& entry : backup_logs){
+        backup_txids.insert(entry.txid());
     }
-  
-    int self_log_size = self_logs.size();
-    int backup_log_size = backup_logs.size();
-    int tentative_end_pos = std::min(self_log_size,backup_log_size)-1;
-    std::cout << "[Recovery]: (Primary) tentative end pos " + std::to_string(tentative_end_pos) << std::endl;
 
-    // If all txid monotonic? less expensive to search!
-    while(tentative_end_pos >=0 && self_logs[tentative_end_pos].txid() != backup_logs[tentative_end_pos].txid()){
-        tentative_end_pos -= 1;
+    std::vector<LogEntry> missing_logs;
+    for(auto& entry : self_logs){
+        if(!backup_txids.count(entry.txid())){
+            missing_logs.push_back(std::move(entry));
+        }
     }
-    std::cout << "[Recovery]: (Primary) Final end pos " + std::to_string(tentative_end_pos) << std::endl;
-    if (tentative_end_pos >= 0){ // Check not required?
-        self_logs.erase(self_logs.begin(), self_logs.begin() + tentative_end_pos + 1);
+    for(auto& entry : backup_logs){
+        if(!self_txids.count(entry.txid())){
+            divergent_logs.push_back(std::move(entry));
+        }
     }
+    std::cout << "[Recovery]: (Primary) Missing on backup: " << missing_logs.size() << ", only on backup: " << divergent_logs.size() << std::endl;
 
-    return self_logs;
+    return missing_logs;
 }
 
 
@@ -99,11 +289,8 @@ int Logger::refresh_logs(std::vector<LogEntry>& fresh_logs){
     #ifdef debug
     std::cout << "[Recovery]: (Primary) Refreshing logs" << std::endl;
     #endif
-    ofs.close();
-    ofs.open(log_file_path_, std::ios::trunc | std::ios::binary); //to_be_implemented - to check another way to remove entries and start fresh - delete?
-    ofs.close();
-    ofs.open(log_file_path_, std::ios::app | std::ios::binary);
-    for(auto entry:fresh_logs){
+    reset_file();
+    for(const auto& entry:fresh_logs){
         add_entry(entry.txid(), entry.address1(), entry.address2(), entry.status());
     }
     #ifdef debug
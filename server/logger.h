@@ -2,6 +2,7 @@
 #define LOGGER_H
 
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <iostream>
 #include <vector>
@@ -10,26 +11,106 @@
 
 using blobstore::LogEntry;
 
+// Log file format, version 2 (all integers little endian):
+//   file header: "BLOBLOG\0" | uint32 version | uint32 header size
+//   record:      uint32 payload length | uint32 crc32c(payload) | payload
+//   payload:     int64 txid | int64 address1 | int64 address2 | int64 status
+// Version 1 logs were bare payloads; they are converted when opened, into a
+// new file that replaces the old one once it is on disk.
+#define LOG_MAGIC "BLOBLOG"
+#define LOG_VERSION 2
+
+// Record status: a write of blocks address1 and address2 (-1 for an aligned
+// write), or a trim of blocks [address1, address2).
+#define LOG_STATUS_WRITE 1
+#define LOG_STATUS_TRIM 2
+
+struct LogFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+};
+
+struct LogRecordHeader {
+  uint32_t length;
+  uint32_t crc;
+};
+
+struct LogRecord {
+  int64_t txid;
+  int64_t address1;
+  int64_t address2;
+  int64_t status;
+};
+
+// Iterates the records of a log file (memory-mapped) or of a buffer of
+// framed records, without allocating. Stops at the first torn record.
+class LogReader {
+public:
+  explicit LogReader(const std::string& log_file_path);
+  LogReader(const char* data, size_t size);
+  ~LogReader();
+  LogReader(const LogReader&) = delete;
+  LogReader& operator=(const LogReader&) = delete;
+
+  // next record; false at the end or at a torn/corrupt record
+  bool Next(LogRecord* record);
+
+  // up to max_records verified records from the current position, as one
+  // contiguous range of framed records; empty at the end
+  std::string_view NextRange(size_t max_records, size_t* num_records = nullptr);
+
+  // stopped at a torn/corrupt record rather than at the end
+  bool torn() const { return torn_; }
+  // the file has no version 2 header
+  bool legacy() const { return legacy_; }
+  // offset just past the last good record
+  size_t offset() const { return pos_; }
+
+private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t pos_ = 0;
+  bool torn_ = false;
+  bool legacy_ = false;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+};
+
 class Logger {
 private:
   std::string log_file_path_;
   std::ofstream ofs;
+  // for fdatasync; the log file keeps its inode when it is reset
+  int sync_fd_ = -1;
+
+  // truncate the log file and write a fresh header
+  void reset_file();
+  // write a complete log of entries to path and sync it
+  static bool write_file(const std::string& path, const std::vector<LogEntry>& entries);
 
 public:
   Logger(std::string log_file_path);
+  ~Logger();
+
+  const std::string& log_file_path() { return log_file_path_; }
 
   // clear log file
   void clear_logs();
 
-  // add a log entry to the log file
-  int add_entry(int64_t txid, int64_t address1, int64_t address2, int64_t status);
+  // add a log entry to the log file; with sync, wait until it is on disk
+  int add_entry(int64_t txid, int64_t address1, int64_t address2, int64_t status, bool sync = false);
 
   // read the entire log file
   std::vector<LogEntry> read_logs();
 
-  // merge log entries from backup on primary and return the merged log entries
-  std::vector<LogEntry> merge_logs(std::vector<LogEntry>& backup_logs);
+  // append the remaining records of reader to entries
+  static void read_entries(LogReader& reader, std::vector<LogEntry>& entries);
+
+  // merge log entries from backup on primary and return the entries the backup
+  // is missing; entries only the backup has are moved to divergent_logs
+  std::vector<LogEntry> merge_logs(std::vector<LogEntry>& backup_logs, std::vector<LogEntry>& divergent_logs);
   int refresh_logs(std::vector<LogEntry>& fresh_logs);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,109 @@
+// Checks that Logger recovers what a crash or an older version left on disk:
+// torn tails of version 1 and version 2 logs, version 1 conversion, and a
+// torn header.
+#include "logger.h"
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+string log_prefix_ = "[LoggerTest]:";
+string test_dir;
+int failures = 0;
+
+void check(bool ok, const string& test, const string& what) {
+  if (!ok) {
+    fprintf(stderr, "%s %s: %s\n", log_prefix_.c_str(), test.c_str(), what.c_str());
+    failures++;
+  }
+}
+
+void write_raw(const string& path, const string& data) {
+  ofstream ofs(path, ios::binary | ios::trunc);
+  ofs.write(data.data(), data.size());
+}
+
+string read_raw(const string& path) {
+  ifstream ifs(path, ios::binary);
+  return string(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+}
+
+// n version 1 records: bare int64[4], txids 1..n
+string legacy_records(int n) {
+  string data;
+  for (int64_t i = 1; i <= n; i++) {
+    LogRecord record = {i, i * 10, -1, LOG_STATUS_WRITE};
+    data.append((const char*)&record, sizeof(record));
+  }
+  return data;
+}
+
+// The log holds txids 1..n in order, with a version 2 header, and takes
+// further entries.
+void check_log(const string& test, const string& path, int n) {
+  {
+    Logger logger(path);
+    vector<LogEntry> entries = logger.read_logs();
+    check(entries.size() == (size_t)n, test, "expected " + to_string(n) + " entries, read " + to_string(entries.size()));
+    for (size_t i = 0; i < entries.size(); i++) {
+      check(entries[i].txid() == (int64_t)i + 1 && entries[i].address1() == ((int64_t)i + 1) * 10, test,
+            "wrong entry " + to_string(i));
+    }
+    check(read_raw(path).compare(0, sizeof(LOG_MAGIC), LOG_MAGIC, sizeof(LOG_MAGIC)) == 0, test, "no version 2 header");
+    check(logger.add_entry(n + 1, (n + 1) * 10, -1, LOG_STATUS_WRITE) == 0, test, "append failed");
+  }
+  Logger logger(path);
+  check(logger.read_logs().size() == (size_t)n + 1, test, "appended entry lost on reopen");
+  check(!filesystem::exists(path + ".tmp"), test, "conversion left its temporary file");
+}
+
+void test_legacy_conversion() {
+  string path = test_dir + "/legacy";
+  write_raw(path, legacy_records(5));
+  check_log("legacy conversion", path, 5);
+}
+
+void test_legacy_torn_tail() {
+  string path = test_dir + "/legacy_torn";
+  string data = legacy_records(3);
+  write_raw(path, data + data.substr(0, 10));
+  check_log("legacy torn tail", path, 3);
+}
+
+void test_torn_tail() {
+  string path = test_dir + "/torn";
+  {
+    Logger logger(path);
+    for (int64_t i = 1; i <= 3; i++) {
+      logger.add_entry(i, i * 10, -1, LOG_STATUS_WRITE);
+    }
+  }
+  string data = read_raw(path);
+  write_raw(path, data + data.substr(sizeof(LogFileHeader), 10));
+  check_log("torn tail", path, 3);
+}
+
+void test_torn_header() {
+  string path = test_dir + "/torn_header";
+  write_raw(path, string(LOG_MAGIC, 5));
+  check_log("torn header", path, 0);
+}
+
+int main(int argc, char* argv[]) {
+  test_dir = filesystem::temp_directory_path().string() + "/logger_test_" + to_string(getpid());
+  filesystem::create_directories(test_dir);
+
+  test_legacy_conversion();
+  test_legacy_torn_tail();
+  test_torn_tail();
+  test_torn_header();
+
+  filesystem::remove_all(test_dir);
+  fprintf(stderr, "%s %s\n", log_prefix_.c_str(), failures == 0 ? "All tests passed." : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include "merkle_tree.h"
+
+namespace {
+
+// splitmix64 finalizer.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+int Shift(int level) {
+  return MERKLE_LEAF_BITS + level * MERKLE_FANOUT_BITS;
+}
+
+}  // namespace
+
+uint64_t MerkleTree::HashBlock(const std::string& data) {
+  // FNV-1a; a block hash is never 0, which stands for an unwritten block.
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(unsigned char c : data) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+void MerkleTree::MarkDirty(int64_t block) {
+  std::lock_guard<std::mutex> lock(dirty_mutex_);
+  dirty_.insert(block);
+}
+
+void MerkleTree::Refresh(const std::function<bool(int64_t, std::string*)>& read) {
+  std::lock_guard<std::mutex> refresh_lock(refresh_mutex_);
+  std::unordered_set<int64_t> dirty;
+  {
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    dirty.swap(dirty_);
+  }
+  // A block written after it was read here is marked dirty again.
+  std::string data;
+  for(int64_t block : dirty) {
+    uint64_t hash = read(block, &data) ? HashBlock(data) : 0;
+    Update(block, hash);
+  }
+}
+
+std::vector<std::pair<int64_t, uint64_t>> MerkleTree::Children(int level, int64_t node) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const std::map<int64_t, uint64_t>& children = level == 0 ? blocks_ : levels_[level - 1];
+  int bits = level == 0 ? MERKLE_LEAF_BITS : MERKLE_FANOUT_BITS;
+  return std::vector<std::pair<int64_t, uint64_t>>(children.lower_bound(node << bits),
+                                                    children.lower_bound((node + 1) << bits));
+}
+
+void MerkleTree::Update(int64_t block, uint64_t hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = blocks_.find(block);
+  uint64_t old_hash = it == blocks_.end() ? 0 : it->second;
+  if(old_hash == hash) {
+    return;
+  }
+  if(hash == 0) {
+    blocks_.erase(it);
+  } else {
+    blocks_[block] = hash;
+  }
+  // Node hashes are the XOR of Mix(block, hash) over the blocks they cover,
+  // so the old contribution is taken out and the new one put in.
+  uint64_t delta = (old_hash == 0 ? 0 : Mix(block ^ Mix(old_hash))) ^ (hash == 0 ? 0 : Mix(block ^ Mix(hash)));
+  for(int level = 0; level < MERKLE_LEVELS; level++) {
+    int64_t node = block >> Shift(level);
+    uint64_t& node_hash = levels_[level][node];
+    node_hash ^= delta;
+    if(node_hash == 0) {
+      levels_[level].erase(node);
+    }
+  }
+}
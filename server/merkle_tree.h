@@ -0,0 +1,53 @@
+#ifndef MERKLE_TREE_H
+#define MERKLE_TREE_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Tree shape: a level 0 node (leaf) covers 2^MERKLE_LEAF_BITS blocks, every
+// node above has 2^MERKLE_FANOUT_BITS children. The single node (0) of the top
+// level, MERKLE_LEVELS - 1, covers 2^34 blocks.
+#define MERKLE_LEAF_BITS 6
+#define MERKLE_FANOUT_BITS 4
+#define MERKLE_LEVELS 8
+
+// Hash tree over the block contents of a store, for comparing replicas (see
+// BlobServer::AntiEntropy). A node's hash combines (block, content hash) of
+// every block it covers, so a block change updates one node per level.
+// Unwritten blocks and empty nodes are absent (hash 0).
+//
+// Writes only mark blocks dirty; they are read and hashed by Refresh, before
+// the tree is compared.
+class MerkleTree {
+public:
+  void MarkDirty(int64_t block);
+
+  // Rehash the dirty blocks; read returns a block's contents and false if it
+  // was never written.
+  void Refresh(const std::function<bool(int64_t, std::string*)>& read);
+
+  // (id, hash) of the non-empty children of node at level, in id order; the
+  // children of a leaf are blocks.
+  std::vector<std::pair<int64_t, uint64_t>> Children(int level, int64_t node);
+
+  static uint64_t HashBlock(const std::string& data);
+
+private:
+  void Update(int64_t block, uint64_t hash);
+
+  // Serializes Refresh, so that an older read never overwrites a newer hash.
+  std::mutex refresh_mutex_;
+  std::mutex dirty_mutex_;
+  std::unordered_set<int64_t> dirty_;
+  std::mutex mutex_;
+  std::map<int64_t, uint64_t> blocks_;
+  std::map<int64_t, uint64_t> levels_[MERKLE_LEVELS];
+};
+
+#endif // MERKLE_TREE_H
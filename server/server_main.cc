@@ -1,4 +1,6 @@
 #include "blob_server.h"
+#include "blob_service.h"
+#include "resources/utils.h"
 #include "protos/blobstore.grpc.pb.h"
 #include <cstdio>
 #include <string>
@@ -22,184 +24,6 @@
 
 using grpc::Server;
 using grpc::ServerBuilder;
-using grpc::ServerContext;
-// using grpc::grpc::Status;
-using blobstore::BlobStore;
-using blobstore::ReadRequest;
-using blobstore::ReadResponse;
-using blobstore::WriteRequest;
-using blobstore::WriteResponse;
-using blobstore::StoreInternal;
-using blobstore::PingRequest;
-using blobstore::PingResponse;
-using blobstore::PrepareRequest;
-using blobstore::PrepareResponse;
-using blobstore::CommitRequest;
-using blobstore::CommitResponse;
-using blobstore::RecoveryRequest;
-using blobstore::RecoveryResponse;
-using blobstore::RecoveryRecord;
-using blobstore::LogEntry;
-
-class BlobStoreImpl final : public BlobStore::Service {
-  private: 
-  std::shared_ptr<BlobServer>  blobserver_;
-  grpc::Status handleStatusCode(absl::Status status){
-    if (status != absl::OkStatus()) {
-        if(status.code() == absl::StatusCode::kNotFound) {
-          return grpc::Status(grpc::StatusCode::NOT_FOUND, "Please contact other server");
-        } else {
-            return grpc::Status(grpc::StatusCode::INTERNAL, "Internal error");
-        }
-    } else {
-      return grpc::Status::OK;
-    }
-  }
-  public:
-  BlobStoreImpl(std::shared_ptr<BlobServer> blobserver) : blobserver_(blobserver) {}
-  grpc::Status Read(ServerContext* context, const ReadRequest* request,
-              ReadResponse* response) override {
-    #ifdef debug
-    std::cout << "[Read]: " << request->address() << std::endl;
-    #endif
-    absl::Status status = blobserver_->Read(request->address(), response->mutable_data());
-    
-    // Redirect to Primary by sending primary address
-    if(status.code() == absl::StatusCode::kNotFound)
-      response->set_primary_ip(blobserver_->get_other_ip());
-    grpc::Status clientStatus = handleStatusCode(status);
-    return clientStatus;
-  }
-
-  grpc::Status Write(ServerContext* context, const WriteRequest* request,
-               WriteResponse* response) override {
-    #ifdef debug
-    std::cout << "[Write]: " << request->address() << std::endl;
-    #endif
-    // return StoreInternal::Write(request, response);
-    absl::Status status = blobserver_->Write(request->address(), request->data());
-    
-    // Redirect to Primary by sending primary address
-    if(status.code() == absl::StatusCode::kNotFound)
-      response->set_primary_ip(blobserver_->get_other_ip());
-
-    grpc::Status clientStatus = handleStatusCode(status);
-    return clientStatus;
-  }
-};
-
-class StoreInternalImpl final : public StoreInternal::Service {
-  private: 
-  std::shared_ptr<BlobServer>  blobserver_;
-  public:
-  StoreInternalImpl(std::shared_ptr<BlobServer> blobserver) : blobserver_(blobserver) {}
-  grpc::Status Ping(ServerContext* context, const PingRequest* request,
-              PingResponse* response) override {
-    // return ::Ping(request, response);
-    return grpc::Status::OK;
-  }
-
-  grpc::Status Prepare(ServerContext* context, const PrepareRequest* request,
-                 PrepareResponse* response) override {
-    #ifdef debug
-    std::cout << "Prepare for Backup" << std::endl;
-    #endif
-    #ifdef performance_measure
-    auto lock_acquire_start = std::chrono::high_resolution_clock::now();
-    #endif
-
-    // Acquire lock for commit to isolate request processing from recovery
-    std::shared_lock<std::shared_timed_mutex> lock(blobserver_->getMutex());
-    #ifdef performance_measure
-    auto lock_acquire_end = std::chrono::high_resolution_clock::now();
-    std::cout << "[Perf][LockAcquire]: " << std::chrono::duration_cast<std::chrono::microseconds>(lock_acquire_end - lock_acquire_start).count() << " us" << std::endl;
-    #endif
-    int status = blobserver_->PrepareLocal(request->address(), request->data());
-
-    if (status != 0) {
-      return grpc::Status(grpc::StatusCode::INTERNAL, "Prepare failed");
-    } else {
-      return grpc::Status::OK;
-    }
-  }
-
-  grpc::Status Commit(ServerContext* context, const CommitRequest* request,
-                CommitResponse* response) override {
-    #ifdef debug
-    std::cout << "Commit for Backup" << std::endl;
-    #endif
-
-    #ifdef performance_measure
-    auto lock_acquire_start = std::chrono::high_resolution_clock::now();
-    #endif
-
-    // Acquire lock for commit to isolate request processing from recovery
-    std::shared_lock<std::shared_timed_mutex> lock(blobserver_->getMutex());
-    #ifdef performance_measure
-    auto lock_acquire_end = std::chrono::high_resolution_clock::now();
-    std::cout << "[Perf][LockAcquire]: " << std::chrono::duration_cast<std::chrono::microseconds>(lock_acquire_end - lock_acquire_start).count() << " us" << std::endl;
-    #endif
-    int status = blobserver_->CommitLocal(request->txid(), request->address());
-
-    if (status != 0) {
-      return grpc::Status(grpc::StatusCode::INTERNAL, "Commit failed");
-    } else {
-      return grpc::Status::OK;
-    }
-  }
-
-  grpc::Status Recovery(ServerContext* context, const RecoveryRequest* request,
-                  RecoveryResponse* response) override {
-    // Pause writing/reading new data (Ensure no inflight requests)
-    std::cout << "Acquire lock to pause all read/write requests and start recovery process" << std::endl;
-    std::unique_lock<std::shared_timed_mutex> recovery_lock(blobserver_->getMutex());
-
-    #ifdef performance_measure
-    auto log_ship_start = std::chrono::high_resolution_clock::now();
-    #endif
-
-    // Set state to Primary if not already
-    if(blobserver_->get_state() == BlobServerState::BACKUP) {
-      blobserver_->set_state(BlobServerState::PRIMARY);
-    }
-
-    std::cout << "[Recovery]: (Primary) Received recovery request" << std::endl;
-    std::vector<LogEntry> backup_logs;
-    for(const LogEntry& i: request->entry() ){
-      backup_logs.push_back(i);
-    }
-    // merge with logger, update local log
-    std::cout << "[Recovery]: (Primary) Start merging log" << std::endl;
-    std::vector<LogEntry> fresh_logs = blobserver_->MergeAndRefreshLogsLocal(backup_logs); //Removing earlier log, considering one server is up untill recovery
-
-    #ifdef performance_measure
-    auto merge_and_refresh_logs_end = std::chrono::high_resolution_clock::now();
-    auto create_recovery_records_start = std::chrono::high_resolution_clock::now();
-    #endif
-
-    // Step 3: Create response structure to send to backup and send logs
-    //Create response with files - data from fresh_logs
-    std::cout << "[Recovery]: (Primary) Create Response Records" << std::endl;
-    std::vector<RecoveryRecord> recovery_records = blobserver_->CreateRecoveryResponse(fresh_logs);
-
-    response->mutable_records()->Assign(recovery_records.begin(), recovery_records.end());
-    #ifdef debug
-    std::cout << "[Recovery]: (Primary) Send Recovery Response: " << recovery_records.size() << " log records." << std::endl;
-    #endif
-    // Set other server state(backup) to be alive
-    blobserver_->setBackupAlive(true);
-
-    #ifdef performance_measure
-    auto create_recovery_records_end = std::chrono::high_resolution_clock::now();
-    std::cout << "[Perf][MergeRefreshLogs]: " << std::chrono::duration_cast<std::chrono::milliseconds>(merge_and_refresh_logs_end - log_ship_start).count() << " ms" << std::endl;
-    std::cout << "[Perf][CreateRecoveryRecords]: " << std::chrono::duration_cast<std::chrono::milliseconds>(create_recovery_records_end - create_recovery_records_start).count() << " ms" << std::endl;
-    #endif
-
-    std::cout << "Releasing the recovery lock to allow normal request processing" << std::endl;
-    return grpc::Status::OK;
-  }
-
-};
 
 void StartBlockingServer(std::shared_ptr<grpc::Server> server){
   std::cout << "Starting Server" << std::endl;
@@ -214,8 +38,74 @@ void InitializeServer(std::shared_ptr<BlobServer> blobserver){
   blobserver->ServerInit();
 }
 
-void RunServer(std::string server_address, std::string other_address, std::string root_dir_path) {
-  std::shared_ptr<BlobServer> blobserver(new BlobServer(root_dir_path, server_address, other_address));
+// Read tunables from a key=value server config file; missing keys keep their defaults.
+int ParseServerOptions(const std::string& config_file, ServerOptions& options) {
+  Utils utils;
+  if (utils.parse_config_file(config_file) != 0) {
+    return -1;
+  }
+  if (utils.config.count("num_shards")) {
+    options.num_shards = atoi(utils.config["num_shards"].c_str());
+  }
+  if (utils.config.count("replication_quorum")) {
+    options.replication_quorum = atoi(utils.config["replication_quorum"].c_str());
+  }
+  if (utils.config.count("async_apply")) {
+    options.async_apply = atoi(utils.config["async_apply"].c_str()) != 0;
+  }
+  if (utils.config.count("replication_channels")) {
+    options.replication_channels = atoi(utils.config["replication_channels"].c_str());
+  }
+  if (utils.config.count("replication_stream")) {
+    options.replication_stream = atoi(utils.config["replication_stream"].c_str()) != 0;
+  }
+  if (utils.config.count("compression")) {
+    options.compression = atoi(utils.config["compression"].c_str()) != 0;
+  }
+  if (utils.config.count("compression_min_bytes")) {
+    options.compression_min_bytes = atoi(utils.config["compression_min_bytes"].c_str());
+  }
+  if (utils.config.count("anti_entropy_interval_s")) {
+    options.anti_entropy_interval_s = atoi(utils.config["anti_entropy_interval_s"].c_str());
+  }
+  if (utils.config.count("scrub_blocks_per_s")) {
+    options.scrub_blocks_per_s = atoi(utils.config["scrub_blocks_per_s"].c_str());
+  }
+  if (utils.config.count("backup_reads")) {
+    options.backup_reads = atoi(utils.config["backup_reads"].c_str()) != 0;
+  }
+  if (utils.config.count("online_recovery")) {
+    options.online_recovery = atoi(utils.config["online_recovery"].c_str()) != 0;
+  }
+  if (utils.config.count("coalesce_writes")) {
+    options.coalesce_writes = atoi(utils.config["coalesce_writes"].c_str()) != 0;
+  }
+  if (utils.config.count("lock_free_reads")) {
+    options.lock_free_reads = atoi(utils.config["lock_free_reads"].c_str()) != 0;
+  }
+  if (utils.config.count("snapshot_max_mb")) {
+    options.snapshot_max_mb = atoi(utils.config["snapshot_max_mb"].c_str());
+  }
+  if (utils.config.count("snapshot_ttl_s")) {
+    options.snapshot_ttl_s = atoi(utils.config["snapshot_ttl_s"].c_str());
+  }
+  if (utils.config.count("heatmap_interval_s")) {
+    options.heatmap_interval_s = atoi(utils.config["heatmap_interval_s"].c_str());
+  }
+  if (utils.config.count("admission_limit")) {
+    options.admission_limit = atoi(utils.config["admission_limit"].c_str());
+  }
+  if (utils.config.count("admission_read_latency_us")) {
+    options.admission_read_latency_us = atoi(utils.config["admission_read_latency_us"].c_str());
+  }
+  if (utils.config.count("admission_write_latency_us")) {
+    options.admission_write_latency_us = atoi(utils.config["admission_write_latency_us"].c_str());
+  }
+  return 0;
+}
+
+void RunServer(std::string server_address, std::string other_address, std::string root_dir_path, ServerOptions options) {
+  std::shared_ptr<BlobServer> blobserver(new BlobServer(root_dir_path, server_address, other_address, options));
   BlobStoreImpl blobstore_service(blobserver);
   StoreInternalImpl store_internal_service(blobserver);
 
@@ -240,8 +130,8 @@ void RunServer(std::string server_address, std::string other_address, std::strin
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <self-ip:port> <other-ip:port> <root-dir-path>\n", argv[0]);
+  if (argc != 4 && argc != 5) {
+    fprintf(stderr, "Usage: %s <self-ip:port> <other-ip:port>[,<other-ip:port>...] <root-dir-path> [server-conf-file]\n", argv[0]);
     return 1;
   }
   if ((getuid() == 0) || (geteuid() == 0)) {
@@ -256,7 +146,29 @@ int main(int argc, char* argv[]) {
   std::string other_ip = argv[2];
   std::string root_dir_path = argv[3];
   std::cout << "Self IP: " << self_ip << std::endl;
-  std::cout << "Other IP: " << other_ip << std::endl;
-  RunServer(self_ip, other_ip, root_dir_path);
+  std::cout << "Other IPs: " << other_ip << std::endl;
+  ServerOptions options;
+  if (argc == 5 && ParseServerOptions(argv[4], options) != 0) {
+    fprintf(stderr, "Failed to parse server config file %s\n", argv[4]);
+    return 1;
+  }
+  std::cout << "Shards: " << options.num_shards << std::endl;
+  std::cout << "Replication quorum: " << options.replication_quorum << std::endl;
+  std::cout << "Async apply: " << options.async_apply << std::endl;
+  std::cout << "Replication channels: " << options.replication_channels << std::endl;
+  std::cout << "Replication stream: " << options.replication_stream << std::endl;
+  std::cout << "Compression: " << options.compression << " (min " << options.compression_min_bytes << " bytes)" << std::endl;
+  std::cout << "Anti-entropy interval: " << options.anti_entropy_interval_s << " s" << std::endl;
+  std::cout << "Scrub rate: " << options.scrub_blocks_per_s << " blocks/s" << std::endl;
+  std::cout << "Backup reads: " << options.backup_reads << std::endl;
+  std::cout << "Online recovery: " << options.online_recovery << std::endl;
+  std::cout << "Coalesce writes: " << options.coalesce_writes << std::endl;
+  std::cout << "Lock-free reads: " << options.lock_free_reads << std::endl;
+  std::cout << "Snapshots: up to " << options.snapshot_max_mb << " MB of images, " << options.snapshot_ttl_s
+            << " s" << std::endl;
+  std::cout << "Heatmap interval: " << options.heatmap_interval_s << " s" << std::endl;
+  std::cout << "Admission limit: " << options.admission_limit << " (latency target read "
+            << options.admission_read_latency_us << " us, write " << options.admission_write_latency_us << " us)" << std::endl;
+  RunServer(self_ip, other_ip, root_dir_path, options);
   return 0;
 }
\ No newline at end of file
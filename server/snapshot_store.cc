@@ -0,0 +1,152 @@
+#include "snapshot_store.h"
+#include <algorithm>
+#include <iostream>
+
+SnapshotStore::SnapshotStore(int64_t max_bytes, int ttl_s)
+    : max_bytes_(max_bytes), ttl_(std::max(1, ttl_s)) {}
+
+int64_t SnapshotStore::Create(int64_t seq) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ExpireLocked();
+  int64_t id = next_id_++;
+  snapshots_[id] = Snapshot{seq, std::chrono::steady_clock::now()};
+  live_ = snapshots_.size();
+  return id;
+}
+
+bool SnapshotStore::Release(int64_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ExpireLocked();
+  if(snapshots_.erase(id) == 0) {
+    return false;
+  }
+  live_ = snapshots_.size();
+  CollectLocked();
+  return true;
+}
+
+int64_t SnapshotStore::Sequence(int64_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ExpireLocked();
+  auto it = snapshots_.find(id);
+  return it == snapshots_.end() ? -1 : it->second.seq;
+}
+
+// Snapshots are in sequence order, so the newest decides: the older ones
+// read images kept before it was created.
+bool SnapshotStore::NeedsImage(int64_t block) {
+  if(live_ == 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if(snapshots_.empty()) {
+    return false;
+  }
+  int64_t newest_seq = snapshots_.rbegin()->second.seq;
+  auto it = versions_.find(block);
+  return it == versions_.end() || it->second.empty() || it->second.back().replaced_seq <= newest_seq;
+}
+
+void SnapshotStore::Keep(int64_t block, int64_t seq, absl::Status status, std::string data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ExpireLocked();
+  while(!snapshots_.empty() && bytes_ + (int64_t)data.size() > max_bytes_) {
+    ExpireOldestLocked();
+  }
+  if(snapshots_.empty()) {
+    return;
+  }
+  bytes_ += data.size();
+  num_versions_++;
+  kept_++;
+  versions_[block].push_back(Version{seq, std::move(status), std::move(data)});
+}
+
+bool SnapshotStore::Find(int64_t block, int64_t seq, absl::Status* status, std::string* data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = versions_.find(block);
+  if(it == versions_.end()) {
+    return false;
+  }
+  for(const Version& version : it->second) {
+    if(version.replaced_seq > seq) {
+      *status = version.status;
+      *data = version.data;
+      return true;
+    }
+  }
+  return false;
+}
+
+SnapshotStats SnapshotStore::get_stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  SnapshotStats stats;
+  stats.snapshots = snapshots_.size();
+  stats.versions = num_versions_;
+  stats.bytes = bytes_;
+  stats.max_bytes = max_bytes_;
+  stats.kept = kept_;
+  stats.expired = expired_;
+  return stats;
+}
+
+void SnapshotStore::ExpireLocked() {
+  auto deadline = std::chrono::steady_clock::now() - ttl_;
+  bool expired = false;
+  while(!snapshots_.empty() && snapshots_.begin()->second.created < deadline) {
+    std::cout << "[Snapshot] Snapshot " << snapshots_.begin()->first << " expired after "
+              << ttl_.count() << " s" << std::endl;
+    snapshots_.erase(snapshots_.begin());
+    expired_++;
+    expired = true;
+  }
+  if(expired) {
+    live_ = snapshots_.size();
+    CollectLocked();
+  }
+}
+
+void SnapshotStore::ExpireOldestLocked() {
+  std::cout << "[Snapshot] Snapshot " << snapshots_.begin()->first << " expired: its images would exceed "
+            << max_bytes_ << " bytes" << std::endl;
+  snapshots_.erase(snapshots_.begin());
+  expired_++;
+  live_ = snapshots_.size();
+  CollectLocked();
+}
+
+// A snapshot at seq reads the first image replaced after it, so an image is
+// read if a live snapshot lies between the commit that replaced the image
+// before it and the one that replaced it.
+void SnapshotStore::CollectLocked() {
+  if(snapshots_.empty()) {
+    versions_.clear();
+    num_versions_ = 0;
+    bytes_ = 0;
+    return;
+  }
+  std::vector<int64_t> seqs;
+  for(auto& entry : snapshots_) {
+    seqs.push_back(entry.second.seq);
+  }
+  for(auto it = versions_.begin(); it != versions_.end();) {
+    std::vector<Version> kept;
+    int64_t previous_seq = -1;
+    for(Version& version : it->second) {
+      auto reader = std::lower_bound(seqs.begin(), seqs.end(), previous_seq);
+      if(reader != seqs.end() && *reader < version.replaced_seq) {
+        previous_seq = version.replaced_seq;
+        kept.push_back(std::move(version));
+      } else {
+        num_versions_--;
+        bytes_ -= version.data.size();
+      }
+    }
+    if(kept.empty()) {
+      it = versions_.erase(it);
+    } else {
+      it->second = std::move(kept);
+      it++;
+    }
+  }
+}
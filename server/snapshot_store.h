@@ -0,0 +1,96 @@
+#ifndef SNAPSHOT_STORE_H
+#define SNAPSHOT_STORE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "absl/status/status.h"
+
+// What a SnapshotStore holds, and has dropped.
+struct SnapshotStats {
+  int64_t snapshots = 0;
+  // Block images kept for the snapshots, and their bytes.
+  int64_t versions = 0;
+  int64_t bytes = 0;
+  int64_t max_bytes = 0;
+  // Since start-up: images kept, and snapshots that expired before they were
+  // released.
+  int64_t kept = 0;
+  int64_t expired = 0;
+};
+
+// Point-in-time views of the store (BlobServer::CreateSnapshot). Commits are
+// numbered in the order their images become visible, and a snapshot is the
+// commit sequence number at its creation. Before a commit replaces an image
+// that a live snapshot reads, the image is kept here under the sequence
+// number of that commit. A snapshot at seq reads a block as the first image
+// kept for it by a commit after seq, or else as the block is now.
+//
+// The images are kept in memory, up to max_bytes of them: when one more
+// would not fit, the oldest snapshots expire until it does. Snapshots also
+// expire ttl_s seconds after their creation, so that clients that never
+// release theirs do not hold images forever. Images no live snapshot reads
+// are dropped.
+class SnapshotStore {
+  public:
+  SnapshotStore(int64_t max_bytes, int ttl_s);
+
+  // A new snapshot at commit sequence seq; its id, from 1 up.
+  int64_t Create(int64_t seq);
+  // False if the snapshot is unknown or expired.
+  bool Release(int64_t id);
+  // The commit sequence of a live snapshot, or -1.
+  int64_t Sequence(int64_t id);
+
+  bool HasSnapshots() {
+    return live_ > 0;
+  }
+  // Whether a commit about to replace the image of block has to keep it.
+  bool NeedsImage(int64_t block);
+  // Keep the image of block that the commit numbered seq replaces: status is
+  // that of reading it (NotFound if never written) and data its contents.
+  void Keep(int64_t block, int64_t seq, absl::Status status, std::string data);
+  // The image of block a snapshot at seq reads, if it was kept.
+  bool Find(int64_t block, int64_t seq, absl::Status* status, std::string* data);
+
+  SnapshotStats get_stats();
+
+  private:
+  struct Version {
+    // Sequence number of the commit that replaced the image.
+    int64_t replaced_seq;
+    absl::Status status;
+    std::string data;
+  };
+  struct Snapshot {
+    int64_t seq;
+    std::chrono::steady_clock::time_point created;
+  };
+
+  void ExpireLocked();
+  void ExpireOldestLocked();
+  // Drop the images no live snapshot reads.
+  void CollectLocked();
+
+  const int64_t max_bytes_;
+  const std::chrono::seconds ttl_;
+  std::mutex mutex_;
+  // By id: oldest first, and in commit sequence order.
+  std::map<int64_t, Snapshot> snapshots_;
+  int64_t next_id_ = 1;
+  // Per block, in commit sequence order.
+  std::unordered_map<int64_t, std::vector<Version>> versions_;
+  int64_t num_versions_ = 0;
+  int64_t bytes_ = 0;
+  int64_t kept_ = 0;
+  int64_t expired_ = 0;
+  // Live snapshots; commits check it without the mutex.
+  std::atomic<int64_t> live_{0};
+};
+
+#endif // SNAPSHOT_STORE_H